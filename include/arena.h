@@ -0,0 +1,25 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/*
+ * Bump allocator for the parse state of an image. Memory is only given back
+ * all at once: jpeg_arena_reset keeps it for the next image, merged into a
+ * single chunk, and jpeg_arena_destroy frees it.
+ */
+struct jpeg_arena_chunk;
+
+struct jpeg_arena {
+    /* Chunk allocations are taken from, earlier ones follow through next */
+    struct jpeg_arena_chunk* chunk;
+};
+
+void jpeg_arena_init(struct jpeg_arena* arena);
+void jpeg_arena_destroy(struct jpeg_arena* arena);
+
+/* Invalidate all allocations, keeping the memory */
+void jpeg_arena_reset(struct jpeg_arena* arena);
+
+/* Uninitialised memory suitably aligned for any type, 0 if out of memory */
+void* jpeg_arena_alloc(struct jpeg_arena* arena, long size);
+
+#endif
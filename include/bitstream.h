@@ -0,0 +1,242 @@
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define E_EMPTY -1
+#define E_FULL -2
+#define E_RESTART -3
+
+/*
+ * Entropy-coded input, read through a 64-bit buffer of unstuffed bits
+ *
+ * Bytes are loaded several at a time; 0xFF00 is unstuffed while loading and
+ * loading stops in front of any other marker. Bits requested beyond that
+ * point make the read fail with E_RESTART (RSTn, the stream then continues
+ * after the marker) or E_EMPTY (EOI or end of data).
+ */
+struct jpeg_ibitstream {
+    /* Unread bits, aligned to the most significant bit */
+    uint64_t buffer;
+    int bits;
+
+    unsigned char* at;
+    long size_bytes;
+
+    /* Unstuffed bits loaded so far, loaded - bits is the read position */
+    long loaded;
+
+    /* Marker that stopped loading, 0 if none has been reached yet */
+    uint8_t marker;
+};
+
+void jpeg_ibitstream_init(struct jpeg_ibitstream* stream, unsigned char* data, long size);
+int jpeg_ibitstream_read(struct jpeg_ibitstream* stream, uint8_t* result);
+
+/* Only padding left and the scan is terminated by EOI (or the data ends) */
+int jpeg_ibitstream_at_end(struct jpeg_ibitstream* stream);
+
+static inline uint64_t jpeg_load_be64(const unsigned char* at){
+    uint64_t word;
+    memcpy(&word, at, 8);
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#elif !defined(__GNUC__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+    word = 0;
+    for(int i=0; i<8; i++) word = (word << 8) | at[i];
+#endif
+    return word;
+}
+
+/* Non-zero if any byte of word is 0xFF */
+static inline uint64_t jpeg_has_ff(uint64_t word){
+    uint64_t inv = ~word;
+    return (inv - 0x0101010101010101ULL) & word & 0x8080808080808080ULL;
+}
+
+static inline void jpeg_ibitstream_fill(struct jpeg_ibitstream* stream){
+    // Fast path: none of the next eight bytes needs unstuffing
+    if(stream->bits <= 56 && stream->size_bytes >= 8 && !stream->marker){
+        uint64_t word = jpeg_load_be64(stream->at);
+        if(!jpeg_has_ff(word)){
+            int n = (64 - stream->bits) >> 3;
+            stream->buffer |= (word >> (64 - 8*n)) << (64 - stream->bits - 8*n);
+            stream->bits += 8*n;
+            stream->loaded += 8*n;
+            stream->at += n;
+            stream->size_bytes -= n;
+            return;
+        }
+    }
+
+    while(stream->bits <= 56 && !stream->marker && stream->size_bytes > 0){
+        unsigned char byte = *stream->at;
+        if(byte == 0xFF){
+            if(stream->size_bytes < 2){
+                stream->size_bytes = 0;
+                break;
+            }
+
+            if(stream->at[1] == 0x00){
+                // FF00 escapes FF
+                stream->at += 2;
+                stream->size_bytes -= 2;
+            }else if(stream->at[1] == 0xFF){
+                // Fill byte in front of a marker
+                stream->at++;
+                stream->size_bytes--;
+                continue;
+            }else{
+                stream->marker = stream->at[1];
+                break;
+            }
+        }else{
+            stream->at++;
+            stream->size_bytes--;
+        }
+
+        stream->buffer |= ((uint64_t)byte) << (56 - stream->bits);
+        stream->bits += 8;
+        stream->loaded += 8;
+    }
+}
+
+static inline long jpeg_ibitstream_position(struct jpeg_ibitstream* stream){
+    return stream->loaded - stream->bits;
+}
+
+/* The requested bits run into a marker */
+static inline int jpeg_ibitstream_underflow(struct jpeg_ibitstream* stream){
+    if(stream->marker >= 0xD0 && stream->marker <= 0xD7){
+        // Drop padding and continue after the restart marker
+        stream->buffer = 0;
+        stream->bits = 0;
+        stream->at += 2;
+        stream->size_bytes -= 2;
+        stream->marker = 0;
+        return E_RESTART;
+    }
+
+    return E_EMPTY;
+}
+
+/* Next n bits (1 <= n <= 32), zero-padded if the stream runs into a marker */
+static inline uint32_t jpeg_ibitstream_peek(struct jpeg_ibitstream* stream, int n){
+    if(stream->bits < n){
+        jpeg_ibitstream_fill(stream);
+    }
+
+    return stream->buffer >> (64 - n);
+}
+
+/* Only to be used for bits that are in the buffer */
+static inline void jpeg_ibitstream_consume(struct jpeg_ibitstream* stream, int n){
+    stream->buffer <<= n;
+    stream->bits -= n;
+}
+
+/* 0 <= n <= 32 */
+static inline int jpeg_ibitstream_read_bits(struct jpeg_ibitstream* stream, int n, uint32_t* result){
+    if(n == 0){
+        *result = 0;
+        return 0;
+    }
+
+    if(stream->bits < n){
+        jpeg_ibitstream_fill(stream);
+        if(stream->bits < n){
+            return jpeg_ibitstream_underflow(stream);
+        }
+    }
+
+    *result = stream->buffer >> (64 - n);
+    jpeg_ibitstream_consume(stream, n);
+    return 0;
+}
+
+/*
+ * Entropy-coded output, collected in a 64-bit accumulator
+ *
+ * Writes of up to 32 bits are appended to the accumulator; whenever it holds
+ * 32 bits they are stored at once, 0xFF bytes are followed by a stuffed 0x00.
+ * The output buffer does not need to be initialised.
+ */
+struct jpeg_obitstream {
+    /* Pending bits, aligned to the least significant bit */
+    uint64_t buffer;
+    int bits;
+
+    unsigned char* at;
+    long size_bytes;
+};
+
+void jpeg_obitstream_init(struct jpeg_obitstream* stream, unsigned char* data, long size);
+int jpeg_obitstream_write(struct jpeg_obitstream* stream, uint8_t bit);
+
+/* Pad with ones to the next byte boundary and store all pending bits */
+int jpeg_obitstream_flush(struct jpeg_obitstream* stream);
+
+/* Store the whole bytes of the pending bits, the bits of a partial byte stay pending */
+int jpeg_obitstream_store_bytes(struct jpeg_obitstream* stream);
+
+/* Flush and write a marker, e.g. RSTn */
+int jpeg_obitstream_write_marker(struct jpeg_obitstream* stream, uint8_t marker);
+
+/* Append everything written to from, which was initialised on from_data, without padding */
+int jpeg_obitstream_append(struct jpeg_obitstream* stream, struct jpeg_obitstream* from, unsigned char* from_data);
+
+static inline int jpeg_obitstream_store_byte(struct jpeg_obitstream* stream, unsigned char byte){
+    if(stream->size_bytes < (byte == 0xFF ? 2 : 1)){
+        return E_FULL;
+    }
+
+    *(stream->at++) = byte;
+    stream->size_bytes--;
+    if(byte == 0xFF){
+        *(stream->at++) = 0x00;
+        stream->size_bytes--;
+    }
+
+    return 0;
+}
+
+/* Stores the oldest 32 pending bits */
+static inline int jpeg_obitstream_store_word(struct jpeg_obitstream* stream){
+    uint32_t word = stream->buffer >> (stream->bits - 32);
+    stream->bits -= 32;
+
+    // Fast path: nothing to stuff
+    if(stream->size_bytes >= 4 && !jpeg_has_ff(word)){
+        stream->at[0] = word >> 24;
+        stream->at[1] = word >> 16;
+        stream->at[2] = word >> 8;
+        stream->at[3] = word;
+        stream->at += 4;
+        stream->size_bytes -= 4;
+        return 0;
+    }
+
+    for(int i=24; i>=0; i-=8){
+        int status = jpeg_obitstream_store_byte(stream, word >> i);
+        if(status){
+            return status;
+        }
+    }
+
+    return 0;
+}
+
+/* 1 <= n <= 32, bits must fit into n bits */
+static inline int jpeg_obitstream_write_bits(struct jpeg_obitstream* stream, uint32_t bits, int n){
+    stream->buffer = (stream->buffer << n) | bits;
+    stream->bits += n;
+
+    if(stream->bits >= 32){
+        return jpeg_obitstream_store_word(stream);
+    }
+
+    return 0;
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define HUFFMAN_H 
 
 #include <stdint.h>
+#include "bitstream.h"
 
 #define E_INVALID_CODE -16
 #define E_NO_CODE -17
@@ -25,6 +26,57 @@ void huffman_tree_print(struct huffman_tree* tree, char* prefix);
 
 int huffman_tree_decode(struct huffman_tree* tree, struct jpeg_ibitstream* stream, uint8_t* result);
 
+#define HUFFMAN_LOOKUP_BITS 9
+
+/*
+ * Decoding table built from the DHT code counts: codes of up to
+ * HUFFMAN_LOOKUP_BITS bits are resolved by a single lookup on the next bits
+ * of the stream, longer codes fall back to the canonical maxcode search
+ */
+struct huffman_lookup {
+    /* (size << 8) | element, 0 if the code is longer than HUFFMAN_LOOKUP_BITS */
+    uint16_t fast[1 << HUFFMAN_LOOKUP_BITS];
+
+    /* Largest code of each size, -1 if there is none */
+    int32_t maxcode[17];
+
+    /* Index into elements of the first code of each size, minus that code */
+    int32_t valoffset[17];
+
+    uint8_t elements[256];
+};
+
+void huffman_lookup_init(struct huffman_lookup* lookup, int* n_elements, uint8_t* elements);
+
+static inline int huffman_lookup_decode(struct huffman_lookup* lookup, struct jpeg_ibitstream* stream, uint8_t* result){
+    uint32_t bits = jpeg_ibitstream_peek(stream, 16);
+
+    uint16_t entry = lookup->fast[bits >> (16 - HUFFMAN_LOOKUP_BITS)];
+    int size = entry >> 8;
+    if(!entry){
+        for(size=HUFFMAN_LOOKUP_BITS + 1; size<=16; size++){
+            int32_t code = bits >> (16 - size);
+            if(code <= lookup->maxcode[size]){
+                entry = lookup->elements[code + lookup->valoffset[size]];
+                break;
+            }
+        }
+
+        if(size > 16){
+            return stream->bits < 16 ? jpeg_ibitstream_underflow(stream) : E_INVALID_CODE;
+        }
+    }
+
+    // Zero-padded bits in front of a marker
+    if(size > stream->bits){
+        return jpeg_ibitstream_underflow(stream);
+    }
+
+    jpeg_ibitstream_consume(stream, size);
+    *result = entry & 0xFF;
+    return 0;
+}
+
 struct huffman_inv_element {
     uint8_t exists;
     uint8_t size;
@@ -33,12 +85,81 @@ struct huffman_inv_element {
 
 struct huffman_inv {
     int size;
-    struct huffman_inv_element* data;
+    struct huffman_inv_element data[256];
+
+    /* (size << 16) | code of every element, ready to be written; 0 if it has no code */
+    uint32_t codes[256];
 };
 
 void huffman_inv_init(struct huffman_inv* inv, struct huffman_tree* from);
-void huffman_inv_destroy(struct huffman_inv* inv);
-int huffman_inv_encode(struct huffman_inv* inv, struct jpeg_obitstream* stream, uint8_t data);
+
+/* Same as huffman_inv_init, from the code counts per size and elements of a DHT */
+void huffman_inv_init_canonical(struct huffman_inv* inv, uint8_t* counts, uint8_t* elements);
+
+static inline int huffman_inv_encode(struct huffman_inv* inv, struct jpeg_obitstream* stream, uint8_t data){
+    uint32_t code = inv->codes[data];
+    if(!code){
+        return E_NO_CODE;
+    }
+
+    return jpeg_obitstream_write_bits(stream, code & 0xFFFF, code >> 16);
+}
+
+/* Number of bits needed for the magnitude of value (SSSS) */
+static inline int huffman_value_ssss(int value){
+    unsigned int magnitude = value < 0 ? -value : value;
+#if defined(__GNUC__)
+    return magnitude ? 32 - __builtin_clz(magnitude) : 0;
+#else
+    int ssss = 0;
+    while(magnitude){
+        magnitude >>= 1;
+        ssss++;
+    }
+    return ssss;
+#endif
+}
+
+/* Read the SSSS magnitude bits following a code into value */
+static inline int huffman_from_ssss(uint8_t ssss, struct jpeg_ibitstream* stream, int* value){
+    uint32_t bits;
+    int status = jpeg_ibitstream_read_bits(stream, ssss, &bits);
+    if(status){
+        return status;
+    }
+
+    // Leading zero bit means negative
+    if(ssss && bits < (1u << (ssss - 1))){
+        *value = (int)bits - (1 << ssss) + 1;
+    }else{
+        *value = bits;
+    }
+
+    return 0;
+}
+
+/*
+ * Code of (rrrr << 4) + SSSS followed by the SSSS bits of value, joined into
+ * a single write of at most 31 bits
+ */
+static inline int huffman_inv_encode_value(struct huffman_inv* inv, struct jpeg_obitstream* stream, int value, int rrrr){
+    int ssss = huffman_value_ssss(value);
+    uint32_t code = ssss < 16 ? inv->codes[(rrrr << 4) + ssss] : 0;
+    if(!code){
+        return E_NO_CODE;
+    }
+
+    // Negative values are stored as value - 1 in ssss bits
+    uint32_t bits = (uint32_t)(value - (value < 0)) & ((1u << ssss) - 1);
+    return jpeg_obitstream_write_bits(stream, ((code & 0xFFFF) << ssss) | bits, (code >> 16) + ssss);
+}
+
+/*
+ * Optimal code for the symbol frequencies freq[256], limited to 16 bits and
+ * without an all-ones code (JPEG Annex K.2). Writes code counts per size to
+ * counts[16] and the elements ordered by code to elements, returns their number.
+ */
+int huffman_optimal_table(long* freq, uint8_t* counts, uint8_t* elements);
 
 
 #endif
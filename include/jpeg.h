@@ -1,22 +1,26 @@
 #ifndef JPEG_H
 #define JPEG_H
 
-struct huffman_tree;
 struct jpeg_quantisation_table;
 struct jpeg_segment;
 struct jpeg;
 
+#include <stdio.h>
+#include "bitstream.h"
 #include "huffman.h"
+#include "arena.h"
 
 #define MAX_TABLES 4
 #define MAX_COMPONENTS 4
+#define MAX_MCU_BLOCKS 10
 
-#define E_EMPTY -1
-#define E_FULL -2
-#define E_RESTART -3
 #define E_SIZE_MISMATCH -4
 #define E_ALREADY_DECODED -5
 #define E_NOT_YET_DECODED -6
+#define E_INVALID_SCAN -7
+#define E_PROGRESSIVE -8
+#define E_INVALID_HEADER -9
+#define E_UNSUPPORTED -10
 
 struct jpeg_segment {
     long size;
@@ -31,12 +35,25 @@ void jpeg_segment_init(struct jpeg_segment* segment, struct jpeg* jpeg, long siz
 struct jpeg_huffman_table{
     int id;
     int class;
-    struct huffman_tree* huffman_tree;
+
+    /* Code counts per size and elements of the source table */
+    uint8_t counts[16];
+    uint8_t elements[256];
+
     struct huffman_inv* huffman_inv;
+    struct huffman_lookup* huffman_lookup;
+
+    /* Table written to the output instead of the source one, set by jpeg_optimise_huffman */
+    int n_optimised;
+    uint8_t optimised_counts[16];
+    uint8_t optimised_elements[256];
 };
 
-int jpeg_huffman_table_init(struct jpeg_huffman_table* table, unsigned char* at);
-void jpeg_huffman_table_destroy(struct jpeg_huffman_table* table);
+/* Lookup and encoding tables are allocated from arena */
+/* Size of the table at, E_INVALID_HEADER if it is cut off by end or has more codes than fit */
+long jpeg_huffman_table_size(unsigned char* at, unsigned char* end);
+
+int jpeg_huffman_table_init(struct jpeg_huffman_table* table, struct jpeg_arena* arena, unsigned char* at);
 
 struct jpeg_quantisation_table {
     int id;
@@ -45,14 +62,57 @@ struct jpeg_quantisation_table {
     /* values in the source */
     uint16_t values[64];
 
-    /* values to be used in recompressing */
+    /* values to be used in recompressing, and the multipliers of values they were computed for */
     uint16_t recompress_values[64];
-    float recompress_factors[64];
+    float recompress_multipliers[64];
+
+    /*
+     * Requantization in fixed point, values / recompress_values is split into
+     * an integer part and a fraction scaled by 2^32 (see requantize.h)
+     */
+    uint16_t recompress_integers[64];
+    uint32_t recompress_fractions[64];
+
+    /*
+     * Dead zone in output steps, coefficients with a magnitude below
+     * recompress_thresholds are zeroed. From position recompress_tail on all
+     * coefficients are, these are skipped while decoding.
+     */
+    float recompress_dead_zone[64];
+    uint16_t recompress_thresholds[64];
+    int recompress_tail;
 };
 
 int jpeq_quantisation_table_init(struct jpeg_quantisation_table* table, unsigned char* at);
 void jpeg_quantisation_table_init_recompress(struct jpeg_quantisation_table* table, float compress);
 
+/* As above with compress scaled by matrix[i] for zigzag position i, matrix may be 0 */
+void jpeg_quantisation_table_init_recompress_matrix(struct jpeg_quantisation_table* table, float compress,
+        const float* matrix);
+
+/*
+ * Zero coefficients at zigzag position i (i > 0) which would requantize to
+ * less than dead_zone[i] output steps in magnitude, 0 for none. A dead zone
+ * of 0.5 changes nothing, INFINITY drops the position.
+ */
+void jpeg_quantisation_table_init_dead_zone(struct jpeg_quantisation_table* table, const float* dead_zone);
+
+/*
+ * Requantization of the luma (first) component and of the chroma components.
+ * Matrices hold 64 multipliers in zigzag order like the DQT entries, 0 for
+ * none. The dead zone applies to all tables.
+ */
+struct jpeg_requantization {
+    float luma_factor;
+    float chroma_factor;
+    const float* luma_matrix;
+    const float* chroma_matrix;
+    const float* dead_zone;
+};
+
+/* factor for luma and chroma, no matrices or dead zone */
+void jpeg_requantization_init(struct jpeg_requantization* requantization, float factor);
+
 struct jpeg_component {
     int id;
     int vertical_sampling;
@@ -70,6 +130,74 @@ struct jpeg_block {
     int16_t values[64];
 };
 
+/*
+ * Counters filled in by the decoders, encoders and the header writer if
+ * jpeg->stats is set. They are only compiled in with JPEG_STATS (meson
+ * option stats), otherwise the struct is left untouched. Counters are
+ * added to, so one struct may collect several frames, and times are summed
+ * over threads. The speculative decoder counts symbols, EOB and ZRL read
+ * and the bits per component in an extra untimed pass. Of progressive
+ * input nothing is counted on the read side.
+ */
+struct jpeg_stats {
+    /* Huffman codes decoded, by code length 1..16 */
+    long symbols[17];
+
+    /* Entropy-coded bits of the scan, without stuffing and markers */
+    long bits_read;
+    long bits_written;
+
+    /* FF00 in the input and output scan */
+    long stuffed_read;
+    long stuffed_written;
+
+    /* RSTn in the input and output scan */
+    long restarts_read;
+    long restarts_written;
+
+    long eob_read;
+    long zrl_read;
+    long eob_written;
+    long zrl_written;
+
+    /* Nonzero coefficients which are zero after requantization */
+    long zeroed;
+
+    /* Bits of the blocks of each component, by id - 1 */
+    long component_bits_read[MAX_COMPONENTS];
+    long component_bits_written[MAX_COMPONENTS];
+
+    double seconds_header;
+    double seconds_decode;
+    double seconds_encode;
+};
+
+void jpeg_stats_init(struct jpeg_stats* stats);
+
+/* Monotonic clock in seconds */
+double jpeg_stats_time();
+
+/* Readable summary of stats */
+void jpeg_stats_print(struct jpeg_stats* stats, FILE* f);
+
+/* Count FF00 and RSTn in entropy-coded data */
+void jpeg_stats_count_markers(unsigned char* data, long size, long* stuffed, long* restarts);
+
+/* Count FF00, RSTn and the bits in between in entropy-coded data */
+void jpeg_stats_count_scan(unsigned char* data, long size, long* bits, long* stuffed, long* restarts);
+
+/* Bits written to stream since it was at from with from_bits pending, without stuffing and markers */
+long jpeg_stats_written_bits(struct jpeg_obitstream* stream, unsigned char* from, int from_bits);
+
+/* Add the counters of from to stats */
+void jpeg_stats_add(struct jpeg_stats* stats, struct jpeg_stats* from);
+
+#ifdef JPEG_STATS
+#define JPEG_STATS_ADD(stats, field, n) do{ if(stats){ (stats)->field += (n); } }while(0)
+#else
+#define JPEG_STATS_ADD(stats, field, n) ((void)(stats))
+#endif
+
 
 struct jpeg {
     long size;
@@ -78,6 +206,22 @@ struct jpeg {
     int width;
     int height;
 
+    /* MCUs per restart interval, 0 if there is no DRI segment */
+    int restart_interval;
+
+    /* SOF2, the scans are decoded into blocks which are written as baseline */
+    int progressive;
+
+    /*
+     * MCUs per restart interval of the output, 0 for none. Set before the
+     * tables are optimised and the header is written, intervals are then
+     * encoded independently.
+     */
+    int output_restart_interval;
+
+    /* Counters to fill in, 0 for none */
+    struct jpeg_stats* stats;
+
     struct jpeg_segment* first_segment;
 
     int n_components;
@@ -92,13 +236,34 @@ struct jpeg {
     int n_dc_huffman_tables;
     struct jpeg_huffman_table* dc_huffman_tables[MAX_TABLES];
 
+    /* Blocks in scan order, mcu_columns * mcu_rows MCUs of loop_count blocks */
+    int mcu_columns;
+    int mcu_rows;
     int n_blocks;
     struct jpeg_block* blocks;
+
+    /* Component of each block of an MCU, in scan order */
+    int loop_count;
+    struct jpeg_component** loop;
+
+    /* Segments, tables, components and the loop */
+    struct jpeg_arena arena;
 };
 
+/* Nothing needs to be destroyed if this fails */
 int jpeg_init(struct jpeg* jpeg, long size, unsigned char* data);
+
+/*
+ * Parse another image into an initialised jpeg, reusing the memory of the
+ * previous one. jpeg still needs to be destroyed if this fails.
+ */
+int jpeg_reinit(struct jpeg* jpeg, long size, unsigned char* data);
+
 void jpeg_destroy(struct jpeg* jpeg);
 
+/* Set up all quantisation tables for recompressing, a table shared by luma and chroma is requantized as luma */
+void jpeg_init_recompress(struct jpeg* jpeg, struct jpeg_requantization* requantization);
+
 void jpeg_print_sizes(struct jpeg* jpeg);
 void jpeg_print_segments(struct jpeg* jpeg);
 void jpeg_print_components(struct jpeg* jpeg);
@@ -107,33 +272,226 @@ void jpeg_print_huffman_tables(struct jpeg* jpeg);
 
 struct jpeg_segment* jpeg_find_segment(struct jpeg* jpeg, unsigned char header, struct jpeg_segment* after);
 
-struct jpeg_ibitstream {
-    uint8_t at_restart;
-    unsigned char* at;
-    uint8_t at_bit;
-    long size_bytes;
-};
+/* Decodes all scans of progressive input */
+int jpeg_decode_huffman(struct jpeg* jpeg);
+
+/*
+ * Progressive input is written with baseline huffman tables built for its
+ * blocks, in which every symbol has a code so they work with any factor.
+ * Decodes and builds the tables unless that has happened already; the
+ * header and scan writers call this themselves.
+ */
+int jpeg_progressive_prepare(struct jpeg* jpeg);
+
+/* Used by jpeg_decode_huffman for progressive input */
+int jpeg_decode_progressive(struct jpeg* jpeg);
+
+/*
+ * Same result as jpeg_decode_huffman. Without restart markers the scan is cut
+ * into byte-aligned chunks that are decoded speculatively on n_threads threads
+ * (all cores if n_threads <= 0) and stitched where the block boundaries agree.
+ */
+int jpeg_decode_huffman_parallel(struct jpeg* jpeg, int n_threads);
+
+/*
+ * Replaces the huffman tables used for encoding by optimal ones for the
+ * requantized blocks, which are written to the output DHT. Decodes the scan
+ * first if that has not happened yet, so call it after the recompression
+ * factors have been set and before writing the header.
+ */
+int jpeg_optimise_huffman(struct jpeg* jpeg);
+
+/* Bytes jpeg_write_recompress_header will write */
+long jpeg_recompress_header_size(struct jpeg* jpeg);
 
-void jpeg_ibitstream_init(struct jpeg_ibitstream* stream, unsigned char* data, long size);
-int jpeg_ibitstream_read(struct jpeg_ibitstream* stream, uint8_t* result);
+long jpeg_write_recompress_header(struct jpeg* jpeg, unsigned char* buffer, long buffer_size);
+
+long jpeg_encode_huffman(struct jpeg* jpeg, unsigned char* buffer, long buffer_size);
 
-struct jpeg_obitstream {
-    unsigned char* at;
-    uint8_t at_bit;
-    long size_bytes;
+/* Same output as jpeg_encode_huffman, ranges of blocks are encoded on n_threads threads */
+long jpeg_encode_huffman_parallel(struct jpeg* jpeg, unsigned char* buffer, long buffer_size, int n_threads);
+
+/* Already decoded blocks are encoded directly with jpeg_encode_huffman */
+long jpeg_reencode_huffman(struct jpeg* jpeg, unsigned char* buffer, long buffer_size);
+
+/*
+ * Same output as jpeg_reencode_huffman, but on n_threads threads (all cores if
+ * n_threads <= 0). The restart intervals of the source are reencoded
+ * concurrently; sources without restart markers are decoded speculatively
+ * with jpeg_decode_huffman_parallel and encoded with jpeg_encode_huffman_parallel.
+ */
+long jpeg_reencode_huffman_parallel(struct jpeg* jpeg, unsigned char* buffer, long buffer_size, int n_threads);
+
+/*
+ * Room for the header and scan written for jpeg with its output restart
+ * interval, so set that first
+ */
+long jpeg_reencode_max_size(struct jpeg* jpeg);
+
+/*
+ * Keeps the parsed header of the previous frame for a stream of frames.
+ * Frames of a stream mostly share their bytes up to the scan; those are then
+ * not parsed again, and the tables built for them as well as the
+ * recompressed header are reused.
+ */
+struct jpeg_context {
+    struct jpeg jpeg;
+    int initialised;
+
+    /* Header jpeg was parsed from, up to the scan, 0 bytes if it cannot be reused */
+    unsigned char* header;
+    long header_size;
+    long header_capacity;
+
+    /* Output of jpeg_write_recompress_header, -1 if there is none */
+    unsigned char* recompress_header;
+    long recompress_header_size;
+    long recompress_header_capacity;
+
+    /* Multipliers of the quantisation tables and restart interval the recompressed header was written with */
+    float recompress_multipliers[MAX_TABLES][64];
+    int recompress_restart_interval;
+
+    /* Frames parsed, and how many of them reused the previous header */
+    long n_frames;
+    long n_reused;
 };
 
-void jpeg_obitstream_init(struct jpeg_obitstream* stream, unsigned char* data, long size);
-int jpeg_obitstream_write(struct jpeg_obitstream* stream, uint8_t bit);
+void jpeg_context_init(struct jpeg_context* context);
+void jpeg_context_destroy(struct jpeg_context* context);
 
-int jpeg_decode_huffman(struct jpeg* jpeg);
+/*
+ * Parse data into context->jpeg, which stays valid until the next call. If
+ * data starts with the same header as the previous frame only the scan
+ * position is updated; blocks decoded for the previous frame are dropped.
+ */
+int jpeg_context_parse(struct jpeg_context* context, long size, unsigned char* data);
 
-long jpeg_write_recompress_header(struct jpeg* jpeg, unsigned char* buffer, long buffer_size);
+/* Same as jpeg_write_recompress_header on context->jpeg, copied if nothing changed since the last frame */
+long jpeg_context_write_recompress_header(struct jpeg_context* context, unsigned char* buffer, long buffer_size);
 
-/* buffer is required to be 0-initialised */
-long jpeg_encode_huffman(struct jpeg* jpeg, unsigned char* buffer, long buffer_size);
+/* Magnitudes below this are counted exactly by the prediction, larger ones per ssss */
+#define PREDICT_EXACT 64
 
-long jpeg_reencode_huffman(struct jpeg* jpeg, unsigned char* buffer, long buffer_size);
+/*
+ * Coefficient statistics of a decoded scan, from which the reencoded size is
+ * estimated for any factor without running the encoder.
+ */
+struct jpeg_prediction {
+    struct jpeg* jpeg;
+
+    long n_blocks[MAX_COMPONENTS];
+
+    /* Per component and zigzag position, position 0 holds the DC differences */
+    uint32_t exact[MAX_COMPONENTS][64][PREDICT_EXACT];
+    uint32_t large_count[MAX_COMPONENTS][64][16];
+    uint64_t large_sum[MAX_COMPONENTS][64][16];
+
+    /* Actual over estimated scan size, of the source or for progressive input of the output at factor one */
+    double calibration;
+};
+
+/*
+ * Decodes the scan unless that has happened already and collects the
+ * statistics. The blocks are kept, so reencoding afterwards does not decode
+ * again. jpeg has to outlive prediction.
+ */
+int jpeg_prediction_init(struct jpeg_prediction* prediction, struct jpeg* jpeg);
+
+/* Estimated output bytes, header included, when recompressing all tables by factor */
+long jpeg_predict_size(struct jpeg_prediction* prediction, float factor);
+
+/*
+ * Smallest factor in [min_factor, max_factor] estimated to give at most
+ * max_bytes, max_factor if there is none
+ */
+float jpeg_predict_factor(struct jpeg_prediction* prediction, long max_bytes, float min_factor, float max_factor);
+
+/*
+ * Chooses requantization factors for a stream of frames so their sizes
+ * follow a target bitrate. Each frame's factor is predicted from its
+ * coefficient statistics, corrected by how far previous predictions were
+ * off, and adjusted to pay back over- or undershoot of the last second.
+ */
+struct jpeg_rate_control {
+    double frame_bytes;
+    double fps;
+    float min_factor;
+    float max_factor;
+
+    /* Weight of the latest frame in the correction, and largest factor change between frames */
+    float smoothing;
+    float max_step;
+
+    struct jpeg_prediction* prediction;
+    long n_frames;
+    float factor;
+    long predicted;
+
+    /* Smoothed achieved over predicted size */
+    double correction;
+
+    /* Bytes written beyond the target so far, limited to one second */
+    double debt;
+};
+
+void jpeg_rate_control_init(struct jpeg_rate_control* rate_control, double bitrate, double fps, float min_factor, float max_factor);
+void jpeg_rate_control_destroy(struct jpeg_rate_control* rate_control);
+
+/*
+ * Decodes jpeg, chooses its factor (stored in rate_control->factor) and
+ * initialises all quantisation tables for recompression with it
+ */
+int jpeg_rate_control_prepare(struct jpeg_rate_control* rate_control, struct jpeg* jpeg);
+
+/* Report the size the frame prepared last ended up with */
+void jpeg_rate_control_update(struct jpeg_rate_control* rate_control, long bytes);
+
+/* Receives output as it becomes available, a non-zero return aborts reencoding */
+typedef int (*jpeg_reencode_output)(void* user, unsigned char* data, long size);
+
+/*
+ * Push-style reencoding: input is fed in chunks of any size, and output is
+ * passed to the callback in whole bytes as soon as it is ready. The header is
+ * buffered until SOS is complete, after which every block whose data has
+ * fully arrived is reencoded and its whole bytes are passed on before
+ * jpeg_reencode_stream_feed returns.
+ */
+struct jpeg_reencode_stream {
+    /* Copied, the matrices it points to have to outlive the stream */
+    struct jpeg_requantization requantization;
+    jpeg_reencode_output output;
+    void* user;
+
+    /* Input not consumed yet: the header until it is complete, then scan data */
+    unsigned char* input;
+    long input_size;
+    long input_capacity;
+
+    /* Copy of the header, which jpeg refers to */
+    unsigned char* header;
+    int has_header;
+    struct jpeg jpeg;
+
+    int n_blocks_done;
+    int done;
+    int dec_dc_offset[MAX_COMPONENTS];
+    int enc_dc_offset[MAX_COMPONENTS];
+
+    struct jpeg_ibitstream istream;
+    struct jpeg_obitstream ostream;
+    unsigned char* output_buffer;
+    long output_buffer_size;
+};
+
+void jpeg_reencode_stream_init(struct jpeg_reencode_stream* stream, struct jpeg_requantization* requantization,
+        jpeg_reencode_output output, void* user);
+void jpeg_reencode_stream_destroy(struct jpeg_reencode_stream* stream);
+
+/* Returns 0 or an error, after which the stream cannot be used anymore */
+int jpeg_reencode_stream_feed(struct jpeg_reencode_stream* stream, unsigned char* data, long size);
 
+/* Returns E_EMPTY if the input ended before the last block */
+int jpeg_reencode_stream_finish(struct jpeg_reencode_stream* stream);
 
 #endif
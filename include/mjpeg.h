@@ -0,0 +1,39 @@
+#ifndef MJPEG_H
+#define MJPEG_H
+
+#include <stdio.h>
+
+struct jpeg_requantization;
+
+#define E_READ -32
+#define E_WRITE -33
+#define E_THREADS -34
+
+/*
+ * Find the first complete frame (SOI ... EOI) in data. Sets *start to its SOI
+ * and returns the offset just after its EOI. Bytes between frames, like
+ * multipart boundaries, are skipped. Returns 0 if data holds no complete
+ * frame, reading may then continue from *start.
+ */
+long jpeg_mjpeg_next_frame(unsigned char* data, long size, long* start);
+
+struct jpeg_mjpeg_stats {
+    long n_frames;
+
+    /* Frames that could not be reencoded, these are copied unchanged */
+    long n_failed;
+
+    long bytes_input;
+    long bytes_output;
+    double seconds;
+};
+
+/*
+ * Reencode the frames read from input_fd, in order, into output using
+ * n_threads workers. At most 2 * n_threads frames are kept in memory. If
+ * report is given, a line per frame is printed to it.
+ */
+int jpeg_mjpeg_reencode(int input_fd, FILE* output, struct jpeg_requantization* requantization, int optimise, int restart_interval, int n_threads,
+        FILE* report, struct jpeg_mjpeg_stats* stats);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/* Number of threads to use, all cores if requested <= 0 */
+int jpeg_parallel_threads(int requested);
+
+/*
+ * Run worker(arg) on n_threads threads, one of them being the calling thread,
+ * and wait for all of them. Workers are expected to share the work through arg.
+ */
+void jpeg_parallel_run(int n_threads, void* (*worker)(void*), void* arg);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef REQUANTIZE_H
+#define REQUANTIZE_H
+
+#include <stdint.h>
+
+/*
+ * Requantization in fixed point: a coefficient v quantised by q is requantized
+ * to round(v * q / r), rounded half away from zero, with
+ *
+ *   integer = q / r, fraction = ceil(2^32 * (q % r) / r)
+ *
+ * |v| * fraction / 2^32 is never more than |v| / 2^32 <= 2^-17 above the exact
+ * value, while a result that is not exactly half-way is at least 1/(2r) away
+ * from it. So the rounding is exact for |v| <= 2^15 and r < 2^16.
+ */
+static inline int16_t jpeg_requantize_value(int value, uint16_t integer, uint32_t fraction){
+    uint32_t magnitude = value < 0 ? -value : value;
+    uint32_t result = magnitude * integer + (uint32_t)(((uint64_t)magnitude * fraction + (1u << 31)) >> 32);
+    return value < 0 ? -result : result;
+}
+
+/*
+ * Requantize the 64 coefficients of a block with jpeg_requantize_value, data
+ * and result may be the same. Coefficients with a magnitude below thresholds[i]
+ * are zeroed instead (dead zone). Returns a mask with bit i set if result[i]
+ * is nonzero.
+ *
+ * Uses SSE2 or AVX2 where available, the results are identical to the scalar path.
+ */
+uint64_t jpeg_requantize_block(const int16_t* data, int16_t* result, const uint16_t* integers, const uint32_t* fractions,
+        const uint16_t* thresholds);
+
+/* Index of the lowest set bit, mask must not be zero */
+static inline int jpeg_mask_first(uint64_t mask){
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask);
+#else
+    int i = 0;
+    while(!(mask & 1)){
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+#endif
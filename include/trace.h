@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Spans of the pipeline, recorded into a ring buffer per thread while the
+ * tracer is active. The spans are only compiled in with JPEG_TRACE (meson
+ * option trace), an inactive tracer costs a relaxed load per span.
+ */
+
+/* Clear all buffers and start recording, not to be called while spans are recorded */
+void jpeg_trace_start();
+
+void jpeg_trace_stop();
+
+/* Write the recorded spans as Chrome trace-event JSON, call once threads are done */
+void jpeg_trace_write(FILE* f);
+
+/* Nanoseconds, never 0 */
+uint64_t jpeg_trace_now();
+
+/* Add span name from start until now, with a number shown in its arguments */
+void jpeg_trace_record(const char* name, long arg, uint64_t start);
+
+extern atomic_int jpeg_trace_active;
+
+static inline uint64_t jpeg_trace_begin(){
+    return atomic_load_explicit(&jpeg_trace_active, memory_order_relaxed) ? jpeg_trace_now() : 0;
+}
+
+#ifdef JPEG_TRACE
+#define JPEG_TRACE_BEGIN(span) uint64_t span = jpeg_trace_begin()
+#define JPEG_TRACE_END(span, name, arg) do{ if(span){ jpeg_trace_record((name), (arg), (span)); } }while(0)
+#else
+#define JPEG_TRACE_BEGIN(span)
+#define JPEG_TRACE_END(span, name, arg)
+#endif
+
+#endif
@@ -7,11 +7,12 @@ with open('./reference/2_480p.jpg', 'rb') as f:
 
 print("Loaded jpeg of size %dkB" % (len(data)/1000))
 result_size = 0
+n = 100
 t = time.time()
-for i in range(1):
+for i in range(n):
     result = reencode(data, 10)
     result_size = len(result)
 
 t = time.time() - t
 print("Compressed to jpeg of size %dkB" % (len(result)/1000))
-print("FPS: %d => %dMbps" % (100./t, 100. * len(data) * 8. / t / 1.e6))
+print("FPS: %d => %dMbps" % (n/t, n * len(data) * 8. / t / 1.e6))
@@ -4,58 +4,625 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <time.h>
+#include <stdatomic.h>
 
 #include "jpeg.h"
+#include "parallel.h"
+#include "trace.h"
 
-static PyObject* jpeg_reencode_reencode(PyObject* self, PyObject* args){
+#define E_HEADER -100
+
+/*
+ * Parse a frame to be reencoded, returns jpeg_reencode_max_size for it or an
+ * error. Counters go into stats if it is given.
+ */
+static long parse_frame(struct jpeg_context* context, unsigned char* data, long size,
+        int restart_interval, struct jpeg_stats* stats){
+    if(jpeg_context_parse(context, size, data)){
+        return E_HEADER;
+    }
+
+    struct jpeg* jpeg = &context->jpeg;
+    jpeg->output_restart_interval = restart_interval;
+    jpeg->stats = stats;
+
+    return jpeg_reencode_max_size(jpeg);
+}
+
+/*
+ * Reencode the frame parsed into context into output, returns the number of
+ * bytes written or an error. The factor is chosen by rate_control if it is
+ * given, otherwise the tables are requantized as given by requantization.
+ * Does not touch any python object, so it may run without the GIL.
+ */
+static long reencode_frame(struct jpeg_context* context, struct jpeg_requantization* requantization, int optimise,
+        struct jpeg_rate_control* rate_control, unsigned char* output, long output_size){
+    struct jpeg* jpeg = &context->jpeg;
+    int status;
+
+    if(rate_control){
+        status = jpeg_rate_control_prepare(rate_control, jpeg);
+        if(status){
+            return status;
+        }
+    }else{
+        jpeg_init_recompress(jpeg, requantization);
+    }
+
+    if(optimise){
+        status = jpeg_optimise_huffman(jpeg);
+        if(status){
+            return status;
+        }
+    }
+
+    long bytes_header = jpeg_context_write_recompress_header(context, output, output_size);
+    if(bytes_header < 0){
+        return bytes_header;
+    }
+
+    long bytes_scan = jpeg_reencode_huffman(jpeg, output + bytes_header, output_size - bytes_header);
+
+    if(bytes_scan < 0){
+        return bytes_scan;
+    }
+
+    if(rate_control){
+        jpeg_rate_control_update(rate_control, bytes_header + bytes_scan);
+    }
+
+    return bytes_header + bytes_scan;
+}
+
+static void set_error(long status){
+    if(status == E_HEADER){
+        PyErr_SetString(PyExc_TypeError, "Could not parse header");
+    }else if(status == E_FULL){
+        PyErr_SetString(PyExc_ValueError, "Output buffer too small");
+    }else{
+        PyErr_Format(PyExc_TypeError, "Could not reencode (%ld)", status);
+    }
+}
+
+static int check_restart_interval(int restart_interval){
+    if(restart_interval < 0 || restart_interval > 65535){
+        PyErr_SetString(PyExc_ValueError, "restart_interval must be in 0..65535");
+        return -1;
+    }
+    return 0;
+}
+
+/* Requantization with room for its matrices and dead zone */
+struct requantization_args {
+    struct jpeg_requantization requantization;
+    float matrices[3][64];
+};
+
+/* Sequence of 64 positive (or with allow_zero non-negative) values in zigzag order, or None */
+static int parse_matrix(PyObject* object, float* matrix, int allow_zero, const float** result){
+    if(object == Py_None){
+        *result = NULL;
+        return 0;
+    }
+
+    PyObject* sequence = PySequence_Fast(object, "matrix must be a sequence of 64 numbers");
+    if(!sequence){
+        return -1;
+    }
+
+    int status = 0;
+    if(PySequence_Fast_GET_SIZE(sequence) != 64){
+        PyErr_SetString(PyExc_ValueError, "matrix must be a sequence of 64 numbers");
+        status = -1;
+    }
+
+    for(int i=0; i<64 && !status; i++){
+        double value = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(sequence, i));
+        if(value == -1. && PyErr_Occurred()){
+            status = -1;
+        }else if(!(value > 0. || (allow_zero && value == 0.))){
+            PyErr_SetString(PyExc_ValueError, allow_zero ? "dead_zone entries must not be negative" : "matrix entries must be positive");
+            status = -1;
+        }
+        matrix[i] = value;
+    }
+
+    Py_DECREF(sequence);
+    *result = status ? NULL : matrix;
+    return status;
+}
+
+/* chroma_factor <= 0 uses factor for chroma as well */
+static int parse_requantization(double factor, double chroma_factor, PyObject* luma_matrix, PyObject* chroma_matrix,
+        PyObject* dead_zone, struct requantization_args* args){
+    jpeg_requantization_init(&args->requantization, factor);
+    if(chroma_factor > 0){
+        args->requantization.chroma_factor = chroma_factor;
+    }
+
+    if(parse_matrix(luma_matrix, args->matrices[0], 0, &args->requantization.luma_matrix) ||
+            parse_matrix(chroma_matrix, args->matrices[1], 0, &args->requantization.chroma_matrix) ||
+            parse_matrix(dead_zone, args->matrices[2], 1, &args->requantization.dead_zone)){
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject* long_list(long* values, int n){
+    PyObject* list = PyList_New(n);
+    if(!list){
+        return NULL;
+    }
+
+    for(int i=0; i<n; i++){
+        PyObject* value = PyLong_FromLong(values[i]);
+        if(!value){
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, value);
+    }
+
+    return list;
+}
+
+/* Dict of the counters in stats, symbols are by code length 1..16 and component bits by component id - 1 */
+static PyObject* stats_dict(struct jpeg_stats* stats){
+    return Py_BuildValue("{s:N,s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:l,s:N,s:N,s:d,s:d,s:d}",
+            "symbols", long_list(stats->symbols + 1, 16),
+            "bits_read", stats->bits_read,
+            "bits_written", stats->bits_written,
+            "stuffed_read", stats->stuffed_read,
+            "stuffed_written", stats->stuffed_written,
+            "restarts_read", stats->restarts_read,
+            "restarts_written", stats->restarts_written,
+            "eob_read", stats->eob_read,
+            "eob_written", stats->eob_written,
+            "zrl_read", stats->zrl_read,
+            "zrl_written", stats->zrl_written,
+            "zeroed", stats->zeroed,
+            "component_bits_read", long_list(stats->component_bits_read, MAX_COMPONENTS),
+            "component_bits_written", long_list(stats->component_bits_written, MAX_COMPONENTS),
+            "seconds_header", stats->seconds_header,
+            "seconds_decode", stats->seconds_decode,
+            "seconds_encode", stats->seconds_encode);
+}
+
+/*
+ * Shrink the bytes object a frame was reencoded into to its size, or release
+ * it on an error
+ */
+static PyObject* finish_output(PyObject* output, long size){
+    if(size < 0){
+        Py_DECREF(output);
+        set_error(size);
+        return NULL;
+    }
+
+    // Releases output on failure
+    if(_PyBytes_Resize(&output, size)){
+        return NULL;
+    }
+    return output;
+}
+
+static PyObject* jpeg_reencode_reencode(PyObject* self, PyObject* args, PyObject* kwargs){
+    static char* keywords[] = { "data", "factor", "optimise", "restart_interval", "stats", "chroma_factor",
+        "luma_matrix", "chroma_matrix", "dead_zone", NULL };
+
+    Py_buffer buffer;
+    double factor;
+    int optimise = 0;
+    int restart_interval = 0;
+    int stats = 0;
+    double chroma_factor = 0.;
+    PyObject* luma_matrix = Py_None;
+    PyObject* chroma_matrix = Py_None;
+    PyObject* dead_zone = Py_None;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "y*d|pipdOOO", keywords, &buffer, &factor, &optimise, &restart_interval,
+                &stats, &chroma_factor, &luma_matrix, &chroma_matrix, &dead_zone)){
+        return NULL;
+    }
+
+    struct requantization_args requantization;
+    if(check_restart_interval(restart_interval) ||
+            parse_requantization(factor, chroma_factor, luma_matrix, chroma_matrix, dead_zone, &requantization)){
+        PyBuffer_Release(&buffer);
+        return NULL;
+    }
+
+#ifndef JPEG_STATS
+    if(stats){
+        PyErr_SetString(PyExc_RuntimeError, "jpeg_reencode was built without stats");
+        PyBuffer_Release(&buffer);
+        return NULL;
+    }
+#endif
+
+    struct jpeg_stats frame_stats;
+    jpeg_stats_init(&frame_stats);
+
+    struct jpeg_context context;
+    jpeg_context_init(&context);
+
+    // The frame is reencoded straight into the bytes object, which is shrunk afterwards
     PyObject* result = NULL;
-    unsigned char* output_buffer = NULL;
+    long result_size = parse_frame(&context, buffer.buf, buffer.len, restart_interval, stats ? &frame_stats : NULL);
+    if(result_size < 0){
+        set_error(result_size);
+    }else{
+        result = PyBytes_FromStringAndSize(NULL, result_size);
+    }
+
+    if(result){
+        // buffer stays exported and result is not shared yet, so both are safe without the GIL
+        unsigned char* output = (unsigned char*)PyBytes_AS_STRING(result);
+        Py_BEGIN_ALLOW_THREADS;
+        result_size = reencode_frame(&context, &requantization.requantization, optimise, NULL, output, result_size);
+        Py_END_ALLOW_THREADS;
+
+        result = finish_output(result, result_size);
+    }
+
+    jpeg_context_destroy(&context);
+    PyBuffer_Release(&buffer);
+
+    if(!stats || !result){
+        return result;
+    }
+
+    return Py_BuildValue("(NN)", result, stats_dict(&frame_stats));
+}
+
+static PyObject* jpeg_reencode_reencode_into(PyObject* self, PyObject* args){
+    Py_buffer src;
+    Py_buffer dst;
+    double factor;
+    int optimise = 0;
+    if(!PyArg_ParseTuple(args, "y*w*d|p", &src, &dst, &factor, &optimise)){
+        return NULL;
+    }
+
+    struct jpeg_requantization requantization;
+    jpeg_requantization_init(&requantization, factor);
+
+    long result_size;
     Py_BEGIN_ALLOW_THREADS;
+    struct jpeg_context context;
+    jpeg_context_init(&context);
+    result_size = parse_frame(&context, src.buf, src.len, 0, NULL);
+    if(result_size >= 0){
+        result_size = reencode_frame(&context, &requantization, optimise, NULL, dst.buf, dst.len);
+    }
+    jpeg_context_destroy(&context);
+    Py_END_ALLOW_THREADS;
+
+    PyBuffer_Release(&src);
+    PyBuffer_Release(&dst);
+
+    if(result_size < 0){
+        set_error(result_size);
+        return NULL;
+    }
 
-    PyBytesObject* buffer;
+    return PyLong_FromLong(result_size);
+}
+
+struct reencode_batch_frame {
+    Py_buffer view;
+
+    /* Bytes object of jpeg_reencode_max_size, output_size is the result */
+    PyObject* output;
+    long output_size;
+};
+
+struct reencode_batch {
+    struct requantization_args requantization;
+    int optimise;
+    int restart_interval;
+
+    int n_frames;
+    struct reencode_batch_frame* frames;
+    atomic_int next_frame;
+};
+
+static void* reencode_batch_worker(void* arg){
+    struct reencode_batch* batch = arg;
+
+    struct jpeg_context context;
+    jpeg_context_init(&context);
+
+    int i;
+    while((i = atomic_fetch_add(&batch->next_frame, 1)) < batch->n_frames){
+        struct reencode_batch_frame* frame = batch->frames + i;
+        JPEG_TRACE_BEGIN(span);
+        frame->output_size = parse_frame(&context, frame->view.buf, frame->view.len, batch->restart_interval, NULL);
+        if(frame->output_size >= 0){
+            frame->output_size = reencode_frame(&context, &batch->requantization.requantization, batch->optimise, NULL,
+                    (unsigned char*)PyBytes_AS_STRING(frame->output), frame->output_size);
+        }
+        JPEG_TRACE_END(span, "batch frame", i);
+    }
+
+    jpeg_context_destroy(&context);
+    return 0;
+}
+
+static PyObject* jpeg_reencode_reencode_many(PyObject* self, PyObject* args, PyObject* kwargs){
+    static char* keywords[] = { "frames", "factor", "threads", "optimise", "restart_interval", "chroma_factor",
+        "luma_matrix", "chroma_matrix", "dead_zone", NULL };
+
+    PyObject* frames;
     double factor;
-    if(!PyArg_ParseTuple(args, "Sd", &buffer, &factor)){
-        PyErr_SetString(PyExc_TypeError, "Invalid parameters");
+    int threads = 0;
+    int optimise = 0;
+    int restart_interval = 0;
+    double chroma_factor = 0.;
+    PyObject* luma_matrix = Py_None;
+    PyObject* chroma_matrix = Py_None;
+    PyObject* dead_zone = Py_None;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "Od|ipidOOO", keywords, &frames, &factor, &threads, &optimise,
+                &restart_interval, &chroma_factor, &luma_matrix, &chroma_matrix, &dead_zone)){
+        return NULL;
+    }
 
+    struct reencode_batch batch;
+    if(check_restart_interval(restart_interval) ||
+            parse_requantization(factor, chroma_factor, luma_matrix, chroma_matrix, dead_zone, &batch.requantization)){
+        return NULL;
+    }
+
+    PyObject* sequence = PySequence_Tuple(frames);
+    if(!sequence){
+        return NULL;
+    }
+
+    batch.optimise = optimise;
+    batch.restart_interval = restart_interval;
+    batch.n_frames = PyTuple_GET_SIZE(sequence);
+    batch.frames = calloc(batch.n_frames ? batch.n_frames : 1, sizeof(struct reencode_batch_frame));
+    atomic_init(&batch.next_frame, 0);
+
+    PyObject* result = NULL;
+    int n_views = 0;
+    if(!batch.frames){
+        PyErr_NoMemory();
         goto Return;
     }
 
-    long size = PyBytes_Size(buffer);
+    // Exported views keep the frames valid without the GIL. The output of
+    // each frame is created here from its header, the workers reencode into it
+    struct jpeg_context context;
+    jpeg_context_init(&context);
+    for(int i=0; i<batch.n_frames; i++){
+        struct reencode_batch_frame* frame = batch.frames + i;
+        if(PyObject_GetBuffer(PyTuple_GET_ITEM(sequence, i), &frame->view, PyBUF_C_CONTIGUOUS)){
+            break;
+        }
+        n_views++;
 
-    struct jpeg jpeg;
-    int status = jpeg_init(&jpeg, size, PyBytes_AsString(buffer));
-    if(status){
-        PyErr_SetString(PyExc_TypeError, "Could not parse header");
+        long size = parse_frame(&context, frame->view.buf, frame->view.len, restart_interval, NULL);
+        if(size < 0){
+            set_error(size);
+            break;
+        }
+
+        frame->output = PyBytes_FromStringAndSize(NULL, size);
+        if(!frame->output){
+            break;
+        }
+    }
+    jpeg_context_destroy(&context);
 
+    if(PyErr_Occurred()){
         goto Return;
     }
 
-    for(int i=0; i<jpeg.n_quantisation_tables; i++){
-        jpeg_quantisation_table_init_recompress(jpeg.quantisation_tables[i], factor);
+    threads = jpeg_parallel_threads(threads);
+    if(threads > batch.n_frames){
+        threads = batch.n_frames;
     }
 
-    output_buffer = malloc(size);
-    memset(output_buffer, 0, size);
-    long bytes_header = jpeg_write_recompress_header(&jpeg, output_buffer, size);
-    long bytes_scan = jpeg_reencode_huffman(&jpeg, output_buffer + bytes_header, size - bytes_header);
+    Py_BEGIN_ALLOW_THREADS;
+    if(threads > 0){
+        jpeg_parallel_run(threads, reencode_batch_worker, &batch);
+    }
+    Py_END_ALLOW_THREADS;
 
-    result = PyBytes_FromStringAndSize(output_buffer, bytes_header + bytes_scan);
+    result = PyList_New(batch.n_frames);
     if(!result){
-        PyErr_SetString(PyExc_TypeError, "Could not create bytes");
-
         goto Return;
     }
-    jpeg_destroy(&jpeg);
+
+    for(int i=0; i<batch.n_frames; i++){
+        struct reencode_batch_frame* frame = batch.frames + i;
+        PyObject* item = finish_output(frame->output, frame->output_size);
+        frame->output = NULL;
+        if(!item){
+            Py_CLEAR(result);
+            goto Return;
+        }
+
+        // The list takes over the reference
+        PyList_SET_ITEM(result, i, item);
+    }
 
 Return:
-    Py_END_ALLOW_THREADS;
-    free(output_buffer);
+    for(int i=0; i<n_views; i++){
+        PyBuffer_Release(&batch.frames[i].view);
+        Py_XDECREF(batch.frames[i].output);
+    }
+    free(batch.frames);
+    Py_DECREF(sequence);
     return result;
 }
 
+static PyObject* jpeg_reencode_trace_start(PyObject* self, PyObject* args){
+#ifndef JPEG_TRACE
+    PyErr_SetString(PyExc_RuntimeError, "jpeg_reencode was built without trace");
+    return NULL;
+#endif
+
+    jpeg_trace_start();
+    Py_RETURN_NONE;
+}
+
+static PyObject* jpeg_reencode_trace_stop(PyObject* self, PyObject* args){
+    jpeg_trace_stop();
+
+    char* json = NULL;
+    size_t size = 0;
+    FILE* f = open_memstream(&json, &size);
+    if(!f){
+        return PyErr_NoMemory();
+    }
+    jpeg_trace_write(f);
+    fclose(f);
+
+    PyObject* result = PyUnicode_FromStringAndSize(json, size);
+    free(json);
+    return result;
+}
+
+typedef struct {
+    PyObject_HEAD
+    int initialised;
+
+    /* Set while a frame is reencoded without the GIL */
+    int busy;
+    struct jpeg_rate_control rate_control;
+    struct jpeg_context context;
+} RateControllerObject;
+
+static int RateController_init(RateControllerObject* self, PyObject* args, PyObject* kwargs){
+    static char* keywords[] = { "bitrate", "fps", "min_factor", "max_factor", NULL };
+
+    double bitrate;
+    double fps;
+    float min_factor = 1.;
+    float max_factor = 64.;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "dd|ff", keywords, &bitrate, &fps, &min_factor, &max_factor)){
+        return -1;
+    }
+
+    if(bitrate <= 0 || fps <= 0 || min_factor <= 0 || max_factor < min_factor){
+        PyErr_SetString(PyExc_ValueError, "Invalid parameters");
+        return -1;
+    }
+
+    if(self->busy){
+        PyErr_SetString(PyExc_RuntimeError, "RateController is in use");
+        return -1;
+    }
+
+    if(self->initialised){
+        jpeg_rate_control_destroy(&self->rate_control);
+        jpeg_context_destroy(&self->context);
+    }
+    jpeg_rate_control_init(&self->rate_control, bitrate, fps, min_factor, max_factor);
+    jpeg_context_init(&self->context);
+    self->initialised = 1;
+
+    return 0;
+}
+
+static void RateController_dealloc(RateControllerObject* self){
+    if(self->initialised){
+        jpeg_rate_control_destroy(&self->rate_control);
+        jpeg_context_destroy(&self->context);
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* RateController_reencode(RateControllerObject* self, PyObject* args){
+    Py_buffer buffer;
+    if(!PyArg_ParseTuple(args, "y*", &buffer)){
+        return NULL;
+    }
+
+    if(!self->initialised || self->busy){
+        PyErr_SetString(PyExc_RuntimeError, self->busy ? "RateController is in use" : "RateController is not initialised");
+        PyBuffer_Release(&buffer);
+        return NULL;
+    }
+
+    PyObject* result = NULL;
+    long result_size = parse_frame(&self->context, buffer.buf, buffer.len, 0, NULL);
+    if(result_size < 0){
+        set_error(result_size);
+    }else{
+        result = PyBytes_FromStringAndSize(NULL, result_size);
+    }
+
+    if(result){
+        unsigned char* output = (unsigned char*)PyBytes_AS_STRING(result);
+        self->busy = 1;
+        Py_BEGIN_ALLOW_THREADS;
+        result_size = reencode_frame(&self->context, NULL, 0, &self->rate_control, output, result_size);
+        Py_END_ALLOW_THREADS;
+        self->busy = 0;
+
+        result = finish_output(result, result_size);
+    }
+
+    PyBuffer_Release(&buffer);
+    return result;
+}
+
+static PyObject* RateController_get_factor(RateControllerObject* self, void* closure){
+    return PyFloat_FromDouble(self->initialised ? self->rate_control.factor : 0.);
+}
+
+static PyMethodDef RateController_methods[] = {
+    { "reencode",          (PyCFunction)&RateController_reencode,       METH_VARARGS,
+        "reencode(data)\n\n"
+        "Reencode a frame at the factor chosen for it and account for its size" },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef RateController_getset[] = {
+    { "factor", (getter)&RateController_get_factor, NULL, "Factor used for the last frame", NULL },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyTypeObject RateControllerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "jpeg_reencode.RateController",
+    .tp_doc = "RateController(bitrate, fps, min_factor=1.0, max_factor=64.0)\n\n"
+        "Chooses the factor of each frame so the output follows bitrate (bits per second) at fps frames per second",
+    .tp_basicsize = sizeof(RateControllerObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)&RateController_init,
+    .tp_dealloc = (destructor)&RateController_dealloc,
+    .tp_methods = RateController_methods,
+    .tp_getset = RateController_getset,
+};
+
 
 static PyMethodDef jpeg_reencode_methods[] = {
-    { "reencode",          &jpeg_reencode_reencode,     METH_VARARGS,   "" },
+    { "reencode",          (PyCFunction)&jpeg_reencode_reencode,        METH_VARARGS | METH_KEYWORDS,
+        "reencode(data, factor, optimise=False, restart_interval=0, stats=False, chroma_factor=0, luma_matrix=None, "
+        "chroma_matrix=None, dead_zone=None)\n\n"
+        "Reencode data, restart_interval is the number of MCUs between restart markers in the output (0 for none). "
+        "With stats, (data, dict of counters) is returned, which needs a build with the stats option. "
+        "chroma_factor replaces factor for chroma if it is positive, matrices are 64 multipliers of the factor "
+        "in zigzag order. dead_zone holds 64 magnitudes in output steps below which coefficients are zeroed "
+        "(0 for none, inf to drop the position)" },
+    { "reencode_into",     &jpeg_reencode_reencode_into,                METH_VARARGS,
+        "reencode_into(src, dst, factor, optimise=False)\n\n"
+        "Reencode src into the writable buffer dst, returns the number of bytes written" },
+    { "reencode_many",     (PyCFunction)&jpeg_reencode_reencode_many,   METH_VARARGS | METH_KEYWORDS,
+        "reencode_many(frames, factor, threads=0, optimise=False, restart_interval=0, chroma_factor=0, "
+        "luma_matrix=None, chroma_matrix=None, dead_zone=None)\n\n"
+        "Reencode a sequence of buffers on a pool of threads (all cores if threads <= 0), results are returned in order" },
+    { "trace_start",       &jpeg_reencode_trace_start,                  METH_NOARGS,
+        "trace_start()\n\n"
+        "Start recording trace spans of all threads, needs a build with the trace option" },
+    { "trace_stop",        &jpeg_reencode_trace_stop,                   METH_NOARGS,
+        "trace_stop()\n\n"
+        "Stop recording, returns the spans as Chrome trace-event JSON" },
     { NULL, NULL, 0, NULL }
 };
 
@@ -68,5 +635,21 @@ static struct PyModuleDef jpeg_reencode = {
 };
 
 PyMODINIT_FUNC PyInit_jpeg_reencode(void){
-    return PyModule_Create(&jpeg_reencode);
+    if(PyType_Ready(&RateControllerType) < 0){
+        return NULL;
+    }
+
+    PyObject* module = PyModule_Create(&jpeg_reencode);
+    if(!module){
+        return NULL;
+    }
+
+    Py_INCREF(&RateControllerType);
+    if(PyModule_AddObject(module, "RateController", (PyObject*)&RateControllerType) < 0){
+        Py_DECREF(&RateControllerType);
+        Py_DECREF(module);
+        return NULL;
+    }
+
+    return module;
 }
@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include "arena.h"
+
+/* Enough for the tables of a typical image */
+#define ARENA_CHUNK_SIZE 32768
+
+struct jpeg_arena_chunk {
+    struct jpeg_arena_chunk* next;
+    long size;
+    long used;
+    max_align_t data[];
+};
+
+static struct jpeg_arena_chunk* chunk_new(long size, struct jpeg_arena_chunk* next){
+    struct jpeg_arena_chunk* chunk = malloc(sizeof(struct jpeg_arena_chunk) + size);
+    if(!chunk){
+        return 0;
+    }
+
+    chunk->next = next;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+static void chunks_free(struct jpeg_arena_chunk* chunk){
+    while(chunk){
+        struct jpeg_arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+void jpeg_arena_init(struct jpeg_arena* arena){
+    arena->chunk = 0;
+}
+
+void jpeg_arena_destroy(struct jpeg_arena* arena){
+    chunks_free(arena->chunk);
+    arena->chunk = 0;
+}
+
+void jpeg_arena_reset(struct jpeg_arena* arena){
+    struct jpeg_arena_chunk* chunk = arena->chunk;
+    if(chunk && chunk->next){
+        // Replace all chunks by one that fits everything
+        long size = 0;
+        for(struct jpeg_arena_chunk* c = chunk; c; c = c->next){
+            size += c->size;
+        }
+
+        chunks_free(chunk);
+        arena->chunk = chunk_new(size, 0);
+    }else if(chunk){
+        chunk->used = 0;
+    }
+}
+
+void* jpeg_arena_alloc(struct jpeg_arena* arena, long size){
+    size = (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+
+    struct jpeg_arena_chunk* chunk = arena->chunk;
+    if(!chunk || chunk->used + size > chunk->size){
+        // Grow geometrically, so there are few chunks to merge on reset
+        long chunk_size = chunk ? 2 * chunk->size : ARENA_CHUNK_SIZE;
+        if(chunk_size < size){
+            chunk_size = size;
+        }
+
+        chunk = chunk_new(chunk_size, arena->chunk);
+        if(!chunk){
+            return 0;
+        }
+        arena->chunk = chunk;
+    }
+
+    void* result = (unsigned char*)chunk->data + chunk->used;
+    chunk->used += size;
+    return result;
+}
@@ -0,0 +1,428 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include "jpeg.h"
+#include "parallel.h"
+
+#define MAX_SWEEP 16
+
+static double now(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1.e-9 * time.tv_nsec;
+}
+
+struct bench_file {
+    char* name;
+    unsigned char* data;
+    long size;
+
+    /* Output of the last run */
+    long output_size;
+
+    /* Wall time of each timed run */
+    double* seconds;
+};
+
+struct bench_summary {
+    int n_runs;
+    double p50;
+    double p95;
+    double p99;
+    double mean;
+
+    double seconds;
+    double bytes_input;
+    double bytes_output;
+};
+
+static int compare_double(const void* a, const void* b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest rank, sorted must be sorted */
+static double percentile(double* sorted, int n, double p){
+    int rank = (int)ceil(p * n);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void summarise(struct bench_summary* summary, double* seconds, int n_runs, double bytes_input, double bytes_output){
+    double* sorted = malloc(n_runs * sizeof(double));
+    memcpy(sorted, seconds, n_runs * sizeof(double));
+    qsort(sorted, n_runs, sizeof(double), compare_double);
+
+    summary->n_runs = n_runs;
+    summary->p50 = percentile(sorted, n_runs, 0.50);
+    summary->p95 = percentile(sorted, n_runs, 0.95);
+    summary->p99 = percentile(sorted, n_runs, 0.99);
+
+    summary->seconds = 0;
+    for(int i=0; i<n_runs; i++){
+        summary->seconds += sorted[i];
+    }
+    summary->mean = summary->seconds / n_runs;
+    summary->bytes_input = bytes_input;
+    summary->bytes_output = bytes_output;
+
+    free(sorted);
+}
+
+/*
+ * Same steps as the CLI: parse, optionally optimise, write header and scan.
+ * output is grown to jpeg_reencode_max_size, which only happens in the first
+ * warm-up run of the largest frames.
+ */
+static long reencode_once(struct bench_file* file, unsigned char** output, long* output_capacity,
+        float factor, int optimise, int restart_interval, int threads){
+    struct jpeg jpeg;
+    long status = jpeg_init(&jpeg, file->size, file->data);
+    if(status){
+        return status;
+    }
+
+    for(int i=0; i<jpeg.n_quantisation_tables; i++){
+        jpeg_quantisation_table_init_recompress(jpeg.quantisation_tables[i], factor);
+    }
+    jpeg.output_restart_interval = restart_interval;
+
+    long output_size = jpeg_reencode_max_size(&jpeg);
+    if(*output_capacity < output_size){
+        free(*output);
+        *output = malloc(output_size);
+        *output_capacity = *output ? output_size : 0;
+        if(!*output){
+            jpeg_destroy(&jpeg);
+            return E_FULL;
+        }
+    }
+
+    if(optimise){
+        status = jpeg_decode_huffman_parallel(&jpeg, threads);
+        if(!status){
+            status = jpeg_optimise_huffman(&jpeg);
+        }
+    }
+
+    long bytes_header = 0;
+    if(!status){
+        bytes_header = jpeg_write_recompress_header(&jpeg, *output, output_size);
+        status = bytes_header < 0 ? bytes_header : 0;
+    }
+
+    if(!status){
+        long bytes_scan = jpeg_reencode_huffman_parallel(&jpeg, *output + bytes_header, output_size - bytes_header, threads);
+        status = bytes_scan < 0 ? bytes_scan : bytes_header + bytes_scan;
+    }
+
+    jpeg_destroy(&jpeg);
+    return status;
+}
+
+static int has_jpeg_extension(const char* name){
+    const char* dot = strrchr(name, '.');
+    return dot && (!strcasecmp(dot, ".jpg") || !strcasecmp(dot, ".jpeg"));
+}
+
+static int compare_files(const void* a, const void* b){
+    return strcmp(((const struct bench_file*)a)->name, ((const struct bench_file*)b)->name);
+}
+
+/* Load all JPEGs of directory, sorted by name. Returns the number of files or -1 */
+static int load_files(const char* directory, struct bench_file** files){
+    DIR* dir = opendir(directory);
+    if(!dir){
+        return -1;
+    }
+
+    int n_files = 0;
+    int capacity = 0;
+    *files = 0;
+
+    struct dirent* entry;
+    while((entry = readdir(dir))){
+        if(!has_jpeg_extension(entry->d_name)){
+            continue;
+        }
+
+        char* path = malloc(strlen(directory) + strlen(entry->d_name) + 2);
+        sprintf(path, "%s/%s", directory, entry->d_name);
+
+        FILE* f = fopen(path, "rb");
+        free(path);
+        if(!f){
+            continue;
+        }
+
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        unsigned char* data = malloc(size > 0 ? size : 1);
+        if(size <= 0 || fread(data, size, 1, f) != 1){
+            free(data);
+            fclose(f);
+            continue;
+        }
+        fclose(f);
+
+        if(n_files == capacity){
+            capacity = capacity ? 2 * capacity : 16;
+            *files = realloc(*files, capacity * sizeof(struct bench_file));
+        }
+
+        struct bench_file* file = *files + n_files++;
+        file->name = strdup(entry->d_name);
+        file->data = data;
+        file->size = size;
+        file->output_size = 0;
+        file->seconds = 0;
+    }
+    closedir(dir);
+
+    if(n_files){
+        qsort(*files, n_files, sizeof(struct bench_file), compare_files);
+    }
+    return n_files;
+}
+
+/* Comma separated thread counts, returns how many were read */
+static int parse_sweep(char* list, int* sweep){
+    int n = 0;
+    for(char* at = list; *at && n < MAX_SWEEP; ){
+        sweep[n++] = jpeg_parallel_threads(atoi(at));
+        at = strchr(at, ',');
+        if(!at){
+            break;
+        }
+        at++;
+    }
+    return n;
+}
+
+/* 1, 2, 4, ... up to the number of cores, which is always included */
+static int default_sweep(int* sweep){
+    int cores = jpeg_parallel_threads(0);
+    int n = 0;
+    for(int threads=1; threads < cores && n < MAX_SWEEP - 1; threads *= 2){
+        sweep[n++] = threads;
+    }
+    sweep[n++] = cores;
+    return n;
+}
+
+static void json_string(FILE* f, const char* string){
+    fputc('"', f);
+    for(const unsigned char* at = (const unsigned char*)string; *at; at++){
+        if(*at == '"' || *at == '\\'){
+            fprintf(f, "\\%c", *at);
+        }else if(*at < 0x20){
+            fprintf(f, "\\u%04x", *at);
+        }else{
+            fputc(*at, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void json_summary(FILE* f, struct bench_summary* summary){
+    fprintf(f, "\"runs\": %d, \"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f, \"mean_ms\": %.4f, "
+            "\"bytes_input\": %.0f, \"bytes_output\": %.0f, \"ratio\": %.4f, "
+            "\"mb_per_s_input\": %.3f, \"mb_per_s_output\": %.3f",
+            summary->n_runs, 1000. * summary->p50, 1000. * summary->p95, 1000. * summary->p99, 1000. * summary->mean,
+            summary->bytes_input, summary->bytes_output, summary->bytes_input / summary->bytes_output,
+            summary->bytes_input / summary->seconds * 1.e-6, summary->bytes_output / summary->seconds * 1.e-6);
+}
+
+static void print_summary(FILE* report, const char* name, struct bench_summary* summary){
+    fprintf(report, "%-24s %8.3f %8.3f %8.3f %10.1f %10.1f %7.2f\n", name,
+            1000. * summary->p50, 1000. * summary->p95, 1000. * summary->p99,
+            summary->bytes_input / summary->seconds * 1.e-6, summary->bytes_output / summary->seconds * 1.e-6,
+            summary->bytes_input / summary->bytes_output);
+}
+
+static void usage(){
+    printf("Usage jpeg-reencode-bench [--optimise] [--restart <mcus>] [--repeat <n>] [--warmup <n>] [--threads <n,n,...>] [--json <file>]"
+            " <factor> <directory>\n");
+    exit(1);
+}
+
+int main(int argc, char** argv){
+    int optimise = 0;
+    int restart_interval = 0;
+    int repeat = 20;
+    int warmup = 3;
+    char* json_path = 0;
+
+    int sweep[MAX_SWEEP];
+    int n_sweep = 0;
+
+    char* args[2];
+    int n_args = 0;
+    for(int i=1; i<argc; i++){
+        if(!strcmp(argv[i], "--optimise")){
+            optimise = 1;
+        }else if(!strcmp(argv[i], "--restart") && i + 1 < argc){
+            restart_interval = atoi(argv[++i]);
+        }else if(!strcmp(argv[i], "--repeat") && i + 1 < argc){
+            repeat = atoi(argv[++i]);
+        }else if(!strcmp(argv[i], "--warmup") && i + 1 < argc){
+            warmup = atoi(argv[++i]);
+        }else if(!strcmp(argv[i], "--threads") && i + 1 < argc){
+            n_sweep = parse_sweep(argv[++i], sweep);
+        }else if(!strcmp(argv[i], "--json") && i + 1 < argc){
+            json_path = argv[++i];
+        }else if(n_args < 2){
+            args[n_args++] = argv[i];
+        }else{
+            usage();
+        }
+    }
+
+    if(n_args < 2 || repeat < 1 || warmup < 0 || restart_interval < 0 || restart_interval > 65535){
+        usage();
+    }
+    if(!n_sweep){
+        n_sweep = default_sweep(sweep);
+    }
+
+    float factor = atof(args[0]);
+
+    struct bench_file* files;
+    int n_files = load_files(args[1], &files);
+    if(n_files <= 0){
+        printf("No JPEGs found in %s\n", args[1]);
+        exit(1);
+    }
+
+    for(int i=0; i<n_files; i++){
+        files[i].seconds = malloc(repeat * sizeof(double));
+    }
+
+    unsigned char* output = 0;
+    long output_capacity = 0;
+
+    FILE* json = 0;
+    if(json_path){
+        json = strcmp(json_path, "-") ? fopen(json_path, "w") : stdout;
+        if(!json){
+            printf("Could not open %s\n", json_path);
+            exit(1);
+        }
+        fprintf(json, "{\"factor\": %f, \"optimise\": %s, \"restart\": %d, \"repeat\": %d, \"warmup\": %d, \"sweep\": [\n",
+                factor, optimise ? "true" : "false", restart_interval, repeat, warmup);
+    }
+
+    // Report goes to stderr if the JSON takes stdout
+    FILE* report = json == stdout ? stderr : stdout;
+
+    double base_throughput = 0;
+    double* all_seconds = malloc((long)n_files * repeat * sizeof(double));
+
+    for(int s=0; s<n_sweep; s++){
+        int threads = sweep[s];
+        fprintf(report, "\n%d thread(s), factor %.2f%s, restart %d, %d runs after %d warm-up\n",
+                threads, factor, optimise ? ", optimised" : "", restart_interval, repeat, warmup);
+        fprintf(report, "%-24s %8s %8s %8s %10s %10s %7s\n", "file", "p50 ms", "p95 ms", "p99 ms", "MB/s in", "MB/s out", "ratio");
+        fflush(report);
+
+        if(json){
+            fprintf(json, "%s  {\"threads\": %d, \"files\": [\n", s ? ",\n" : "", threads);
+        }
+
+        int n_ok = 0;
+        int n_all = 0;
+        double bytes_input = 0;
+        double bytes_output = 0;
+        for(int i=0; i<n_files; i++){
+            struct bench_file* file = files + i;
+
+            long result = 0;
+            for(int r=0; r<warmup && result >= 0; r++){
+                result = reencode_once(file, &output, &output_capacity, factor, optimise, restart_interval, threads);
+            }
+            for(int r=0; r<repeat && result >= 0; r++){
+                double start = now();
+                result = reencode_once(file, &output, &output_capacity, factor, optimise, restart_interval, threads);
+                file->seconds[r] = now() - start;
+            }
+
+            if(result < 0){
+                fprintf(report, "%-24s error %ld\n", file->name, result);
+                if(json){
+                    fprintf(json, "%s    {\"file\": ", n_ok ? ",\n" : "");
+                    json_string(json, file->name);
+                    fprintf(json, ", \"error\": %ld}", result);
+                    n_ok++;
+                }
+                continue;
+            }
+            file->output_size = result;
+
+            struct bench_summary summary;
+            summarise(&summary, file->seconds, repeat, (double)file->size * repeat, (double)file->output_size * repeat);
+            print_summary(report, file->name, &summary);
+
+            if(json){
+                fprintf(json, "%s    {\"file\": ", n_ok ? ",\n" : "");
+                json_string(json, file->name);
+                fprintf(json, ", ");
+                json_summary(json, &summary);
+                fprintf(json, "}");
+            }
+            n_ok++;
+
+            memcpy(all_seconds + n_all, file->seconds, repeat * sizeof(double));
+            n_all += repeat;
+            bytes_input += summary.bytes_input;
+            bytes_output += summary.bytes_output;
+        }
+
+        if(!n_all){
+            if(json){
+                fprintf(json, "\n  ], \"total\": null}");
+            }
+            continue;
+        }
+
+        // Percentiles over the runs of all files, throughput over their total time
+        struct bench_summary total;
+        summarise(&total, all_seconds, n_all, bytes_input, bytes_output);
+        print_summary(report, "total", &total);
+
+        double throughput = total.bytes_input / total.seconds;
+        if(!base_throughput){
+            base_throughput = throughput;
+        }
+        fprintf(report, "Speedup over %d thread(s): %.2fx\n", sweep[0], throughput / base_throughput);
+
+        if(json){
+            fprintf(json, "\n  ], \"total\": {");
+            json_summary(json, &total);
+            fprintf(json, ", \"speedup\": %.4f}}", throughput / base_throughput);
+        }
+    }
+
+    if(json){
+        fprintf(json, "\n]}\n");
+        if(json != stdout){
+            fclose(json);
+        }
+    }
+
+    for(int i=0; i<n_files; i++){
+        free(files[i].name);
+        free(files[i].data);
+        free(files[i].seconds);
+    }
+    free(files);
+    free(all_seconds);
+    free(output);
+    return 0;
+}
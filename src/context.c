@@ -0,0 +1,150 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "jpeg.h"
+
+void jpeg_context_init(struct jpeg_context* context){
+    context->initialised = 0;
+
+    context->header = 0;
+    context->header_size = 0;
+    context->header_capacity = 0;
+
+    context->recompress_header = 0;
+    context->recompress_header_size = -1;
+    context->recompress_header_capacity = 0;
+
+    context->n_frames = 0;
+    context->n_reused = 0;
+}
+
+void jpeg_context_destroy(struct jpeg_context* context){
+    if(context->initialised){
+        jpeg_destroy(&context->jpeg);
+        context->initialised = 0;
+    }
+
+    free(context->header);
+    context->header = 0;
+    free(context->recompress_header);
+    context->recompress_header = 0;
+}
+
+/* Optimised huffman tables replace the parsed ones, so they cannot be reused */
+static int has_optimised_tables(struct jpeg* jpeg){
+    for(int i=0; i<jpeg->n_dc_huffman_tables; i++){
+        if(jpeg->dc_huffman_tables[i] && jpeg->dc_huffman_tables[i]->n_optimised) return 1;
+    }
+    for(int i=0; i<jpeg->n_ac_huffman_tables; i++){
+        if(jpeg->ac_huffman_tables[i] && jpeg->ac_huffman_tables[i]->n_optimised) return 1;
+    }
+    return 0;
+}
+
+int jpeg_context_parse(struct jpeg_context* context, long size, unsigned char* data){
+    struct jpeg* jpeg = &context->jpeg;
+    context->n_frames++;
+
+    if(context->header_size > 0 && size >= context->header_size &&
+            !memcmp(data, context->header, context->header_size) && !has_optimised_tables(jpeg)){
+        // Same header: only point the segments at the new frame
+        for(struct jpeg_segment* segment = jpeg->first_segment; segment; segment = segment->next_segment){
+            segment->data = data + (segment->data - jpeg->data);
+        }
+        jpeg->data = data;
+        jpeg->size = size;
+
+        // Output options start over like after jpeg_init
+        jpeg->output_restart_interval = 0;
+        jpeg->stats = 0;
+
+        free(jpeg->blocks);
+        jpeg->blocks = 0;
+
+        context->n_reused++;
+        return 0;
+    }
+
+    context->header_size = 0;
+    context->recompress_header_size = -1;
+
+    int status;
+    if(context->initialised){
+        status = jpeg_reinit(jpeg, size, data);
+    }else{
+        status = jpeg_init(jpeg, size, data);
+        context->initialised = !status;
+    }
+
+    if(status){
+        return status;
+    }
+
+    // Remember everything up to the scan
+    struct jpeg_segment* sos = jpeg_find_segment(jpeg, 0xDA, 0);
+    long header_size = sos->data + sos->size - data;
+    if(header_size > context->header_capacity){
+        free(context->header);
+        context->header = malloc(header_size);
+        context->header_capacity = header_size;
+    }
+    memcpy(context->header, data, header_size);
+    context->header_size = header_size;
+
+    return 0;
+}
+
+long jpeg_context_write_recompress_header(struct jpeg_context* context, unsigned char* buffer, long buffer_size){
+    struct jpeg* jpeg = &context->jpeg;
+
+    int valid = context->recompress_header_size >= 0 && !has_optimised_tables(jpeg) &&
+        context->recompress_restart_interval == jpeg->output_restart_interval;
+    for(int i=0; i<jpeg->n_quantisation_tables && valid; i++){
+        if(jpeg->quantisation_tables[i] && memcmp(jpeg->quantisation_tables[i]->recompress_multipliers,
+                    context->recompress_multipliers[i], sizeof(context->recompress_multipliers[i]))){
+            valid = 0;
+        }
+    }
+
+    if(!valid){
+        long size = jpeg_recompress_header_size(jpeg);
+        if(size > context->recompress_header_capacity){
+            free(context->recompress_header);
+            context->recompress_header = malloc(size);
+            context->recompress_header_capacity = size;
+        }
+
+        long written = jpeg_write_recompress_header(jpeg, context->recompress_header, size);
+        if(written < 0){
+            context->recompress_header_size = -1;
+            return written;
+        }
+
+        context->recompress_header_size = written;
+        context->recompress_restart_interval = jpeg->output_restart_interval;
+        for(int i=0; i<jpeg->n_quantisation_tables; i++){
+            if(jpeg->quantisation_tables[i]){
+                memcpy(context->recompress_multipliers[i], jpeg->quantisation_tables[i]->recompress_multipliers,
+                        sizeof(context->recompress_multipliers[i]));
+            }
+        }
+
+        // Optimised tables depend on the frame, so do not keep their header
+        if(has_optimised_tables(jpeg)){
+            context->recompress_header_size = -1;
+            if(written > buffer_size){
+                return E_FULL;
+            }
+            memcpy(buffer, context->recompress_header, written);
+            return written;
+        }
+    }
+
+    if(context->recompress_header_size > buffer_size){
+        return E_FULL;
+    }
+    memcpy(buffer, context->recompress_header, context->recompress_header_size);
+    return context->recompress_header_size;
+}
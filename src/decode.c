@@ -4,114 +4,64 @@
 #include <stdint.h>
 #include <math.h>
 #include <string.h>
+#include <stdatomic.h>
 #include "jpeg.h"
 #include "huffman.h"
+#include "parallel.h"
+#include "trace.h"
 
 
 void jpeg_ibitstream_init(struct jpeg_ibitstream* stream, unsigned char* data, long size){
+    stream->buffer = 0;
+    stream->bits = 0;
     stream->at = data;
-    stream->at_restart = 0;
-    stream->at_bit = 0;
     stream->size_bytes = size;
+    stream->loaded = 0;
+    stream->marker = 0;
 }
 
 int jpeg_ibitstream_read(struct jpeg_ibitstream* stream, uint8_t* result){
-
-    if(stream->size_bytes == 0) return E_EMPTY;
-    if(stream->at_restart){
-        stream->at_restart = 0;
-        return E_RESTART;
-    }
-
-    *result = ((*stream->at) >> (7 - stream->at_bit)) & 1;
-
-    if(stream->at_bit == 7){
-        if(
-            stream->size_bytes >= 2 && 
-            stream->at[0] == 0xFF &&
-            stream->at[1] == 0x00
-        ){
-            stream->at++;
-            stream->size_bytes--;
-        }
-
-        if(
-            stream->size_bytes >= 3 &&
-            stream->at[1] == 0xFF &&
-            stream->at[2] != 0x00
-        ){
-            stream->at += 2;
-            stream->size_bytes -= 2;
-
-            // EOS marker
-            if(*stream->at == 0xD9){
-                stream->size_bytes = 1;
-            }
-
-            // Restart marker
-            if(*stream->at >= 0xD0 && *stream->at <= 0xD7){
-                stream->at_restart = 1;
-            }
-        }
-
-        stream->at_bit = 0;
-        stream->at++;
-        stream->size_bytes--;
-    }else{
-        stream->at_bit++;
-    }
-
-    return 0;
+    uint32_t bit = 0;
+    int status = jpeg_ibitstream_read_bits(stream, 1, &bit);
+    *result = bit;
+    return status;
 }
 
-static inline int from_ssss(uint8_t ssss, struct jpeg_ibitstream* stream, int* value){
-    if(ssss == 0){
-        *value = 0;
+int jpeg_ibitstream_at_end(struct jpeg_ibitstream* stream){
+    jpeg_ibitstream_fill(stream);
+    if(stream->bits >= 8){
         return 0;
     }
 
-    int basevalue = 1 << (ssss - 1);
-
-    uint8_t positive; 
-    int status = jpeg_ibitstream_read(stream, &positive);
-    if(status){
-        return status;
-    }
-
-    if(!positive){
-        basevalue = 1 - 2*basevalue;
-    }
-
-    int additional = 0;
-    for(int i=0; i<ssss - 1; i++){
-        uint8_t next_bit;
-        int status = jpeg_ibitstream_read(stream, &next_bit);
-        if(status){
-            return status;
-        }
-        additional = (additional << 1) + next_bit;
-    }
-
-    *value = basevalue + additional;
-    return 0;
+    return stream->marker == 0xD9 || (!stream->marker && stream->size_bytes == 0);
 }
 
-static inline int read_dc_value(struct jpeg_ibitstream* stream, struct huffman_tree* tree, int* value){
+static inline int read_dc_value(struct jpeg_ibitstream* stream, struct huffman_lookup* lookup, int* value,
+        struct jpeg_stats* stats){
+#ifdef JPEG_STATS
+    long position = jpeg_ibitstream_position(stream);
+#endif
     uint8_t ssss;
-    int status = huffman_tree_decode(tree, stream, &ssss);
+    int status = huffman_lookup_decode(lookup, stream, &ssss);
     if(status){
         return status;
     }
+    JPEG_STATS_ADD(stats, symbols[jpeg_ibitstream_position(stream) - position], 1);
 
-    return from_ssss(ssss, stream, value);
+    return huffman_from_ssss(ssss, stream, value);
 }
 
-static inline int read_ac_value(struct jpeg_ibitstream* stream, struct huffman_tree* tree, int* value, uint8_t* leading_zeros){
+static inline int read_ac_value(struct jpeg_ibitstream* stream, struct huffman_lookup* lookup, int* value, uint8_t* leading_zeros,
+        struct jpeg_stats* stats){
+#ifdef JPEG_STATS
+    long position = jpeg_ibitstream_position(stream);
+#endif
     uint8_t rrrrssss;
-    int status = huffman_tree_decode(tree, stream, &rrrrssss);
+    int status = huffman_lookup_decode(lookup, stream, &rrrrssss);
     if(status){
         return status;
     }
+    JPEG_STATS_ADD(stats, symbols[jpeg_ibitstream_position(stream) - position], 1);
 
     uint8_t rrrr = (rrrrssss & 0xF0) / 16;
     uint8_t ssss = rrrrssss & 0x0F;
@@ -120,25 +70,28 @@ static inline int read_ac_value(struct jpeg_ibitstream* stream, struct huffman_t
         // Terminate
         *leading_zeros = 64;
         *value = 0;
+        JPEG_STATS_ADD(stats, eob_read, 1);
 
         return 0;
     }else if(rrrr == 15 && ssss == 0){
         // 16 zeros
         *leading_zeros = 15;
         *value = 0;
+        JPEG_STATS_ADD(stats, zrl_read, 1);
 
         return 0;
     }else{
         // rrrr zeros followed by value specified through ssss
         *leading_zeros = rrrr;
 
-        return from_ssss(ssss, stream, value);
+        return huffman_from_ssss(ssss, stream, value);
     }
 }
 
-static inline int decode_block(int16_t* result, struct jpeg_ibitstream* stream, int* dc_offset, struct huffman_tree* dc_tree, struct huffman_tree* ac_tree){
+static inline int decode_block(int16_t* result, struct jpeg_ibitstream* stream, int* dc_offset, struct huffman_lookup* dc_lookup, struct huffman_lookup* ac_lookup,
+        struct jpeg_stats* stats){
     int value = 0;
-    int status = read_dc_value(stream, dc_tree, &value);
+    int status = read_dc_value(stream, dc_lookup, &value, stats);
     value += *dc_offset;
     *dc_offset = value;
 
@@ -151,7 +104,7 @@ static inline int decode_block(int16_t* result, struct jpeg_ibitstream* stream,
     for(int i=1; i<64; i++){
         uint8_t leading_zeros;
         int value;
-        int status = read_ac_value(stream, ac_tree, &value, &leading_zeros);
+        int status = read_ac_value(stream, ac_lookup, &value, &leading_zeros, stats);
         if(status){
             return status;
         }
@@ -167,11 +120,88 @@ static inline int decode_block(int16_t* result, struct jpeg_ibitstream* stream,
     return 0;
 }
 
+/*
+ * Decode the blocks of a sequential scan from stream into blocks, or with
+ * blocks NULL only read them for the counters in stats
+ */
+static int decode_scan(struct jpeg* jpeg, struct jpeg_ibitstream* stream, struct jpeg_block* blocks, struct jpeg_stats* stats){
+    struct jpeg_component** loop = jpeg->loop;
+
+    int dc_offset[MAX_COMPONENTS] = { 0 };
+    struct jpeg_block scratch;
+
+    int component = 0;
+    for(int i=0; i<jpeg->n_blocks; i++){
+        struct jpeg_block* block = blocks ? blocks + i : &scratch;
+        block->component_id = loop[component]->id;
+        int dc_id = loop[component]->dc_huffman_id;
+        int ac_id = loop[component]->ac_huffman_id;
+
+#ifdef JPEG_STATS
+        long position = jpeg_ibitstream_position(stream);
+#endif
+
+        int done = 0;
+        int status = 0;
+        while(!done){
+#ifdef JPEG_STATS
+            struct jpeg_stats stats_stored;
+            if(stats){
+                stats_stored = *stats;
+            }
+#endif
+
+            status = decode_block(block->values, stream,
+                    dc_offset + loop[component]->id - 1,
+                    jpeg->dc_huffman_tables[dc_id]->huffman_lookup,
+                    jpeg->ac_huffman_tables[ac_id]->huffman_lookup,
+                    stats);
+
+            if(status == E_RESTART){
+                // Padding in front of the marker may have been decoded into the block
+                memset(block->values, 0, sizeof(block->values));
+                for(int i=0; i<MAX_COMPONENTS; i++) dc_offset[i] = 0;
+#ifdef JPEG_STATS
+                if(stats){
+                    *stats = stats_stored;
+                }
+                position = jpeg_ibitstream_position(stream);
+#endif
+            }else{
+                done = 1;
+            }
+        }
+
+        if(status){
+            return status;
+        }
+
+        JPEG_STATS_ADD(stats, component_bits_read[loop[component]->id - 1], jpeg_ibitstream_position(stream) - position);
+
+        component = (component + 1) % jpeg->loop_count;
+    }
+
+    // Assert we hit EOS
+    if(!jpeg_ibitstream_at_end(stream)){
+        return E_SIZE_MISMATCH;
+    }
+
+    return 0;
+}
+
 int jpeg_decode_huffman(struct jpeg* jpeg){
     if(jpeg->blocks){
         return E_ALREADY_DECODED;
     }
 
+    if(jpeg->progressive){
+        return jpeg_decode_progressive(jpeg);
+    }
+
+#ifdef JPEG_STATS
+    double start = jpeg->stats ? jpeg_stats_time() : 0;
+#endif
+
     jpeg->blocks = malloc(jpeg->n_blocks * sizeof(struct jpeg_block));
     memset(jpeg->blocks, 0, jpeg->n_blocks * sizeof(struct jpeg_block));
 
@@ -182,63 +212,310 @@ int jpeg_decode_huffman(struct jpeg* jpeg){
     struct jpeg_ibitstream stream;
     jpeg_ibitstream_init(&stream, scan_data, scan_size);
 
-    int loop_count = 0;
-    for(int i=0; i<jpeg->n_components; i++){
-        loop_count += jpeg->components[i]->vertical_sampling * jpeg->components[i]->horizontal_sampling;
+    int status = decode_scan(jpeg, &stream, jpeg->blocks, jpeg->stats);
+    if(status){
+        return status;
+    }
+
+#ifdef JPEG_STATS
+    if(jpeg->stats){
+        struct jpeg_stats* stats = jpeg->stats;
+        stats->bits_read += jpeg_ibitstream_position(&stream);
+        jpeg_stats_count_markers(scan_data, scan_size - 2, &stats->stuffed_read, &stats->restarts_read);
+        stats->seconds_decode += jpeg_stats_time() - start;
     }
+#endif
+
+    return 0;
+}
+
+/* Chunks below this size are not worth a thread */
+#define SPECULATIVE_MIN_CHUNK 16384
+
+/*
+ * Part of the scan decoded from a guessed state: the chunk is assumed to start
+ * with the first block of an MCU at its first bit. Until the previous chunk
+ * confirms one of the recorded block starts, the blocks are speculative.
+ */
+struct jpeg_speculative_chunk {
+    unsigned char* data;
+    long size;
+
+    /* Unstuffed bit offset of data within the scan */
+    long start;
+
+    /* Blocks starting at or after this offset belong to the next chunk */
+    long end;
 
-    struct jpeg_component** loop = malloc(loop_count * sizeof(struct jpeg_component*));
-    int k = 0;
-    for(int i=0; i<jpeg->n_components; i++){
-        int block_count = jpeg->components[i]->vertical_sampling * jpeg->components[i]->horizontal_sampling;
-        for(int j=0; j<block_count; j++){
-            loop[k++] = jpeg->components[i];
+    /* State after the last block decoded without error */
+    struct jpeg_ibitstream stream;
+    int next_slot;
+    int status;
+
+    /* Decoded blocks, DC values are not yet added to the predictor */
+    int n_blocks;
+    int capacity;
+    struct jpeg_block* blocks;
+    long* positions;
+};
+
+struct jpeg_decode_speculative {
+    struct jpeg* jpeg;
+    struct jpeg_component** loop;
+    int loop_count;
+
+    int n_chunks;
+    struct jpeg_speculative_chunk* chunks;
+    atomic_int next_chunk;
+};
+
+static inline long chunk_position(struct jpeg_speculative_chunk* chunk, struct jpeg_ibitstream* stream){
+    return chunk->start + jpeg_ibitstream_position(stream);
+}
+
+/* Decode the block at the current position of stream without the DC prediction */
+static inline int decode_block_difference(struct jpeg* jpeg, struct jpeg_component* component, struct jpeg_ibitstream* stream, int16_t* values){
+    memset(values, 0, 64 * sizeof(int16_t));
+
+    int dc_offset = 0;
+    struct jpeg_ibitstream next = *stream;
+    int status = decode_block(values, &next, &dc_offset,
+            jpeg->dc_huffman_tables[component->dc_huffman_id]->huffman_lookup,
+            jpeg->ac_huffman_tables[component->ac_huffman_id]->huffman_lookup, NULL);
+
+    if(!status){
+        *stream = next;
+    }
+    return status;
+}
+
+static void decode_chunk(struct jpeg_decode_speculative* speculative, struct jpeg_speculative_chunk* chunk){
+    chunk->next_slot = 0;
+    chunk->status = 0;
+    chunk->n_blocks = 0;
+
+    while(chunk_position(chunk, &chunk->stream) < chunk->end && chunk->n_blocks < speculative->jpeg->n_blocks){
+        if(chunk->n_blocks == chunk->capacity){
+            chunk->capacity = 2 * chunk->capacity + 64;
+            chunk->blocks = realloc(chunk->blocks, chunk->capacity * sizeof(struct jpeg_block));
+            chunk->positions = realloc(chunk->positions, chunk->capacity * sizeof(long));
+        }
+
+        struct jpeg_component* component = speculative->loop[chunk->next_slot];
+        chunk->positions[chunk->n_blocks] = chunk_position(chunk, &chunk->stream);
+        chunk->blocks[chunk->n_blocks].component_id = component->id;
+
+        chunk->status = decode_block_difference(speculative->jpeg, component, &chunk->stream, chunk->blocks[chunk->n_blocks].values);
+        if(chunk->status){
+            break;
         }
+
+        chunk->n_blocks++;
+        chunk->next_slot = (chunk->next_slot + 1) % speculative->loop_count;
     }
+}
 
-    int dc_offset[MAX_COMPONENTS] = { 0 };
+static void* decode_speculative_worker(void* arg){
+    struct jpeg_decode_speculative* speculative = arg;
 
-    int component = 0;
-    for(int i=0; i<jpeg->n_blocks; i++){
-        jpeg->blocks[i].component_id = loop[component]->id;
-        int dc_id = loop[component]->dc_huffman_id;
-        int ac_id = loop[component]->ac_huffman_id;
+    int i;
+    while((i = atomic_fetch_add(&speculative->next_chunk, 1)) < speculative->n_chunks){
+        JPEG_TRACE_BEGIN(span);
+        decode_chunk(speculative, speculative->chunks + i);
+        JPEG_TRACE_END(span, "decode chunk", i);
+    }
 
-        int done = 0;
-        int status = 0;
-        while(!done){
-            status = decode_block(jpeg->blocks[i].values, &stream, 
-                    dc_offset + loop[component]->id - 1,
-                    jpeg->dc_huffman_tables[dc_id]->huffman_tree,
-                    jpeg->ac_huffman_tables[ac_id]->huffman_tree);
+    return 0;
+}
 
-            if(status == E_RESTART){
-                for(int i=0; i<MAX_COMPONENTS; i++) dc_offset[i] = 0;
-            }else{
-                done = 1;
-            }
+/* Index of the first recorded block at or after position */
+static int find_position(struct jpeg_speculative_chunk* chunk, long position){
+    int low = 0;
+    int high = chunk->n_blocks;
+    while(low < high){
+        int mid = (low + high) / 2;
+        if(chunk->positions[mid] < position){
+            low = mid + 1;
+        }else{
+            high = mid;
         }
+    }
+    return low;
+}
 
-        if(status){
-            free(loop);
-            return status;
+int jpeg_decode_huffman_parallel(struct jpeg* jpeg, int n_threads){
+    if(jpeg->blocks){
+        return E_ALREADY_DECODED;
+    }
+
+    // Scans depend on each other
+    if(jpeg->progressive){
+        return jpeg_decode_huffman(jpeg);
+    }
+
+    struct jpeg_segment* sos = jpeg_find_segment(jpeg, 0xDA, 0);
+    unsigned char* scan_data = sos->data + sos->size;
+    long scan_size = jpeg->size - (scan_data - jpeg->data);
+
+    n_threads = jpeg_parallel_threads(n_threads);
+    if(n_threads > scan_size / SPECULATIVE_MIN_CHUNK){
+        n_threads = scan_size / SPECULATIVE_MIN_CHUNK;
+    }
+
+    // Restart markers reset the predictors, the speculation does not handle that
+    if(n_threads <= 1 || jpeg->restart_interval){
+        return jpeg_decode_huffman(jpeg);
+    }
+
+#ifdef JPEG_STATS
+    double start = jpeg->stats ? jpeg_stats_time() : 0;
+#endif
+
+    struct jpeg_decode_speculative speculative;
+    speculative.jpeg = jpeg;
+
+    speculative.loop_count = jpeg->loop_count;
+    speculative.loop = jpeg->loop;
+
+    /*
+     * Byte-aligned chunks; the unstuffed offset of each start is the byte offset
+     * minus the stuffed zeros in front of it. Never start on a stuffed zero.
+     */
+    speculative.n_chunks = n_threads;
+    speculative.chunks = malloc(n_threads * sizeof(struct jpeg_speculative_chunk));
+    atomic_init(&speculative.next_chunk, 0);
+
+    long stuffed = 0;
+    unsigned char* counted = scan_data;
+    for(int i=0; i<n_threads; i++){
+        struct jpeg_speculative_chunk* chunk = speculative.chunks + i;
+
+        long offset = i * (scan_size / n_threads);
+        if(offset > 0 && scan_data[offset - 1] == 0xFF){
+            offset++;
         }
 
-        component = (component + 1) % loop_count;
+        for(unsigned char* ff = counted; (ff = memchr(ff, 0xFF, scan_data + offset - ff)); ff++){
+            stuffed++;
+        }
+        counted = scan_data + offset;
+
+        chunk->data = scan_data + offset;
+        chunk->size = scan_size - offset;
+        chunk->start = 8 * (offset - stuffed);
+        chunk->end = -1;
+        if(i > 0){
+            speculative.chunks[i - 1].end = chunk->start;
+        }
+
+        jpeg_ibitstream_init(&chunk->stream, chunk->data, chunk->size);
+        chunk->n_blocks = 0;
+        chunk->capacity = 0;
+        chunk->blocks = 0;
+        chunk->positions = 0;
     }
+    speculative.chunks[n_threads - 1].end = 8 * scan_size;
 
-    free(loop);
+    jpeg_parallel_run(n_threads, decode_speculative_worker, &speculative);
+
+    /*
+     * Serial pass: continue each chunk from its real end state until a block
+     * start coincides with one recorded by the next chunk, from there on the
+     * next chunk decoded the same blocks.
+     */
+    jpeg->blocks = malloc(jpeg->n_blocks * sizeof(struct jpeg_block));
 
-    // Move to byte boundary
-    if(stream.size_bytes > 0){
-        uint8_t dummy;
-        while(stream.at_bit != 0) jpeg_ibitstream_read(&stream, &dummy);
+    struct jpeg_speculative_chunk* current = speculative.chunks;
+    int n = current->n_blocks;
+    memcpy(jpeg->blocks, current->blocks, n * sizeof(struct jpeg_block));
+
+    int status = n < jpeg->n_blocks ? current->status : 0;
+    int slot = current->next_slot;
+    struct jpeg_ibitstream stream = current->stream;
+
+    for(int i=1; i<=n_threads && !status && n < jpeg->n_blocks; i++){
+        struct jpeg_speculative_chunk* next = i < n_threads ? speculative.chunks + i : 0;
+
+        while(!status && n < jpeg->n_blocks){
+            long position = chunk_position(current, &stream);
+
+            if(next){
+                if(position >= next->end){
+                    // Never synchronised, we decoded all of next ourselves
+                    break;
+                }
+
+                int j = find_position(next, position);
+                if(j < next->n_blocks && next->positions[j] == position && j % speculative.loop_count == slot){
+                    int count = next->n_blocks - j;
+                    if(count > jpeg->n_blocks - n){
+                        // More blocks than the frame has
+                        status = E_SIZE_MISMATCH;
+                        break;
+                    }
+                    memcpy(jpeg->blocks + n, next->blocks + j, count * sizeof(struct jpeg_block));
+                    n += count;
+
+                    current = next;
+                    stream = next->stream;
+                    slot = next->next_slot;
+
+                    // The error is only real if we need the block that failed
+                    status = n < jpeg->n_blocks ? next->status : 0;
+                    break;
+                }
+            }
+
+            jpeg->blocks[n].component_id = speculative.loop[slot]->id;
+            status = decode_block_difference(jpeg, speculative.loop[slot], &stream, jpeg->blocks[n].values);
+            if(!status){
+                n++;
+                slot = (slot + 1) % speculative.loop_count;
+            }
+        }
     }
 
-    // Assert we hit EOS
-    if(stream.size_bytes != 0){
-        return E_SIZE_MISMATCH;
+#ifdef JPEG_STATS
+    long bits_read = chunk_position(current, &stream);
+#endif
+
+    for(int i=0; i<n_threads; i++){
+        free(speculative.chunks[i].blocks);
+        free(speculative.chunks[i].positions);
+    }
+    free(speculative.chunks);
+
+    if(!status && !jpeg_ibitstream_at_end(&stream)){
+        status = E_SIZE_MISMATCH;
+    }
+
+    if(status){
+        free(jpeg->blocks);
+        jpeg->blocks = 0;
+        return status;
+    }
+
+    // Cheap serial fix-up of the DC prediction
+    int dc_offset[MAX_COMPONENTS] = { 0 };
+    for(int i=0; i<jpeg->n_blocks; i++){
+        int* offset = dc_offset + jpeg->blocks[i].component_id - 1;
+        *offset += jpeg->blocks[i].values[0];
+        jpeg->blocks[i].values[0] = *offset;
+    }
+
+#ifdef JPEG_STATS
+    if(jpeg->stats){
+        struct jpeg_stats* stats = jpeg->stats;
+        stats->bits_read += bits_read;
+        jpeg_stats_count_markers(scan_data, scan_size - 2, &stats->stuffed_read, &stats->restarts_read);
+        stats->seconds_decode += jpeg_stats_time() - start;
+
+        // Speculative blocks may be thrown away, the symbols are counted by reading the scan once more untimed
+        struct jpeg_ibitstream count;
+        jpeg_ibitstream_init(&count, scan_data, scan_size);
+        decode_scan(jpeg, &count, NULL, stats);
     }
+#endif
 
     return 0;
 }
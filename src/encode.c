@@ -3,146 +3,288 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <math.h>
+#include <stdatomic.h>
 #include "jpeg.h"
 #include "huffman.h"
+#include "parallel.h"
+#include "requantize.h"
+#include "trace.h"
 
 
 void jpeg_obitstream_init(struct jpeg_obitstream* stream, unsigned char* data, long size){
+    stream->buffer = 0;
+    stream->bits = 0;
     stream->at = data;
-    stream->at_bit = 0;
     stream->size_bytes = size;
 }
 
 int jpeg_obitstream_write(struct jpeg_obitstream* stream, uint8_t bit){
+    return jpeg_obitstream_write_bits(stream, bit ? 1 : 0, 1);
+}
 
-    if(stream->size_bytes == 0) return E_FULL;
-
-    if(bit){
-        (*stream->at) |= 1 << (7 - stream->at_bit);
-    }
+int jpeg_obitstream_flush(struct jpeg_obitstream* stream){
+    int padding = (8 - stream->bits % 8) % 8;
+    stream->buffer = (stream->buffer << padding) | ((1 << padding) - 1);
+    stream->bits += padding;
 
-    if(stream->at_bit == 7){
-        if(stream->at[0] == 0xFF){
-            if(stream->size_bytes < 2){
-                return E_FULL;
-            }
-            stream->at++;
-            stream->size_bytes--;
+    while(stream->bits > 0){
+        stream->bits -= 8;
+        int status = jpeg_obitstream_store_byte(stream, stream->buffer >> stream->bits);
+        if(status){
+            return status;
         }
-
-        stream->at_bit = 0;
-        stream->at++;
-        stream->size_bytes--;
-    }else{
-        stream->at_bit++;
     }
 
     return 0;
 }
 
-static inline int write_rrrrssss(struct jpeg_obitstream* stream, struct huffman_inv* huffman_inv, int value, uint8_t rrrr){
-    int ssss;
-
-    if(value == 0){
-        ssss = 0;
-    }else if(value > 0){
-        ssss = 12;
-        while((value & ~(1 << ssss)) == value) ssss--;
-        ssss++;
-    }else{
-        value *= -1;
-        ssss = 12;
-        while((value & ~(1 << ssss)) == value) ssss--;
-        ssss++;
-        value *= -1;
+int jpeg_obitstream_store_bytes(struct jpeg_obitstream* stream){
+    while(stream->bits >= 8){
+        int status = jpeg_obitstream_store_byte(stream, stream->buffer >> (stream->bits - 8));
+        if(status){
+            return status;
+        }
+        stream->bits -= 8;
     }
 
-    int status = huffman_inv_encode(huffman_inv, stream, (rrrr << 4) + ssss);
+    return 0;
+}
+
+int jpeg_obitstream_write_marker(struct jpeg_obitstream* stream, uint8_t marker){
+    int status = jpeg_obitstream_flush(stream);
     if(status){
         return status;
     }
 
-    if(ssss > 0){
-        status = jpeg_obitstream_write(stream, value > 0);
+    if(stream->size_bytes < 2){
+        return E_FULL;
+    }
+    *(stream->at++) = 0xFF;
+    *(stream->at++) = marker;
+    stream->size_bytes -= 2;
+
+    return 0;
+}
+
+int jpeg_obitstream_append(struct jpeg_obitstream* stream, struct jpeg_obitstream* from, unsigned char* from_data){
+    // Bytes already stored by from, unstuffed while reading them back
+    struct jpeg_ibitstream istream;
+    jpeg_ibitstream_init(&istream, from_data, from->at - from_data);
+
+    uint32_t word;
+    while(!jpeg_ibitstream_read_bits(&istream, 32, &word)){
+        int status = jpeg_obitstream_write_bits(stream, word, 32);
         if(status){
             return status;
         }
     }
 
-    int basevalue = 1 << (ssss - 1);
-    if(value < 0){
-        basevalue = 1 - 2*basevalue;
-    }
-    int additional = value - basevalue;
-
-    for(int i=(8 - ssss + 1); i<8; i++){
-        int status = jpeg_obitstream_write(stream, (additional >> (7 - i)) & 1);
+    if(istream.bits > 0){
+        int status = jpeg_obitstream_write_bits(stream, istream.buffer >> (64 - istream.bits), istream.bits);
         if(status){
             return status;
         }
     }
 
+    // Pending bits of from, fewer than 32
+    if(from->bits > 0){
+        return jpeg_obitstream_write_bits(stream, from->buffer & ((1ULL << from->bits) - 1), from->bits);
+    }
+
     return 0;
 }
 
-static inline int encode_block(int16_t* data, struct jpeg_obitstream* stream, int* dc_offset, struct huffman_inv* dc_inv, struct huffman_inv* ac_inv, struct jpeg_quantisation_table* quantisation){
-    
-    for(int i=0; i<64; i++){
-        if(data[i] == 0) continue;
-        data[i] = round(data[i] * quantisation->recompress_factors[i]);
+static inline int encode_block(int16_t* data, struct jpeg_obitstream* stream, int* dc_offset, struct huffman_inv* dc_inv, struct huffman_inv* ac_inv, struct jpeg_quantisation_table* quantisation,
+        struct jpeg_stats* stats, int component_index){
+    // Requantized into a copy, so the coefficients can be encoded again
+    int16_t values[64];
+    uint64_t mask = jpeg_requantize_block(data, values, quantisation->recompress_integers, quantisation->recompress_fractions,
+            quantisation->recompress_thresholds);
+
+#ifdef JPEG_STATS
+    unsigned char* output_at = stream->at;
+    int output_bits = stream->bits;
+    if(stats){
+        for(int i=0; i<64; i++){
+            stats->zeroed += data[i] != 0;
+        }
+        for(uint64_t m = mask; m; m &= m - 1){
+            stats->zeroed--;
+        }
     }
+#else
+    (void)component_index;
+#endif
 
-    int value = data[0] - (*dc_offset);
-    int status = write_rrrrssss(stream, dc_inv, value, 0);
-    *dc_offset = data[0];
+    int value = values[0] - (*dc_offset);
+    int status = huffman_inv_encode_value(dc_inv, stream, value, 0);
+    *dc_offset = values[0];
 
     if(status){
         return status;
     }
 
-    int zeros = 0;
-    for(int i=1; i<64; i++){
-        if(data[i] == 0){
-            zeros++;
-        }else{
-            if(zeros > 16){
-                status = huffman_inv_encode(ac_inv, stream, 0xF0);
-                if(status){
-                    return status;
-                }
-                zeros -= 16;
-            }
-
-            status = write_rrrrssss(stream, ac_inv, data[i], zeros);
+    // Zero runs between nonzero coefficients, found by bit scans
+    int last = 0;
+    for(uint64_t ac = mask & ~1ULL; ac; ac &= ac - 1){
+        int i = jpeg_mask_first(ac);
+        int zeros = i - last - 1;
+        while(zeros > 15){
+            status = huffman_inv_encode(ac_inv, stream, 0xF0);
             if(status){
                 return status;
             }
-            zeros = 0;
+            zeros -= 16;
+            JPEG_STATS_ADD(stats, zrl_written, 1);
+        }
+
+        status = huffman_inv_encode_value(ac_inv, stream, values[i], zeros);
+        if(status){
+            return status;
         }
+        last = i;
     }
-    if(zeros > 0){
+    if(last < 63){
         // Terminate
         status = huffman_inv_encode(ac_inv, stream, 0);
         if(status){
             return status;
         }
+        JPEG_STATS_ADD(stats, eob_written, 1);
+    }
+
+    JPEG_STATS_ADD(stats, component_bits_written[component_index], jpeg_stats_written_bits(stream, output_at, output_bits));
+    return 0;
+}
+
+/* Counts the symbols encode_block would write, without modifying data */
+static void count_block(int16_t* data, int* dc_offset, long* dc_freq, long* ac_freq, struct jpeg_quantisation_table* quantisation){
+    int16_t values[64];
+    uint64_t mask = jpeg_requantize_block(data, values, quantisation->recompress_integers, quantisation->recompress_fractions,
+            quantisation->recompress_thresholds);
+
+    dc_freq[huffman_value_ssss(values[0] - (*dc_offset))]++;
+    *dc_offset = values[0];
+
+    int last = 0;
+    for(uint64_t ac = mask & ~1ULL; ac; ac &= ac - 1){
+        int i = jpeg_mask_first(ac);
+        int zeros = i - last - 1;
+        while(zeros > 15){
+            ac_freq[0xF0]++;
+            zeros -= 16;
+        }
+
+        ac_freq[(zeros << 4) + huffman_value_ssss(values[i])]++;
+        last = i;
+    }
+    if(last < 63){
+        ac_freq[0]++;
+    }
+}
 
+static void optimise_table(struct jpeg_huffman_table* table, long* freq){
+    int used = 0;
+    for(int i=0; i<256; i++){
+        if(freq[i]) used = 1;
     }
 
+    // Keep tables no block is encoded with
+    if(!table || !used){
+        return;
+    }
+
+    table->n_optimised = huffman_optimal_table(freq, table->optimised_counts, table->optimised_elements);
+
+    huffman_inv_init_canonical(table->huffman_inv, table->optimised_counts, table->optimised_elements);
+}
+
+int jpeg_optimise_huffman(struct jpeg* jpeg){
+    if(!jpeg->blocks){
+        int status = jpeg_decode_huffman(jpeg);
+        if(status){
+            return status;
+        }
+    }
+
+    long (*dc_freq)[256] = calloc(MAX_TABLES, sizeof(*dc_freq));
+    long (*ac_freq)[256] = calloc(MAX_TABLES, sizeof(*ac_freq));
+
+    int dc_offset[MAX_COMPONENTS] = { 0 };
+    int interval_blocks = jpeg->output_restart_interval * jpeg->loop_count;
+
+    for(int i=0; i<jpeg->n_blocks; i++){
+        // Differences are counted as they will be written, from zero after each restart
+        if(interval_blocks && i % interval_blocks == 0){
+            for(int c=0; c<MAX_COMPONENTS; c++) dc_offset[c] = 0;
+        }
+
+        struct jpeg_block* block = jpeg->blocks + i;
+        struct jpeg_component* component = jpeg->components[block->component_id - 1];
+
+        count_block(block->values,
+                dc_offset + block->component_id - 1,
+                dc_freq[component->dc_huffman_id],
+                ac_freq[component->ac_huffman_id],
+                jpeg->quantisation_tables[component->quantisation_id]);
+    }
+
+    if(jpeg->progressive){
+        // Without source tables to fall back on every symbol gets a code, so the tables work for any factor
+        for(int i=0; i<MAX_TABLES; i++){
+            for(int ssss=0; ssss<=11; ssss++){
+                dc_freq[i][ssss]++;
+            }
+            ac_freq[i][0x00]++;
+            ac_freq[i][0xF0]++;
+            for(int rrrr=0; rrrr<16; rrrr++){
+                for(int ssss=1; ssss<=10; ssss++){
+                    ac_freq[i][(rrrr << 4) | ssss]++;
+                }
+            }
+        }
+    }
+
+    for(int i=0; i<MAX_TABLES; i++){
+        optimise_table(jpeg->dc_huffman_tables[i], dc_freq[i]);
+        optimise_table(jpeg->ac_huffman_tables[i], ac_freq[i]);
+    }
+
+    free(dc_freq);
+    free(ac_freq);
+
     return 0;
 }
 
+/* RSTn at the end of the given interval, the predictors start over */
+static int write_restart(struct jpeg_obitstream* stream, int interval, int* dc_offset){
+    for(int i=0; i<MAX_COMPONENTS; i++) dc_offset[i] = 0;
+    return jpeg_obitstream_write_marker(stream, 0xD0 + interval % 8);
+}
+
 long jpeg_encode_huffman(struct jpeg* jpeg, unsigned char* buffer, long buffer_size){
     if(!jpeg->blocks){
         return E_NOT_YET_DECODED;
     }
 
+#ifdef JPEG_STATS
+    double start = jpeg->stats ? jpeg_stats_time() : 0;
+#endif
+
     struct jpeg_obitstream stream;
     jpeg_obitstream_init(&stream, buffer, buffer_size);
 
     int dc_offset[MAX_COMPONENTS] = { 0 };
+    int interval_blocks = jpeg->output_restart_interval * jpeg->loop_count;
 
     for(int i=0; i<jpeg->n_blocks; i++){
+        if(interval_blocks && i > 0 && i % interval_blocks == 0){
+            int status = write_restart(&stream, i / interval_blocks - 1, dc_offset);
+            if(status){
+                return status;
+            }
+        }
+
         struct jpeg_block* block = jpeg->blocks + i;
         int dc_id = jpeg->components[block->component_id - 1]->dc_huffman_id;
         int ac_id = jpeg->components[block->component_id - 1]->ac_huffman_id;
@@ -152,7 +294,8 @@ long jpeg_encode_huffman(struct jpeg* jpeg, unsigned char* buffer, long buffer_s
                 dc_offset + block->component_id - 1,
                 jpeg->dc_huffman_tables[dc_id]->huffman_inv,
                 jpeg->ac_huffman_tables[ac_id]->huffman_inv,
-                jpeg->quantisation_tables[quantisation_id]);
+                jpeg->quantisation_tables[quantisation_id],
+                jpeg->stats, block->component_id - 1);
 
         if(status){
             return status;
@@ -160,13 +303,284 @@ long jpeg_encode_huffman(struct jpeg* jpeg, unsigned char* buffer, long buffer_s
     }
 
     // Pad byte with ones
-    if(stream.size_bytes > 0){
-        while(stream.at_bit != 0) jpeg_obitstream_write(&stream, 1);
+    int status = jpeg_obitstream_flush(&stream);
+    if(status){
+        return status;
+    }
+
+#ifdef JPEG_STATS
+    if(jpeg->stats){
+        struct jpeg_stats* stats = jpeg->stats;
+        jpeg_stats_count_scan(buffer, stream.at - buffer, &stats->bits_written, &stats->stuffed_written, &stats->restarts_written);
+        stats->seconds_encode += jpeg_stats_time() - start;
     }
+#endif
 
     // Write EOS
     unsigned char* out = stream.at;
-    assert(out - buffer <= buffer_size - 2);
+    if(out - buffer > buffer_size - 2){
+        return E_FULL;
+    }
+    *(out++) = 0xFF;
+    *(out++) = 0xD9;
+
+    return out - buffer;
+}
+
+struct jpeg_encode_range {
+    int first_block;
+    int n_blocks;
+
+    /* Requantized DC of the last block of each component in front of the range */
+    int dc_offset[MAX_COMPONENTS];
+
+    unsigned char* buffer;
+    struct jpeg_obitstream stream;
+    int status;
+
+#ifdef JPEG_STATS
+    /* Added to jpeg->stats once all ranges are stitched */
+    struct jpeg_stats stats;
+#endif
+};
+
+struct jpeg_encode_parallel {
+    struct jpeg* jpeg;
+
+    /* Blocks per restart interval of the output, 0 if there are none */
+    int interval_blocks;
+
+    int n_ranges;
+    struct jpeg_encode_range* ranges;
+    atomic_int next_range;
+};
+
+static void* encode_parallel_worker(void* arg){
+    struct jpeg_encode_parallel* parallel = arg;
+    struct jpeg* jpeg = parallel->jpeg;
+
+    int r;
+    while((r = atomic_fetch_add(&parallel->next_range, 1)) < parallel->n_ranges){
+        struct jpeg_encode_range* range = parallel->ranges + r;
+        JPEG_TRACE_BEGIN(span);
+
+        range->status = 0;
+        struct jpeg_stats* stats = 0;
+#ifdef JPEG_STATS
+        if(jpeg->stats){
+            stats = &range->stats;
+            jpeg_stats_init(stats);
+        }
+        double start = stats ? jpeg_stats_time() : 0;
+#endif
+
+        for(int i=range->first_block; i<range->first_block + range->n_blocks && !range->status; i++){
+            // Ranges start with an interval, the marker in front of it is written when stitching
+            if(parallel->interval_blocks && i > range->first_block && i % parallel->interval_blocks == 0){
+                range->status = write_restart(&range->stream, i / parallel->interval_blocks - 1, range->dc_offset);
+                if(range->status){
+                    break;
+                }
+            }
+
+            struct jpeg_block* block = jpeg->blocks + i;
+            struct jpeg_component* component = jpeg->components[block->component_id - 1];
+
+            range->status = encode_block(block->values, &range->stream,
+                    range->dc_offset + block->component_id - 1,
+                    jpeg->dc_huffman_tables[component->dc_huffman_id]->huffman_inv,
+                    jpeg->ac_huffman_tables[component->ac_huffman_id]->huffman_inv,
+                    jpeg->quantisation_tables[component->quantisation_id],
+                    stats, block->component_id - 1);
+        }
+
+        // Ranges of whole intervals end on a byte, so they are stitched without unstuffing
+        if(parallel->interval_blocks && !range->status){
+            range->status = jpeg_obitstream_flush(&range->stream);
+        }
+
+#ifdef JPEG_STATS
+        if(stats){
+            stats->seconds_encode += jpeg_stats_time() - start;
+        }
+#endif
+
+        JPEG_TRACE_END(span, "encode range", r);
+    }
+
+    return 0;
+}
+
+/* Output of a range, twice its share of the buffer leaves room for detail that is not spread evenly */
+static long range_size(struct jpeg* jpeg, struct jpeg_encode_range* range, long buffer_size){
+    long size = 2 * (buffer_size * range->n_blocks / jpeg->n_blocks) + 64;
+    return size < buffer_size ? size : buffer_size;
+}
+
+long jpeg_encode_huffman_parallel(struct jpeg* jpeg, unsigned char* buffer, long buffer_size, int n_threads){
+    if(!jpeg->blocks){
+        return E_NOT_YET_DECODED;
+    }
+
+    n_threads = jpeg_parallel_threads(n_threads);
+    if(n_threads > jpeg->n_blocks / 64){
+        n_threads = jpeg->n_blocks / 64;
+    }
+
+    // With restart intervals in the output every range is made of whole intervals
+    int interval_blocks = jpeg->output_restart_interval * jpeg->loop_count;
+    int n_intervals = interval_blocks ? (jpeg->n_blocks + interval_blocks - 1) / interval_blocks : 0;
+    if(interval_blocks && n_threads > n_intervals){
+        n_threads = n_intervals;
+    }
+
+    if(n_threads <= 1){
+        return jpeg_encode_huffman(jpeg, buffer, buffer_size);
+    }
+
+    struct jpeg_encode_parallel parallel;
+    parallel.jpeg = jpeg;
+    parallel.interval_blocks = interval_blocks;
+    parallel.n_ranges = n_threads;
+    parallel.ranges = malloc(n_threads * sizeof(struct jpeg_encode_range));
+    atomic_init(&parallel.next_range, 0);
+    if(!parallel.ranges){
+        return jpeg_encode_huffman(jpeg, buffer, buffer_size);
+    }
+
+    for(int r=0; r<n_threads; r++){
+        struct jpeg_encode_range* range = parallel.ranges + r;
+        range->first_block = r * (jpeg->n_blocks / n_threads);
+        range->n_blocks = r < n_threads - 1 ? jpeg->n_blocks / n_threads : jpeg->n_blocks - range->first_block;
+        for(int c=0; c<MAX_COMPONENTS; c++) range->dc_offset[c] = 0;
+
+        if(parallel.interval_blocks){
+            // Whole intervals, which need no predictors from the range in front
+            int first_interval = r * (n_intervals / n_threads);
+            int last_interval = r < n_threads - 1 ? (r + 1) * (n_intervals / n_threads) : n_intervals;
+            range->first_block = first_interval * parallel.interval_blocks;
+            range->n_blocks = last_interval * parallel.interval_blocks;
+            if(range->n_blocks > jpeg->n_blocks){
+                range->n_blocks = jpeg->n_blocks;
+            }
+            range->n_blocks -= range->first_block;
+            continue;
+        }
+
+        // Predictors of the blocks in front of the range
+        int found = 0;
+        int n_found = 0;
+        for(int i=range->first_block - 1; i>=0 && n_found < jpeg->n_components; i--){
+            struct jpeg_block* block = jpeg->blocks + i;
+            if(!(found & (1 << (block->component_id - 1)))){
+                struct jpeg_quantisation_table* quantisation =
+                    jpeg->quantisation_tables[jpeg->components[block->component_id - 1]->quantisation_id];
+                range->dc_offset[block->component_id - 1] = jpeg_requantize_value(block->values[0],
+                        quantisation->recompress_integers[0], quantisation->recompress_fractions[0]);
+                found |= 1 << (block->component_id - 1);
+                n_found++;
+            }
+        }
+    }
+
+    long scratch_size = 0;
+    for(int r=0; r<n_threads; r++){
+        scratch_size += range_size(jpeg, parallel.ranges + r, buffer_size);
+    }
+
+    unsigned char* scratch = malloc(scratch_size);
+    if(!scratch){
+        free(parallel.ranges);
+        return jpeg_encode_huffman(jpeg, buffer, buffer_size);
+    }
+
+    unsigned char* at = scratch;
+    for(int r=0; r<n_threads; r++){
+        struct jpeg_encode_range* range = parallel.ranges + r;
+        long size = range_size(jpeg, range, buffer_size);
+        range->buffer = at;
+        jpeg_obitstream_init(&range->stream, range->buffer, size);
+        at += size;
+    }
+
+    jpeg_parallel_run(n_threads, encode_parallel_worker, &parallel);
+
+    // A range which did not fit its share is encoded again in one piece
+    int full = 0;
+    for(int r=0; r<n_threads; r++){
+        if(parallel.ranges[r].status == E_FULL){
+            full = 1;
+        }
+    }
+    if(full){
+        free(scratch);
+        free(parallel.ranges);
+        return jpeg_encode_huffman(jpeg, buffer, buffer_size);
+    }
+
+    struct jpeg_obitstream stream;
+    jpeg_obitstream_init(&stream, buffer, buffer_size);
+
+    int status = 0;
+    for(int r=0; r<n_threads && !status; r++){
+        struct jpeg_encode_range* range = parallel.ranges + r;
+        status = range->status;
+        if(status){
+            break;
+        }
+
+        if(parallel.interval_blocks){
+            if(range->first_block > 0){
+                status = jpeg_obitstream_write_marker(&stream, 0xD0 + (range->first_block / parallel.interval_blocks - 1) % 8);
+            }
+
+            long size = range->stream.at - range->buffer;
+            if(!status && size > stream.size_bytes){
+                status = E_FULL;
+            }
+            if(!status){
+                memcpy(stream.at, range->buffer, size);
+                stream.at += size;
+                stream.size_bytes -= size;
+            }
+        }else{
+            status = jpeg_obitstream_append(&stream, &range->stream, range->buffer);
+        }
+    }
+
+#ifdef JPEG_STATS
+    if(jpeg->stats && !status){
+        for(int r=0; r<n_threads; r++){
+            jpeg_stats_add(jpeg->stats, &parallel.ranges[r].stats);
+        }
+    }
+#endif
+
+    free(scratch);
+    free(parallel.ranges);
+
+    if(status){
+        return status;
+    }
+
+    // Pad byte with ones
+    status = jpeg_obitstream_flush(&stream);
+    if(status){
+        return status;
+    }
+
+#ifdef JPEG_STATS
+    if(jpeg->stats){
+        struct jpeg_stats* stats = jpeg->stats;
+        jpeg_stats_count_scan(buffer, stream.at - buffer, &stats->bits_written, &stats->stuffed_written, &stats->restarts_written);
+    }
+#endif
+
+    // Write EOS
+    unsigned char* out = stream.at;
+    if(out - buffer > buffer_size - 2){
+        return E_FULL;
+    }
     *(out++) = 0xFF;
     *(out++) = 0xD9;
 
@@ -113,6 +113,37 @@ int huffman_tree_decode(struct huffman_tree* tree, struct jpeg_ibitstream* strea
     }
 }
 
+void huffman_lookup_init(struct huffman_lookup* lookup, int* n_elements, uint8_t* elements){
+    for(int i=0; i<(1 << HUFFMAN_LOOKUP_BITS); i++){
+        lookup->fast[i] = 0;
+    }
+
+    /* Canonical codes, same order as huffman_tree_insert_goleft assigns them */
+    int32_t code = 0;
+    int k = 0;
+    lookup->maxcode[0] = -1;
+    lookup->valoffset[0] = 0;
+    for(int size=1; size<=16; size++){
+        lookup->valoffset[size] = k - code;
+        for(int i=0; i<n_elements[size - 1]; i++){
+            assert(k < 256);
+            lookup->elements[k] = elements[k];
+
+            if(size <= HUFFMAN_LOOKUP_BITS){
+                int shift = HUFFMAN_LOOKUP_BITS - size;
+                for(int j=(code << shift); j<((code + 1) << shift); j++){
+                    lookup->fast[j] = (size << 8) | elements[k];
+                }
+            }
+
+            code++;
+            k++;
+        }
+        lookup->maxcode[size] = n_elements[size - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+}
+
 static void huffman_inv_init_rec(struct huffman_inv* inv, struct huffman_tree* from, uint16_t current, uint8_t current_size){
     if(from->has_element){
         assert(from->element < inv->size);
@@ -131,37 +162,140 @@ static void huffman_inv_init_rec(struct huffman_inv* inv, struct huffman_tree* f
     }
 }
 
+static void huffman_inv_init_codes(struct huffman_inv* inv){
+    for(int i=0; i<256; i++){
+        struct huffman_inv_element* element = inv->data + i;
+        inv->codes[i] = element->exists ? ((uint32_t)element->size << 16) | (element->bits >> (16 - element->size)) : 0;
+    }
+}
+
 void huffman_inv_init(struct huffman_inv* inv, struct huffman_tree* from){
-    /* For now */
     inv->size = 256;
-
-    inv->data = malloc(256 * sizeof(struct huffman_inv_element));
     for(int i=0; i<256; i++){
         inv->data[i].exists = 0;
     }
 
     huffman_inv_init_rec(inv, from, 0, 0);
+    huffman_inv_init_codes(inv);
 }
 
-void huffman_inv_destroy(struct huffman_inv* inv){
-    free(inv->data);
-    inv->data = 0;
+void huffman_inv_init_canonical(struct huffman_inv* inv, uint8_t* counts, uint8_t* elements){
+    inv->size = 256;
+    for(int i=0; i<256; i++){
+        inv->data[i].exists = 0;
+    }
+
+    uint16_t code = 0;
+    int k = 0;
+    for(int size=1; size<=16; size++){
+        for(int i=0; i<counts[size - 1]; i++){
+            inv->data[elements[k]].exists = 1;
+            inv->data[elements[k]].size = size;
+            inv->data[elements[k]].bits = code << (16 - size);
+            code++;
+            k++;
+        }
+        code <<= 1;
+    }
+
+    huffman_inv_init_codes(inv);
 }
 
-int huffman_inv_encode(struct huffman_inv* inv, struct jpeg_obitstream* stream, uint8_t data){
-    if(data >= inv->size || !inv->data[data].exists){
-        printf("%d\n", data);
-        return E_NO_CODE;
+int huffman_optimal_table(long* freq, uint8_t* counts, uint8_t* elements){
+    long f[257];
+    int codesize[257];
+    int others[257];
+    for(int i=0; i<256; i++){
+        f[i] = freq[i];
+    }
+
+    // Reserve one code point so no real code is all ones
+    f[256] = 1;
+
+    for(int i=0; i<257; i++){
+        codesize[i] = 0;
+        others[i] = -1;
+    }
+
+    // Huffman's construction, merging the two least frequent trees
+    for(;;){
+        int c1 = -1;
+        long v = 0;
+        for(int i=0; i<257; i++){
+            if(f[i] && (c1 < 0 || f[i] <= v)){
+                v = f[i];
+                c1 = i;
+            }
+        }
+
+        int c2 = -1;
+        v = 0;
+        for(int i=0; i<257; i++){
+            if(f[i] && i != c1 && (c2 < 0 || f[i] <= v)){
+                v = f[i];
+                c2 = i;
+            }
+        }
+
+        if(c2 < 0){
+            break;
+        }
+
+        f[c1] += f[c2];
+        f[c2] = 0;
+
+        codesize[c1]++;
+        while(others[c1] >= 0){
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+
+        codesize[c2]++;
+        while(others[c2] >= 0){
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    int bits[33] = { 0 };
+    for(int i=0; i<257; i++){
+        if(codesize[i]){
+            assert(codesize[i] <= 32);
+            bits[codesize[i]]++;
+        }
+    }
+
+    // Limit to 16 bits: move pairs of long codes up, splitting a shorter one
+    for(int i=32; i>16; i--){
+        while(bits[i] > 0){
+            int j = i - 2;
+            while(bits[j] == 0) j--;
+
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    // Drop the reserved code point, it has the longest code
+    int i = 16;
+    while(bits[i] == 0) i--;
+    bits[i]--;
+
+    for(int size=1; size<=16; size++){
+        counts[size - 1] = bits[size];
     }
 
-    uint16_t val = inv->data[data].bits;
-    for(int i=0; i<inv->data[data].size; i++){
-        uint8_t bit = (val >> (15 - i)) & 1;
-        int status = jpeg_obitstream_write(stream, bit);
-        if(status){
-            return status;
+    int n = 0;
+    for(int size=1; size<=32; size++){
+        for(int j=0; j<256; j++){
+            if(codesize[j] == size){
+                elements[n++] = j;
+            }
         }
     }
 
-    return 0;
+    return n;
 }
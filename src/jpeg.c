@@ -6,53 +6,62 @@
 #include <string.h>
 #include "jpeg.h"
 #include "huffman.h"
+#include "trace.h"
 
 static uint16_t uint16_from_uchar(unsigned char* at){
     return at[1] + 256*at[0];
 }
 
-int jpeg_huffman_table_init(struct jpeg_huffman_table* table, unsigned char* at){
+long jpeg_huffman_table_size(unsigned char* at, unsigned char* end){
+    if(at + 17 > end){
+        return E_INVALID_HEADER;
+    }
+
+    long n_total = 0;
+    long codes = 0;
+    for(int i=0; i<16; i++){
+        n_total += at[1 + i];
+        codes = 2 * codes + at[1 + i];
+        if(codes > (2L << i)){
+            return E_INVALID_HEADER;
+        }
+    }
+
+    return at + 17 + n_total <= end ? 17 + n_total : E_INVALID_HEADER;
+}
+
+int jpeg_huffman_table_init(struct jpeg_huffman_table* table, struct jpeg_arena* arena, unsigned char* at){
     unsigned char* at_orig = at;
     uint8_t info = *at;
     at++;
 
     table->class = (info & 0xF0) / 16;
     table->id = info & 0x0F;
-    table->huffman_tree = malloc(sizeof(struct huffman_tree));
-    huffman_tree_init(table->huffman_tree);
+    table->n_optimised = 0;
 
     int n_elements[16];
+    int n_total = 0;
     for(int i=0; i<16; i++){
+        table->counts[i] = *at;
         n_elements[i] = *at;
+        n_total += *at;
         at++;
     }
+    assert(n_total <= 256);
 
-    for(int depth=1; depth<=16; depth++){
-        for(int i=0; i<n_elements[depth - 1]; i++){
-            uint8_t element = *at;
-            at++;
+    memcpy(table->elements, at, n_total);
+    at += n_total;
 
-            int success = huffman_tree_insert_goleft(table->huffman_tree, depth, element);
-            assert(success);
-        }
-    }
+    table->huffman_lookup = jpeg_arena_alloc(arena, sizeof(struct huffman_lookup));
+    huffman_lookup_init(table->huffman_lookup, n_elements, table->elements);
 
-    table->huffman_inv = malloc(sizeof(struct huffman_inv));
-    huffman_inv_init(table->huffman_inv, table->huffman_tree);
+    // Codes are assigned canonically, no need for a tree
+    table->huffman_inv = jpeg_arena_alloc(arena, sizeof(struct huffman_inv));
+    huffman_inv_init_canonical(table->huffman_inv, table->counts, table->elements);
 
     return at - at_orig;
 }
 
-void jpeg_huffman_table_destroy(struct jpeg_huffman_table* table){
-    huffman_tree_destroy(table->huffman_tree);
-    free(table->huffman_tree);
-    table->huffman_tree = 0;
-
-    huffman_inv_destroy(table->huffman_inv);
-    free(table->huffman_inv);
-    table->huffman_inv = 0;
-}
-
 
 int jpeg_quantisation_table_init(struct jpeg_quantisation_table* table, unsigned char* at){
     unsigned char* at_orig = at;
@@ -75,17 +84,85 @@ int jpeg_quantisation_table_init(struct jpeg_quantisation_table* table, unsigned
 
     for(int i=0; i<64; i++){
         table->recompress_values[i] = table->values[i];
-        table->recompress_factors[i] = 1.;
+        table->recompress_multipliers[i] = 1.;
+        table->recompress_integers[i] = 1;
+        table->recompress_fractions[i] = 0;
+        table->recompress_dead_zone[i] = 0.;
+        table->recompress_thresholds[i] = 0;
     }
+    table->recompress_tail = 64;
 
     return at - at_orig;
 }
 
+/* Thresholds of the dead zone for the current recompress_values */
+static void init_thresholds(struct jpeg_quantisation_table* table){
+    // DC is never dropped
+    table->recompress_thresholds[0] = 0;
+    table->recompress_tail = 64;
+
+    for(int i=1; i<64; i++){
+        // Coefficients v are kept if |v| * values[i] >= dead_zone * recompress_values[i]
+        double threshold = table->values[i] ?
+            ceil(table->recompress_dead_zone[i] * table->recompress_values[i] / table->values[i]) : 0.;
+        table->recompress_thresholds[i] = threshold > 65535. ? 65535 : (threshold < 0. ? 0 : threshold);
+    }
+
+    // No coefficient reaches 65535 in magnitude
+    while(table->recompress_tail > 1 && table->recompress_thresholds[table->recompress_tail - 1] == 65535){
+        table->recompress_tail--;
+    }
+}
+
+void jpeg_quantisation_table_init_dead_zone(struct jpeg_quantisation_table* table, const float* dead_zone){
+    for(int i=0; i<64; i++){
+        table->recompress_dead_zone[i] = dead_zone ? dead_zone[i] : 0.;
+    }
+    init_thresholds(table);
+}
+
 void jpeg_quantisation_table_init_recompress(struct jpeg_quantisation_table* table, float compress){
+    jpeg_quantisation_table_init_recompress_matrix(table, compress, 0);
+}
+
+void jpeg_quantisation_table_init_recompress_matrix(struct jpeg_quantisation_table* table, float compress,
+        const float* matrix){
+    float multipliers[64];
+    for(int i=0; i<64; i++){
+        multipliers[i] = matrix ? compress * matrix[i] : compress;
+    }
+
+    // Tables reused from a previous frame often have the right values already
+    if(!memcmp(multipliers, table->recompress_multipliers, sizeof(multipliers))){
+        return;
+    }
+    memcpy(table->recompress_multipliers, multipliers, sizeof(multipliers));
+
+    // Values have to fit into the DQT entry
+    double max_value = table->double_precision ? 65535. : 255.;
+
     for(int i=0; i<64; i++){
-        table->recompress_values[i] = floor(table->values[i] * compress + .5);
-        table->recompress_factors[i] = ((float)table->values[i]) / table->recompress_values[i];
+        double value = floor(table->values[i] * multipliers[i] + .5);
+        table->recompress_values[i] = value < 1. ? 1 : (value > max_value ? max_value : value);
+
+        /*
+         * Rounding up the fraction keeps the result exact for coefficients up
+         * to 2^15 in magnitude, see jpeg_requantize_value
+         */
+        uint32_t remainder = table->values[i] % table->recompress_values[i];
+        table->recompress_integers[i] = table->values[i] / table->recompress_values[i];
+        table->recompress_fractions[i] = (((uint64_t)remainder << 32) + table->recompress_values[i] - 1) / table->recompress_values[i];
     }
+
+    init_thresholds(table);
+}
+
+void jpeg_requantization_init(struct jpeg_requantization* requantization, float factor){
+    requantization->luma_factor = factor;
+    requantization->chroma_factor = factor;
+    requantization->luma_matrix = 0;
+    requantization->chroma_matrix = 0;
+    requantization->dead_zone = 0;
 }
 
 int jpeg_component_init(struct jpeg_component* component, unsigned char* at){
@@ -115,15 +192,29 @@ void jpeg_segment_init(struct jpeg_segment* segment, struct jpeg* jpeg, long siz
     assert(size > 1);
 }
 
-int jpeg_init(struct jpeg* jpeg, long size, unsigned char* data){
+/* Size of the table at, E_INVALID_HEADER if it is cut off by end */
+static long quantisation_table_size(unsigned char* at, unsigned char* end){
+    long size = (*at & 0xF0) ? 129 : 65;
+    return at + size <= end ? size : E_INVALID_HEADER;
+}
+
+/* Parse the header of data into jpeg, allocating from jpeg->arena */
+static int jpeg_parse(struct jpeg* jpeg, long size, unsigned char* data){
     jpeg->size = size;
     jpeg->data = data;
+    jpeg->first_segment = 0;
+    jpeg->n_components = 0;
+    jpeg->output_restart_interval = 0;
+    jpeg->stats = 0;
 
     for(int i=0; i<MAX_TABLES; i++){
         jpeg->quantisation_tables[i] = 0;
         jpeg->ac_huffman_tables[i] = 0;
         jpeg->dc_huffman_tables[i] = 0;
     }
+    for(int i=0; i<MAX_COMPONENTS; i++){
+        jpeg->components[i] = 0;
+    }
 
     struct jpeg_segment* seg = 0;
     for(long i=0; i<size; i++){
@@ -134,7 +225,7 @@ int jpeg_init(struct jpeg* jpeg, long size, unsigned char* data){
                     data[i+1] != 0xFF && // FFFF is not a marker
                     (data[i+1] < 0xD0 || data[i+1] > 0xD7) // FFD0 - FFD8 are restart markers
             ){
-                struct jpeg_segment* next_seg = malloc(sizeof(struct jpeg_segment));
+                struct jpeg_segment* next_seg = jpeg_arena_alloc(&jpeg->arena, sizeof(struct jpeg_segment));
                 jpeg_segment_init(next_seg, jpeg, 2, data + i);
                 if(seg){
                     seg->size = data + i - seg->data;
@@ -144,12 +235,16 @@ int jpeg_init(struct jpeg* jpeg, long size, unsigned char* data){
                 }
                 seg = next_seg;
 
-                // DA, DB, C0, C4 store length as uint16_t after header
+                // DA, DB, C0 - C2, C4 store length as uint16_t after header
                 if(i < (size - 3) && 
-                        (data[i+1] == 0xDA || data[i+1] == 0xDB || data[i+1] == 0xC0 || data[i+1] == 0xC4)
+                        (data[i+1] == 0xDA || data[i+1] == 0xDB || data[i+1] == 0xC4 ||
+                         data[i+1] == 0xC0 || data[i+1] == 0xC1 || data[i+1] == 0xC2)
                 ){
                     // We always include the marker in the size
                     seg->size = uint16_from_uchar(data + i + 2) + 2;
+                    if(seg->size < 4 || i + seg->size > size){
+                        return E_INVALID_HEADER;
+                    }
                     i += seg->size - 2;
                 }
 
@@ -167,16 +262,19 @@ int jpeg_init(struct jpeg* jpeg, long size, unsigned char* data){
     jpeg->n_quantisation_tables = 0;
     for(struct jpeg_segment* quantisation = jpeg_find_segment(jpeg, 0xDB, 0); quantisation; quantisation = jpeg_find_segment(jpeg, 0xDB, quantisation)){
         unsigned char* at = quantisation->data + 4;
-        while(at - quantisation->data < quantisation->size){
-            struct jpeg_quantisation_table* quantisation_table = malloc(sizeof(struct jpeg_quantisation_table));
+        unsigned char* end = quantisation->data + quantisation->size;
+        while(at < end){
+            if(quantisation_table_size(at, end) < 0 || (*at & 0x0F) >= MAX_TABLES){
+                return E_INVALID_HEADER;
+            }
+
+            struct jpeg_quantisation_table* quantisation_table = jpeg_arena_alloc(&jpeg->arena, sizeof(struct jpeg_quantisation_table));
             at += jpeg_quantisation_table_init(quantisation_table, at);
-            assert(quantisation_table->id < MAX_TABLES);
             jpeg->quantisation_tables[quantisation_table->id] = quantisation_table;
             if(quantisation_table->id >= jpeg->n_quantisation_tables){
                 jpeg->n_quantisation_tables = quantisation_table->id + 1;
             }
         }
-        assert(at - quantisation->data == quantisation->size);
     }
 
     // Huffman
@@ -184,10 +282,14 @@ int jpeg_init(struct jpeg* jpeg, long size, unsigned char* data){
     jpeg->n_dc_huffman_tables = 0;
     for(struct jpeg_segment* huffman = jpeg_find_segment(jpeg, 0xC4, 0); huffman; huffman = jpeg_find_segment(jpeg, 0xC4, huffman)){
         unsigned char* at = huffman->data + 4;
-        while(at - huffman->data < huffman->size){
-            struct jpeg_huffman_table* huffman_table = malloc(sizeof(struct jpeg_huffman_table));
-            at += jpeg_huffman_table_init(huffman_table, at);
-            assert(huffman_table->id < MAX_TABLES);
+        unsigned char* end = huffman->data + huffman->size;
+        while(at < end){
+            if(jpeg_huffman_table_size(at, end) < 0 || (*at & 0x0F) >= MAX_TABLES){
+                return E_INVALID_HEADER;
+            }
+
+            struct jpeg_huffman_table* huffman_table = jpeg_arena_alloc(&jpeg->arena, sizeof(struct jpeg_huffman_table));
+            at += jpeg_huffman_table_init(huffman_table, &jpeg->arena, at);
             if(huffman_table->class){
                 jpeg->ac_huffman_tables[huffman_table->id] = huffman_table;
                 if(huffman_table->id >= jpeg->n_ac_huffman_tables){
@@ -200,23 +302,60 @@ int jpeg_init(struct jpeg* jpeg, long size, unsigned char* data){
                 }
             }
         }
-        assert(at - huffman->data == huffman->size);
     }
 
-    // Start of frame
+    // Restart interval
+    struct jpeg_segment* dri = jpeg_find_segment(jpeg, 0xDD, 0);
+    jpeg->restart_interval = 0;
+    if(dri){
+        if(dri->size < 6){
+            return E_INVALID_HEADER;
+        }
+        jpeg->restart_interval = uint16_from_uchar(dri->data + 4);
+    }
+
+    // Start of frame, extended sequential frames are decoded like baseline ones
     struct jpeg_segment* sof = jpeg_find_segment(jpeg, 0xC0, 0);
-    assert(sof);
-    assert(sof->size >= 10);
+    if(!sof){
+        sof = jpeg_find_segment(jpeg, 0xC1, 0);
+    }
+    jpeg->progressive = 0;
+    if(!sof){
+        sof = jpeg_find_segment(jpeg, 0xC2, 0);
+        jpeg->progressive = 1;
+    }
+    if(!sof){
+        // Lossless, hierarchical and arithmetic coded frames
+        for(struct jpeg_segment* segment = jpeg->first_segment; segment; segment = segment->next_segment){
+            if(segment->data[1] >= 0xC3 && segment->data[1] <= 0xCF && segment->data[1] != 0xC4 && segment->data[1] != 0xC8 && segment->data[1] != 0xCC){
+                return E_UNSUPPORTED;
+            }
+        }
+        return E_INVALID_HEADER;
+    }
+    if(sof->size < 10){
+        return E_INVALID_HEADER;
+    }
     jpeg->height = uint16_from_uchar(sof->data + 5);
     jpeg->width = uint16_from_uchar(sof->data + 7);
     jpeg->n_components = *(sof->data + 9);
+    if(jpeg->n_components < 1 || jpeg->n_components > MAX_COMPONENTS || sof->size != 10 + 3 * jpeg->n_components ||
+            !jpeg->height || !jpeg->width){
+        return E_INVALID_HEADER;
+    }
     unsigned char* at = sof->data + 10;
-    for(int i=0; at - sof->data < sof->size && i < jpeg->n_components; i++){
-        struct jpeg_component* component = malloc(sizeof(struct jpeg_component));
+    for(int i=0; i < jpeg->n_components; i++){
+        // Components are numbered from one
+        if(at[0] < 1 || at[0] > jpeg->n_components || jpeg->components[at[0] - 1] ||
+                (at[1] & 0xF0) < 0x10 || (at[1] & 0xF0) > 0x40 || (at[1] & 0x0F) < 1 || (at[1] & 0x0F) > 4 ||
+                at[2] >= MAX_TABLES || !jpeg->quantisation_tables[at[2]]){
+            return E_INVALID_HEADER;
+        }
+
+        struct jpeg_component* component = jpeg_arena_alloc(&jpeg->arena, sizeof(struct jpeg_component));
         at += jpeg_component_init(component, at);
         jpeg->components[component->id - 1] = component;
     }
-    assert(at - sof->data == sof->size);
 
     /*
      * Handle stupid way of specifying subsampling
@@ -253,60 +392,109 @@ int jpeg_init(struct jpeg* jpeg, long size, unsigned char* data){
     int block_height = ceil(jpeg->height / reference_height / 8.);
     int block_width = ceil(jpeg->width / reference_width / 8.);
 
+    jpeg->mcu_columns = block_width;
+    jpeg->mcu_rows = block_height;
     jpeg->n_blocks = 0;
     for(int i=0; i<jpeg->n_components; i++){
         jpeg->n_blocks += block_width * jpeg->components[i]->vertical_sampling * 
             block_height * jpeg->components[i]->horizontal_sampling;
     }
 
-    jpeg->blocks = 0;
+    jpeg->loop_count = 0;
+    for(int i=0; i<jpeg->n_components; i++){
+        jpeg->loop_count += jpeg->components[i]->vertical_sampling * jpeg->components[i]->horizontal_sampling;
+    }
+
+    jpeg->loop = jpeg_arena_alloc(&jpeg->arena, jpeg->loop_count * sizeof(struct jpeg_component*));
+    int k = 0;
+    for(int i=0; i<jpeg->n_components; i++){
+        int block_count = jpeg->components[i]->vertical_sampling * jpeg->components[i]->horizontal_sampling;
+        for(int j=0; j<block_count; j++){
+            jpeg->loop[k++] = jpeg->components[i];
+        }
+    }
 
-    // Start of scan
+    // Start of scan, progressive scans are read by the decoder
     struct jpeg_segment* sos = jpeg_find_segment(jpeg, 0xDA, 0);
-    assert(sos);
-    assert(jpeg->n_components == *(sos->data + 4));
+    if(!sos){
+        return E_INVALID_HEADER;
+    }
+    if(jpeg->progressive){
+        return 0;
+    }
+
+    // Three empty bytes before scan data
+    if(sos->size < 5 || jpeg->n_components != *(sos->data + 4) || sos->size != 5 + 2 * jpeg->n_components + 3){
+        return E_INVALID_HEADER;
+    }
     at = sos->data + 5;
-    for(int i=0; at - sos->data < sos->size && i < jpeg->n_components; i++){
+    for(int i=0; i < jpeg->n_components; i++){
+        if(at[0] < 1 || at[0] > jpeg->n_components ||
+                (at[1] >> 4) >= MAX_TABLES || !jpeg->dc_huffman_tables[at[1] >> 4] ||
+                (at[1] & 0x0F) >= MAX_TABLES || !jpeg->ac_huffman_tables[at[1] & 0x0F]){
+            return E_INVALID_HEADER;
+        }
+
         struct jpeg_component* component = jpeg->components[*at - 1];
         at += jpeg_component_add_huffman(component, at);
     }
-    // Three empty bytes before scan data
-    assert(at + 3 - sos->data == sos->size);
 
     return 0;
 }
 
-void jpeg_destroy(struct jpeg* jpeg){
-    for(int i=0; i<jpeg->n_components; i++){
-        free(jpeg->components[i]);
-        jpeg->components[i] = 0;
-    }
+int jpeg_init(struct jpeg* jpeg, long size, unsigned char* data){
+    JPEG_TRACE_BEGIN(span);
 
-    for(int i=0; i<jpeg->n_quantisation_tables; i++){
-        free(jpeg->quantisation_tables[i]);
-        jpeg->quantisation_tables[i] = 0;
-    }
+    jpeg_arena_init(&jpeg->arena);
+    jpeg->blocks = 0;
 
-    for(int i=0; i<jpeg->n_ac_huffman_tables; i++){
-        jpeg_huffman_table_destroy(jpeg->ac_huffman_tables[i]);
-        free(jpeg->ac_huffman_tables[i]);
-        jpeg->ac_huffman_tables[i] = 0;
+    int status = jpeg_parse(jpeg, size, data);
+    if(status){
+        jpeg_arena_destroy(&jpeg->arena);
     }
 
-    for(int i=0; i<jpeg->n_dc_huffman_tables; i++){
-        jpeg_huffman_table_destroy(jpeg->dc_huffman_tables[i]);
-        free(jpeg->dc_huffman_tables[i]);
-        jpeg->dc_huffman_tables[i] = 0;
-    }
+    JPEG_TRACE_END(span, "jpeg_init", size);
+    return status;
+}
+
+int jpeg_reinit(struct jpeg* jpeg, long size, unsigned char* data){
+    JPEG_TRACE_BEGIN(span);
+
+    free(jpeg->blocks);
+    jpeg->blocks = 0;
+
+    jpeg_arena_reset(&jpeg->arena);
+    int status = jpeg_parse(jpeg, size, data);
+
+    JPEG_TRACE_END(span, "jpeg_reinit", size);
+    return status;
+}
 
+void jpeg_destroy(struct jpeg* jpeg){
     free(jpeg->blocks);
     jpeg->blocks = 0;
 
-    struct jpeg_segment* segment = jpeg->first_segment;
-    while(segment){
-        struct jpeg_segment* next = segment->next_segment;
-        free(segment);
-        segment = next;
+    jpeg_arena_destroy(&jpeg->arena);
+}
+
+void jpeg_init_recompress(struct jpeg* jpeg, struct jpeg_requantization* requantization){
+    int luma[MAX_TABLES] = { 0 };
+    if(jpeg->n_components > 0 && jpeg->components[0] && jpeg->components[0]->quantisation_id < MAX_TABLES){
+        luma[jpeg->components[0]->quantisation_id] = 1;
+    }
+
+    for(int i=0; i<MAX_TABLES; i++){
+        struct jpeg_quantisation_table* table = jpeg->quantisation_tables[i];
+        if(!table){
+            continue;
+        }
+
+        if(luma[i]){
+            jpeg_quantisation_table_init_recompress_matrix(table, requantization->luma_factor, requantization->luma_matrix);
+        }else{
+            jpeg_quantisation_table_init_recompress_matrix(table, requantization->chroma_factor, requantization->chroma_matrix);
+        }
+        jpeg_quantisation_table_init_dead_zone(table, requantization->dead_zone);
     }
 }
 
@@ -343,15 +531,30 @@ void jpeg_print_quantisation_tables(struct jpeg* jpeg){
     }
 }
 
+static void print_huffman_table(struct jpeg_huffman_table* table){
+    struct huffman_tree tree;
+    huffman_tree_init(&tree);
+
+    int k = 0;
+    for(int depth=1; depth<=16; depth++){
+        for(int i=0; i<table->counts[depth - 1]; i++){
+            huffman_tree_insert_goleft(&tree, depth, table->elements[k++]);
+        }
+    }
+
+    huffman_tree_print(&tree, "\t");
+    huffman_tree_destroy(&tree);
+}
+
 void jpeg_print_huffman_tables(struct jpeg* jpeg){
     printf("------ Huffman -------\n");
     for(int i=0; i<jpeg->n_dc_huffman_tables; i++){
         printf("Huffman(DC, %d)\n", jpeg->dc_huffman_tables[i]->id);
-        huffman_tree_print(jpeg->dc_huffman_tables[i]->huffman_tree, "\t");
+        print_huffman_table(jpeg->dc_huffman_tables[i]);
     }
     for(int i=0; i<jpeg->n_ac_huffman_tables; i++){
         printf("Huffman(AC, %d)\n", jpeg->ac_huffman_tables[i]->id);
-        huffman_tree_print(jpeg->ac_huffman_tables[i]->huffman_tree, "\t");
+        print_huffman_table(jpeg->ac_huffman_tables[i]);
     }
 
 }
@@ -364,11 +567,157 @@ struct jpeg_segment* jpeg_find_segment(struct jpeg* jpeg, unsigned char header,
     return 0;
 }
 
-long jpeg_write_recompress_header(struct jpeg* jpeg, unsigned char* buffer, long buffer_size){
+/* Progressive input gets a single DHT with the tables of all components, written in front of SOS */
+static long progressive_huffman_size(struct jpeg* jpeg){
+    long size = 4;
+    for(int i=0; i<MAX_TABLES; i++){
+        if(jpeg->dc_huffman_tables[i]) size += 17 + jpeg->dc_huffman_tables[i]->n_optimised;
+        if(jpeg->ac_huffman_tables[i]) size += 17 + jpeg->ac_huffman_tables[i]->n_optimised;
+    }
+    return size;
+}
+
+static unsigned char* write_progressive_huffman(struct jpeg* jpeg, unsigned char* at){
+    unsigned char* start = at;
+    *(at++) = 0xFF;
+    *(at++) = 0xC4;
+    at += 2;
+
+    for(int class=0; class<2; class++){
+        for(int i=0; i<MAX_TABLES; i++){
+            struct jpeg_huffman_table* table = class ? jpeg->ac_huffman_tables[i] : jpeg->dc_huffman_tables[i];
+            if(!table){
+                continue;
+            }
+
+            *(at++) = (class << 4) | i;
+            memcpy(at, table->optimised_counts, 16);
+            at += 16;
+            memcpy(at, table->optimised_elements, table->n_optimised);
+            at += table->n_optimised;
+        }
+    }
+
+    int s = at - start - 2;
+    start[2] = (s & 0xFF00) / 256;
+    start[3] = s & 0xFF;
+    return at;
+}
+
+/* Baseline SOS for progressive input, all components in one scan */
+static unsigned char* write_progressive_scan(struct jpeg* jpeg, unsigned char* at){
+    int s = 6 + 2 * jpeg->n_components;
+    *(at++) = 0xFF;
+    *(at++) = 0xDA;
+    *(at++) = (s & 0xFF00) / 256;
+    *(at++) = s & 0xFF;
+    *(at++) = jpeg->n_components;
+    for(int i=0; i<jpeg->n_components; i++){
+        *(at++) = jpeg->components[i]->id;
+        *(at++) = (jpeg->components[i]->dc_huffman_id << 4) | jpeg->components[i]->ac_huffman_id;
+    }
+
+    // Spectral selection 0 - 63, no successive approximation
+    *(at++) = 0;
+    *(at++) = 63;
+    *(at++) = 0;
+    return at;
+}
+
+/* Bytes jpeg_write_recompress_header writes for segment */
+static long recompress_segment_size(struct jpeg* jpeg, struct jpeg_segment* segment){
+    // DRI of the output goes in front of SOS
+    long restart = segment->data[1] == 0xDA && jpeg->output_restart_interval ? 6 : 0;
+
+    if(jpeg->progressive && segment->data[1] == 0xC4){
+        return 0;
+    }else if(jpeg->progressive && segment->data[1] == 0xDA){
+        return restart + progressive_huffman_size(jpeg) + 8 + 2 * jpeg->n_components;
+    }else if(segment->data[1] == 0xDD){
+        return 0;
+    }else if(segment->data[1] == 0xDB){
+        long size = 4;
+        for(int i=0; i<jpeg->n_quantisation_tables; i++){
+            size += 1 + (jpeg->quantisation_tables[i]->double_precision ? 128 : 64);
+        }
+        return size;
+    }else if(segment->data[1] == 0xC4){
+        long size = 4;
+        unsigned char* from = segment->data + 4;
+        while(from - segment->data < segment->size){
+            int n_elements = 0;
+            for(int i=0; i<16; i++){
+                n_elements += from[1 + i];
+            }
+
+            struct jpeg_huffman_table* table = (*from & 0xF0) ?
+                jpeg->ac_huffman_tables[*from & 0x0F] : jpeg->dc_huffman_tables[*from & 0x0F];
+            size += 17 + (table->n_optimised ? table->n_optimised : n_elements);
+            from += 17 + n_elements;
+        }
+        return size;
+    }
+
+    return segment->size + restart;
+}
+
+long jpeg_recompress_header_size(struct jpeg* jpeg){
+    if(jpeg->progressive){
+        int status = jpeg_progressive_prepare(jpeg);
+        if(status){
+            return status;
+        }
+    }
+
+    long size = 0;
+    for(struct jpeg_segment* cur = jpeg->first_segment; cur; cur = cur->next_segment){
+        size += recompress_segment_size(jpeg, cur);
+    }
+
+    return size;
+}
+
+static long write_recompress_header(struct jpeg* jpeg, unsigned char* buffer, long buffer_size){
+    if(jpeg->progressive){
+        int status = jpeg_progressive_prepare(jpeg);
+        if(status){
+            return status;
+        }
+    }
+
     unsigned char* at = buffer;
 
     for(struct jpeg_segment* cur = jpeg->first_segment; cur; cur = cur->next_segment){
-        if(cur->data[1] == 0xDD){
+        if(buffer + buffer_size - at < recompress_segment_size(jpeg, cur)){
+            return E_FULL;
+        }
+
+        if(cur->data[1] == 0xDA && jpeg->output_restart_interval){
+            *(at++) = 0xFF;
+            *(at++) = 0xDD;
+            *(at++) = 0;
+            *(at++) = 4;
+            *(at++) = (jpeg->output_restart_interval & 0xFF00) / 256;
+            *(at++) = jpeg->output_restart_interval & 0xFF;
+        }
+
+        if(jpeg->progressive && cur->data[1] == 0xC4){
+            // Replaced by the tables in front of SOS
+            continue;
+        }else if(jpeg->progressive && cur->data[1] == 0xDA){
+            at = write_progressive_huffman(jpeg, at);
+            at = write_progressive_scan(jpeg, at);
+        }else if(jpeg->progressive && cur->data[1] == 0xC2){
+            // Baseline, or extended sequential for 16-bit quantisation tables
+            int extended = 0;
+            for(int i=0; i<jpeg->n_quantisation_tables; i++){
+                extended |= jpeg->quantisation_tables[i]->double_precision;
+            }
+
+            memcpy(at, cur->data, cur->size);
+            at[1] = extended ? 0xC1 : 0xC0;
+            at += cur->size;
+        }else if(cur->data[1] == 0xDD){
             // Skip restart header
             continue;
         }else if(cur->data[1] == 0xDB){
@@ -400,21 +749,68 @@ long jpeg_write_recompress_header(struct jpeg* jpeg, unsigned char* buffer, long
             *(size++) = (s & 0xFF00) / 256;
             *(size++) = (s & 0xFF);
 
+        }else if(cur->data[1] == 0xC4){
+            // Rewrite huffman header, replacing optimised tables
+            *(at++) = 0xFF;
+            *(at++) = 0xC4;
+
+            // Leave room for size
+            unsigned char* size = at;
+            at += 2;
+
+            unsigned char* from = cur->data + 4;
+            while(from - cur->data < cur->size){
+                uint8_t info = *from;
+                int n_elements = 0;
+                for(int i=0; i<16; i++){
+                    n_elements += from[1 + i];
+                }
+
+                struct jpeg_huffman_table* table = (info & 0xF0) ?
+                    jpeg->ac_huffman_tables[info & 0x0F] : jpeg->dc_huffman_tables[info & 0x0F];
+
+                if(table->n_optimised){
+                    *(at++) = info;
+                    memcpy(at, table->optimised_counts, 16);
+                    at += 16;
+                    memcpy(at, table->optimised_elements, table->n_optimised);
+                    at += table->n_optimised;
+                }else{
+                    memcpy(at, from, 17 + n_elements);
+                    at += 17 + n_elements;
+                }
+                from += 17 + n_elements;
+            }
+
+            // Set size
+            int s = (at - size);
+            *(size++) = (s & 0xFF00) / 256;
+            *(size++) = (s & 0xFF);
+
         }else{
             // Copy other headers
             memcpy(at, cur->data, cur->size);
             at += cur->size;
         }
+    }
 
-        /*
-         * Actually we are too late at this point, but let's just assume
-         * anyone provides enough space for the header
-         */
-        if(buffer + buffer_size < at){
-            return E_FULL;
-        }
+    return at - buffer;
+}
+
+long jpeg_write_recompress_header(struct jpeg* jpeg, unsigned char* buffer, long buffer_size){
+    JPEG_TRACE_BEGIN(span);
+#ifdef JPEG_STATS
+    double start = jpeg->stats ? jpeg_stats_time() : 0;
+#endif
+
+    long written = write_recompress_header(jpeg, buffer, buffer_size);
+    JPEG_TRACE_END(span, "jpeg_write_recompress_header", written);
 
+#ifdef JPEG_STATS
+    if(jpeg->stats){
+        jpeg->stats->seconds_header += jpeg_stats_time() - start;
     }
+#endif
 
-    return at - buffer;
+    return written;
 }
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -5,19 +7,183 @@
 #include <time.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "jpeg.h"
+#include "mjpeg.h"
+#include "parallel.h"
+#include "trace.h"
 
 #define REENCODE
 
+/* Wall-clock seconds, the reencode may run on several threads */
+static double now(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1.e-9 * time.tv_nsec;
+}
+
+/* Input and output may be - for stdin and stdout */
+static int reencode_mjpeg(struct jpeg_requantization* requantization, int optimise, int restart_interval, char* input, char* output, int threads){
+    int input_fd = strcmp(input, "-") ? open(input, O_RDONLY) : STDIN_FILENO;
+    FILE* f = strcmp(output, "-") ? fopen(output, "wb") : stdout;
+    if(input_fd < 0 || !f){
+        printf("Error: Could not open files\n");
+        return 1;
+    }
+
+    // Keep stdout clean if frames are written to it
+    FILE* report = f == stdout ? stderr : stdout;
+
+    struct jpeg_mjpeg_stats stats;
+    int status = jpeg_mjpeg_reencode(input_fd, f, requantization, optimise, restart_interval,
+            jpeg_parallel_threads(threads), report, &stats);
+
+    if(input_fd != STDIN_FILENO){
+        close(input_fd);
+    }
+    if(f != stdout){
+        fclose(f);
+    }
+
+    if(status){
+        fprintf(report, "Error: %d\n", status);
+        return 1;
+    }
+
+    fprintf(report, "Reencoded %ld frames (%ld failed): %ldkB to %ldkB in %fms\n",
+            stats.n_frames,
+            stats.n_failed,
+            stats.bytes_input/1000,
+            stats.bytes_output/1000,
+            1000.*stats.seconds
+    );
+
+    fprintf(report, "=======================================> %ffps, %fMbps\n",
+            stats.n_frames/stats.seconds,
+            stats.bytes_input * 8./stats.seconds * 1.e-6
+    );
+
+    return 0;
+}
+
+/* 64 whitespace-separated positive (or with allow_zero non-negative) values in zigzag order */
+static int read_matrix(char* path, float* matrix, int allow_zero){
+    FILE* f = fopen(path, "r");
+    if(!f){
+        return 1;
+    }
+
+    int n = 0;
+    while(n < 64 && fscanf(f, "%f", matrix + n) == 1 && (matrix[n] > 0 || (allow_zero && matrix[n] == 0))){
+        n++;
+    }
+    fclose(f);
+
+    return n != 64;
+}
+
+static void write_trace(char* path){
+    jpeg_trace_stop();
+
+    FILE* f = fopen(path, "w");
+    if(!f){
+        fprintf(stderr, "Error: Could not open %s\n", path);
+        return;
+    }
+    jpeg_trace_write(f);
+    fclose(f);
+}
+
 int main(int argc, char** argv){
-    if (argc < 4){
-        printf("Usage jpeg-reencode <factor> file.jpg output.jpg");
+    int optimise = 0;
+    int mjpeg = 0;
+    int restart_interval = 0;
+    int print_stats = 0;
+    char* trace = 0;
+    float chroma_factor = 0;
+    char* matrix_paths[3] = { 0, 0, 0 };
+
+    // Positional arguments, options may appear anywhere
+    char* args[4];
+    int n_args = 0;
+    for(int i=1; i<argc; i++){
+        if(!strcmp(argv[i], "--optimise")){
+            optimise = 1;
+        }else if(!strcmp(argv[i], "--stats")){
+            print_stats = 1;
+        }else if(!strcmp(argv[i], "--mjpeg")){
+            mjpeg = 1;
+        }else if(!strcmp(argv[i], "--restart") && i + 1 < argc){
+            restart_interval = atoi(argv[++i]);
+        }else if(!strcmp(argv[i], "--trace") && i + 1 < argc){
+            trace = argv[++i];
+        }else if(!strcmp(argv[i], "--chroma") && i + 1 < argc){
+            chroma_factor = atof(argv[++i]);
+        }else if(!strcmp(argv[i], "--luma-matrix") && i + 1 < argc){
+            matrix_paths[0] = argv[++i];
+        }else if(!strcmp(argv[i], "--chroma-matrix") && i + 1 < argc){
+            matrix_paths[1] = argv[++i];
+        }else if(!strcmp(argv[i], "--dead-zone") && i + 1 < argc){
+            matrix_paths[2] = argv[++i];
+        }else if(n_args < 4){
+            args[n_args++] = argv[i];
+        }
+    }
+
+    if (n_args < 3 || restart_interval < 0 || restart_interval > 65535){
+        printf("Usage jpeg-reencode [options] [--stats] <factor> file.jpg output.jpg [threads]\n");
+        printf("      jpeg-reencode --mjpeg [options] <factor> input.mjpeg output.mjpeg [threads]\n");
+        printf("Options: --optimise, --restart <mcus>, --trace out.json,\n");
+        printf("         --chroma <factor> (default: factor), --luma-matrix <file>, --chroma-matrix <file>,\n");
+        printf("         --dead-zone <file>\n");
+        printf("A matrix file holds 64 multipliers of the factor in zigzag order, a dead zone file the magnitude\n");
+        printf("in output steps below which coefficients are zeroed (0 for none, inf to drop the position)\n");
         exit(1);
     }
 
-    float factor = atof(argv[1]);
+    float factor = atof(args[0]);
+
+    struct jpeg_requantization requantization;
+    jpeg_requantization_init(&requantization, factor);
+    if(chroma_factor > 0){
+        requantization.chroma_factor = chroma_factor;
+    }
+
+    float matrices[3][64];
+    for(int i=0; i<3; i++){
+        if(!matrix_paths[i]){
+            continue;
+        }
+        if(read_matrix(matrix_paths[i], matrices[i], i == 2)){
+            printf("Error: Could not read 64 %s values from %s\n", i == 2 ? "non-negative" : "positive", matrix_paths[i]);
+            exit(1);
+        }
+    }
+    requantization.luma_matrix = matrix_paths[0] ? matrices[0] : 0;
+    requantization.chroma_matrix = matrix_paths[1] ? matrices[1] : 0;
+    requantization.dead_zone = matrix_paths[2] ? matrices[2] : 0;
+
+    if(trace){
+#ifndef JPEG_TRACE
+        fprintf(stderr, "Warning: Built without trace\n");
+#endif
+        jpeg_trace_start();
+    }
+
+    // Streams use all cores by default
+    if(mjpeg){
+        int status = reencode_mjpeg(&requantization, optimise, restart_interval, args[1], args[2], n_args > 3 ? atoi(args[3]) : 0);
+        if(trace){
+            write_trace(trace);
+        }
+        return status;
+    }
+
+    int threads = n_args > 3 ? atoi(args[3]) : 1;
 
-    FILE* f = fopen(argv[2], "rb");
+    FILE* f = fopen(args[1], "rb");
     fseek(f, 0, SEEK_END);
     long bytes_input = ftell(f);
     fseek(f, 0, SEEK_SET);
@@ -27,15 +193,15 @@ int main(int argc, char** argv){
 
     struct jpeg jpeg;
 
-    clock_t init_time = clock();
+    double init_time = now();
     int status = jpeg_init(&jpeg, bytes_input, input_buffer);
     if(status){
         printf("Error: %d\n", status);
         exit(1);
     }
-    init_time = clock() - init_time;
+    init_time = now() - init_time;
 
-    printf("Read header in %fms\n", 1000.*init_time/CLOCKS_PER_SEC);
+    printf("Read header in %fms\n", 1000.*init_time);
     printf("Image size: %dx%d, %dMP\n", jpeg.width, jpeg.height, jpeg.width * jpeg.height / 1000000);
 
     /* jpeg_print_sizes(&jpeg); */
@@ -44,25 +210,62 @@ int main(int argc, char** argv){
     /* jpeg_print_quantisation_tables(&jpeg); */
     /* jpeg_print_huffman_tables(&jpeg); */
 
-    unsigned char* output_buffer = malloc(bytes_input);
-    memset(output_buffer, 0, bytes_input);
+    jpeg_init_recompress(&jpeg, &requantization);
+    jpeg.output_restart_interval = restart_interval;
+
+    long bytes_output_buffer = jpeg_reencode_max_size(&jpeg);
+    unsigned char* output_buffer = malloc(bytes_output_buffer);
+
+    struct jpeg_stats stats;
+    jpeg_stats_init(&stats);
+    if(print_stats){
+#ifdef JPEG_STATS
+        jpeg.stats = &stats;
+#else
+        printf("Warning: Built without stats\n");
+#endif
+    }
+
+    double optimise_time = 0.;
+    if(optimise){
+        optimise_time = now();
+        status = jpeg_decode_huffman_parallel(&jpeg, threads);
+        if(!status){
+            status = jpeg_optimise_huffman(&jpeg);
+        }
+        if(status){
+            printf("Error: %d\n", status);
+            exit(1);
+        }
+        optimise_time = now() - optimise_time;
+        printf("Optimised huffman tables in %fms\n", 1000.*optimise_time);
+    }
 
-    for(int i=0; i<jpeg.n_quantisation_tables; i++){
-        jpeg_quantisation_table_init_recompress(jpeg.quantisation_tables[i], factor);
+    /* Progressive scans would otherwise be decoded inside the header writer */
+    double progressive_time = 0.;
+    if(jpeg.progressive && !optimise){
+        progressive_time = now();
+        status = jpeg_progressive_prepare(&jpeg);
+        if(status){
+            printf("Error: %d\n", status);
+            exit(1);
+        }
+        progressive_time = now() - progressive_time;
+        printf("Decoded progressive scans in %fms\n", 1000.*progressive_time);
     }
 
-    clock_t header_time = clock();
-    long bytes_header = jpeg_write_recompress_header(&jpeg, output_buffer, bytes_input);
+    double header_time = now();
+    long bytes_header = jpeg_write_recompress_header(&jpeg, output_buffer, bytes_output_buffer);
     if(bytes_header < 0){
         printf("Error: %ld\n", bytes_header);
         exit(1);
     }
-    header_time = clock() - header_time;
-    printf("Wrote header in %fms\n", 1000.*header_time/CLOCKS_PER_SEC);
+    header_time = now() - header_time;
+    printf("Wrote header in %fms\n", 1000.*header_time);
 
 #ifndef REENCODE
-    clock_t decode_time = clock();
-    status = jpeg_decode_huffman(&jpeg);
+    double decode_time = now();
+    status = optimise || jpeg.progressive ? 0 : jpeg_decode_huffman(&jpeg);
     if(status == E_SIZE_MISMATCH){
         printf("Error: Wrong number of MCUs\n");
         exit(1);
@@ -70,51 +273,55 @@ int main(int argc, char** argv){
         printf("Error: %d\n", status);
         exit(1);
     }
-    decode_time = clock() - decode_time;
+    decode_time = now() - decode_time + progressive_time;
 
-    printf("Decoded: %ldkB in %fms\n", bytes_input/1000, 1000.*decode_time/CLOCKS_PER_SEC);
+    printf("Decoded: %ldkB in %fms\n", bytes_input/1000, 1000.*decode_time);
 
-    clock_t encode_time = clock();
-    long bytes_scan = jpeg_encode_huffman(&jpeg, output_buffer + bytes_header, bytes_input - bytes_header);
+    double encode_time = now();
+    long bytes_scan = jpeg_encode_huffman(&jpeg, output_buffer + bytes_header, bytes_output_buffer - bytes_header);
     if(bytes_scan < 0){
         printf("Error: %ld\n", bytes_scan);
         exit(1);
     }
-    encode_time = clock() - encode_time;
+    encode_time = now() - encode_time;
 
     long bytes_output = bytes_header + bytes_scan;
 
-    printf("Encoded: %ldkB in %fms\n", bytes_output/1000, 1000.*encode_time/CLOCKS_PER_SEC);
+    printf("Encoded: %ldkB in %fms\n", bytes_output/1000, 1000.*encode_time);
 
     printf("\t\t\t\t\t %fMbps\n",
-            bytes_input * 8 * CLOCKS_PER_SEC/(decode_time + encode_time) * 1.e-6
+            bytes_input * 8./(decode_time + encode_time) * 1.e-6
     );
 
 #else
 
-    clock_t reencode_time = clock();
-    long bytes_scan = jpeg_reencode_huffman(&jpeg, output_buffer + bytes_header, bytes_input - bytes_header);
+    double reencode_time = now();
+    long bytes_scan = jpeg_reencode_huffman_parallel(&jpeg, output_buffer + bytes_header, bytes_output_buffer - bytes_header, threads);
     if(bytes_scan < 0){
         printf("Error: %ld\n", bytes_scan);
         exit(1);
     }
-    reencode_time = clock() - reencode_time;
+    reencode_time = now() - reencode_time + optimise_time + progressive_time;
 
     long bytes_output = bytes_header + bytes_scan;
 
     printf("Reencoded: %ldkB to %ldkB in %fms\n",
             bytes_input/1000,
             bytes_output/1000,
-            1000.*reencode_time/CLOCKS_PER_SEC
+            1000.*reencode_time
     );
 
     printf("=======================================> %fMbps\n",
-            bytes_input * 8. * CLOCKS_PER_SEC/reencode_time * 1.e-6
+            bytes_input * 8./reencode_time * 1.e-6
     );
 
 #endif
 
-    f = fopen(argv[3], "wb");  
+    if(jpeg.stats){
+        jpeg_stats_print(&stats, stdout);
+    }
+
+    f = fopen(args[2], "wb");  
     fwrite(output_buffer, 1, bytes_output, f);
     fclose(f);
 
@@ -122,5 +329,9 @@ int main(int argc, char** argv){
 
     free(input_buffer);
     free(output_buffer);
+
+    if(trace){
+        write_trace(trace);
+    }
     return 0;
 }
@@ -0,0 +1,520 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "jpeg.h"
+#include "huffman.h"
+#include "requantize.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define MAX_REPEAT 1000
+
+/* Each run of a kernel takes at least this long, short ones loop over the corpus */
+#define MIN_RUN_SECONDS 0.02
+
+static double now(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1.e-9 * time.tv_nsec;
+}
+
+/* Time stamp counter where there is one, bits/cycle is not reported otherwise */
+static uint64_t cycles(){
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Symbol as the encoder writes it: a code, followed by ssss magnitude bits */
+struct symbol {
+    /* 0 .. MAX_TABLES-1 for DC tables, MAX_TABLES .. 2*MAX_TABLES-1 for AC */
+    uint8_t table;
+    uint8_t symbol;
+    uint8_t ssss;
+    int16_t value;
+
+    /* (size << 16) | code, as in huffman_inv */
+    uint32_t code;
+};
+
+/* Symbols of one image and the streams the decoding kernels read */
+struct corpus {
+    struct jpeg jpeg;
+
+    long n_symbols;
+    struct symbol* symbols;
+
+    struct huffman_inv* inv[2 * MAX_TABLES];
+    struct huffman_lookup* lookup[2 * MAX_TABLES];
+    struct huffman_tree tree[2 * MAX_TABLES];
+
+    /* Codes and magnitude bits, codes only, magnitude bits only */
+    unsigned char* full;
+    long full_size;
+    long full_bits;
+    unsigned char* codes;
+    long codes_size;
+    long codes_bits;
+    unsigned char* values;
+    long values_size;
+    long values_bits;
+
+    unsigned char* output;
+    long output_capacity;
+
+    /* Sums the decoding kernels have to arrive at */
+    long symbol_sum;
+    long value_sum;
+};
+
+static uint32_t value_bits(struct symbol* symbol){
+    return (uint32_t)(symbol->value - (symbol->value < 0)) & ((1u << symbol->ssss) - 1);
+}
+
+static void add_symbol(struct corpus* corpus, long* capacity, int table, int symbol, int value){
+    if(corpus->n_symbols == *capacity){
+        *capacity = *capacity ? 2 * *capacity : 4096;
+        corpus->symbols = realloc(corpus->symbols, *capacity * sizeof(struct symbol));
+    }
+
+    struct symbol* s = corpus->symbols + corpus->n_symbols++;
+    s->table = table;
+    s->symbol = symbol;
+    s->ssss = symbol & 0x0F;
+    s->value = value;
+    s->code = corpus->inv[table]->codes[symbol];
+
+    corpus->full_bits += (s->code >> 16) + s->ssss;
+    corpus->codes_bits += s->code >> 16;
+    corpus->values_bits += s->ssss;
+    corpus->symbol_sum += symbol;
+    corpus->value_sum += s->ssss ? value : 0;
+}
+
+/* Symbols of the quantised coefficients, without restarts, the same way encode_block writes them */
+static void extract_symbols(struct corpus* corpus){
+    struct jpeg* jpeg = &corpus->jpeg;
+    long capacity = 0;
+    int dc_offset[MAX_COMPONENTS] = { 0 };
+
+    for(int i=0; i<jpeg->n_blocks; i++){
+        struct jpeg_block* block = jpeg->blocks + i;
+        struct jpeg_component* component = jpeg->components[block->component_id - 1];
+        int dc = component->dc_huffman_id;
+        int ac = MAX_TABLES + component->ac_huffman_id;
+
+        int diff = block->values[0] - dc_offset[block->component_id - 1];
+        dc_offset[block->component_id - 1] = block->values[0];
+        add_symbol(corpus, &capacity, dc, huffman_value_ssss(diff), diff);
+
+        int last = 0;
+        for(int k=1; k<64; k++){
+            if(!block->values[k]){
+                continue;
+            }
+
+            int zeros = k - last - 1;
+            while(zeros > 15){
+                add_symbol(corpus, &capacity, ac, 0xF0, 0);
+                zeros -= 16;
+            }
+            add_symbol(corpus, &capacity, ac, (zeros << 4) + huffman_value_ssss(block->values[k]), block->values[k]);
+            last = k;
+        }
+        if(last < 63){
+            add_symbol(corpus, &capacity, ac, 0x00, 0);
+        }
+    }
+}
+
+/* Write the fields selected by codes and values, returns the number of bytes */
+static long write_stream(struct corpus* corpus, unsigned char* buffer, long size, int codes, int values){
+    struct jpeg_obitstream stream;
+    jpeg_obitstream_init(&stream, buffer, size);
+    for(long i=0; i<corpus->n_symbols; i++){
+        struct symbol* s = corpus->symbols + i;
+        if(codes){
+            jpeg_obitstream_write_bits(&stream, s->code & 0xFFFF, s->code >> 16);
+        }
+        if(values && s->ssss){
+            jpeg_obitstream_write_bits(&stream, value_bits(s), s->ssss);
+        }
+    }
+    jpeg_obitstream_flush(&stream);
+    return stream.at - buffer;
+}
+
+static void build_tree(struct huffman_tree* tree, struct jpeg_huffman_table* table){
+    huffman_tree_init(tree);
+    int k = 0;
+    for(int size=1; size<=16; size++){
+        for(int i=0; i<table->counts[size - 1]; i++){
+            huffman_tree_insert_goleft(tree, size, table->elements[k++]);
+        }
+    }
+}
+
+static void corpus_destroy(struct corpus* corpus){
+    for(int i=0; i<2 * MAX_TABLES; i++){
+        if(corpus->inv[i]){
+            huffman_tree_destroy(corpus->tree + i);
+        }
+    }
+    free(corpus->symbols);
+    free(corpus->full);
+    free(corpus->codes);
+    free(corpus->values);
+    free(corpus->output);
+    jpeg_destroy(&corpus->jpeg);
+}
+
+static int corpus_init(struct corpus* corpus, long size, unsigned char* data, float factor){
+    memset(corpus, 0, sizeof(struct corpus));
+
+    int status = jpeg_init(&corpus->jpeg, size, data);
+    if(status){
+        return status;
+    }
+
+    struct jpeg* jpeg = &corpus->jpeg;
+    if(jpeg->progressive){
+        jpeg_destroy(jpeg);
+        return E_PROGRESSIVE;
+    }
+
+    for(int i=0; i<jpeg->n_quantisation_tables; i++){
+        jpeg_quantisation_table_init_recompress(jpeg->quantisation_tables[i], factor);
+    }
+
+    status = jpeg_decode_huffman(jpeg);
+    if(status){
+        jpeg_destroy(jpeg);
+        return status;
+    }
+
+    for(int i=0; i<MAX_TABLES; i++){
+        struct jpeg_huffman_table* tables[2] = { jpeg->dc_huffman_tables[i], jpeg->ac_huffman_tables[i] };
+        for(int j=0; j<2; j++){
+            if(tables[j]){
+                corpus->inv[i + j * MAX_TABLES] = tables[j]->huffman_inv;
+                corpus->lookup[i + j * MAX_TABLES] = tables[j]->huffman_lookup;
+                build_tree(corpus->tree + i + j * MAX_TABLES, tables[j]);
+            }
+        }
+    }
+
+    extract_symbols(corpus);
+
+    // Room for stuffing every byte
+    corpus->output_capacity = 2 * (corpus->full_bits / 8) + 16;
+    corpus->output = malloc(corpus->output_capacity);
+    corpus->full = malloc(corpus->output_capacity);
+    corpus->codes = malloc(corpus->output_capacity);
+    corpus->values = malloc(corpus->output_capacity);
+
+    corpus->full_size = write_stream(corpus, corpus->full, corpus->output_capacity, 1, 1);
+    corpus->codes_size = write_stream(corpus, corpus->codes, corpus->output_capacity, 1, 0);
+    corpus->values_size = write_stream(corpus, corpus->values, corpus->output_capacity, 0, 1);
+
+    return 0;
+}
+
+/*
+ * Kernels, each one pass over the corpus. They return a checksum which is
+ * compared with the expected one, so the work cannot be optimised away.
+ */
+
+static long bench_ibitstream_read(struct corpus* corpus){
+    struct jpeg_ibitstream stream;
+    jpeg_ibitstream_init(&stream, corpus->full, corpus->full_size);
+
+    long sum = 0;
+    for(long i=0; i<corpus->n_symbols; i++){
+        struct symbol* s = corpus->symbols + i;
+        uint32_t code = 0, bits = 0;
+        jpeg_ibitstream_read_bits(&stream, s->code >> 16, &code);
+        jpeg_ibitstream_read_bits(&stream, s->ssss, &bits);
+        sum += code + bits;
+    }
+    return sum;
+}
+
+static long bench_huffman_lookup(struct corpus* corpus){
+    struct jpeg_ibitstream stream;
+    jpeg_ibitstream_init(&stream, corpus->codes, corpus->codes_size);
+
+    long sum = 0;
+    for(long i=0; i<corpus->n_symbols; i++){
+        uint8_t symbol = 0;
+        huffman_lookup_decode(corpus->lookup[corpus->symbols[i].table], &stream, &symbol);
+        sum += symbol;
+    }
+    return sum;
+}
+
+static long bench_huffman_tree(struct corpus* corpus){
+    struct jpeg_ibitstream stream;
+    jpeg_ibitstream_init(&stream, corpus->codes, corpus->codes_size);
+
+    long sum = 0;
+    for(long i=0; i<corpus->n_symbols; i++){
+        uint8_t symbol = 0;
+        huffman_tree_decode(corpus->tree + corpus->symbols[i].table, &stream, &symbol);
+        sum += symbol;
+    }
+    return sum;
+}
+
+static long bench_from_ssss(struct corpus* corpus){
+    struct jpeg_ibitstream stream;
+    jpeg_ibitstream_init(&stream, corpus->values, corpus->values_size);
+
+    long sum = 0;
+    for(long i=0; i<corpus->n_symbols; i++){
+        int value = 0;
+        huffman_from_ssss(corpus->symbols[i].ssss, &stream, &value);
+        sum += corpus->symbols[i].ssss ? value : 0;
+    }
+    return sum;
+}
+
+static long bench_requantize(struct corpus* corpus){
+    struct jpeg* jpeg = &corpus->jpeg;
+    int16_t result[64];
+
+    long sum = 0;
+    for(int i=0; i<jpeg->n_blocks; i++){
+        struct jpeg_block* block = jpeg->blocks + i;
+        struct jpeg_quantisation_table* quantisation =
+            jpeg->quantisation_tables[jpeg->components[block->component_id - 1]->quantisation_id];
+        uint64_t mask = jpeg_requantize_block(block->values, result,
+                quantisation->recompress_integers, quantisation->recompress_fractions, quantisation->recompress_thresholds);
+        sum ^= (long)mask;
+    }
+    return sum;
+}
+
+static long bench_encode_value(struct corpus* corpus){
+    struct jpeg_obitstream stream;
+    jpeg_obitstream_init(&stream, corpus->output, corpus->output_capacity);
+
+    for(long i=0; i<corpus->n_symbols; i++){
+        struct symbol* s = corpus->symbols + i;
+        if(s->table >= MAX_TABLES && !s->ssss){
+            // EOB and ZRL
+            huffman_inv_encode(corpus->inv[s->table], &stream, s->symbol);
+        }else{
+            huffman_inv_encode_value(corpus->inv[s->table], &stream, s->value, s->symbol >> 4);
+        }
+    }
+    jpeg_obitstream_flush(&stream);
+    return stream.at - corpus->output;
+}
+
+static long bench_obitstream_write(struct corpus* corpus){
+    struct jpeg_obitstream stream;
+    jpeg_obitstream_init(&stream, corpus->output, corpus->output_capacity);
+
+    for(long i=0; i<corpus->n_symbols; i++){
+        struct symbol* s = corpus->symbols + i;
+        jpeg_obitstream_write_bits(&stream, s->code & 0xFFFF, s->code >> 16);
+        jpeg_obitstream_write_bits(&stream, value_bits(s), s->ssss);
+    }
+    jpeg_obitstream_flush(&stream);
+    return stream.at - corpus->output;
+}
+
+struct kernel {
+    const char* name;
+    long (*run)(struct corpus* corpus);
+};
+
+static const struct kernel kernels[] = {
+    { "ibitstream_read", bench_ibitstream_read },
+    { "huffman_lookup", bench_huffman_lookup },
+    { "huffman_tree", bench_huffman_tree },
+    { "from_ssss", bench_from_ssss },
+    { "requantize", bench_requantize },
+    { "encode_value", bench_encode_value },
+    { "obitstream_write", bench_obitstream_write },
+};
+
+/* Work of a kernel per pass: items (symbols or coefficients), bits of entropy-coded data and checksum */
+static void kernel_work(struct corpus* corpus, int k, long* items, long* bits, long* expected){
+    const char* name = kernels[k].name;
+    *items = corpus->n_symbols;
+    *bits = corpus->full_bits;
+    *expected = corpus->symbol_sum;
+
+    if(!strcmp(name, "ibitstream_read")){
+        *expected = -1;
+    }else if(!strcmp(name, "huffman_lookup") || !strcmp(name, "huffman_tree")){
+        *bits = corpus->codes_bits;
+    }else if(!strcmp(name, "from_ssss")){
+        *bits = corpus->values_bits;
+        *expected = corpus->value_sum;
+    }else if(!strcmp(name, "requantize")){
+        *items = 64L * corpus->jpeg.n_blocks;
+        *bits = 0;
+        *expected = -1;
+    }else{
+        *expected = corpus->full_size;
+    }
+}
+
+static void run_kernel(struct corpus* corpus, int k, int repeat){
+    long items, bits, expected;
+    kernel_work(corpus, k, &items, &bits, &expected);
+
+    // Checksums without a fixed value have to agree between passes
+    long first = kernels[k].run(corpus);
+    if(expected >= 0 && first != expected){
+        printf("%-18s wrong result %ld, expected %ld\n", kernels[k].name, first, expected);
+        return;
+    }
+
+    double start = now();
+    first = kernels[k].run(corpus);
+    double once = now() - start;
+    int passes = once > 0 ? (int)ceil(MIN_RUN_SECONDS / once) : 1;
+    if(passes < 1){
+        passes = 1;
+    }
+
+    double ns[MAX_REPEAT];
+    double cycles_per_pass[MAX_REPEAT];
+    for(int r=0; r<repeat; r++){
+        uint64_t start_cycles = cycles();
+        start = now();
+        for(int p=0; p<passes; p++){
+            if(kernels[k].run(corpus) != first){
+                printf("%-18s result differs between passes\n", kernels[k].name);
+                return;
+            }
+        }
+        double seconds = now() - start;
+        cycles_per_pass[r] = (double)(cycles() - start_cycles) / passes;
+        ns[r] = 1.e9 * seconds / passes / items;
+    }
+
+    double mean = 0, min = 0, mean_cycles = 0;
+    for(int r=0; r<repeat; r++){
+        mean += ns[r] / repeat;
+        mean_cycles += cycles_per_pass[r] / repeat;
+        min = !r || ns[r] < min ? ns[r] : min;
+    }
+    double variance = 0;
+    for(int r=0; r<repeat; r++){
+        variance += (ns[r] - mean) * (ns[r] - mean) / (repeat > 1 ? repeat - 1 : 1);
+    }
+
+    printf("%-18s %10.3f %10.3f %10.3f %8.1f", kernels[k].name, mean, sqrt(variance), min, 100. * sqrt(variance) / mean);
+    if(bits && mean_cycles > 0){
+        printf(" %10.3f\n", bits / mean_cycles);
+    }else{
+        printf(" %10s\n", "-");
+    }
+}
+
+static void usage(){
+    printf("Usage jpeg-reencode-microbench [--cpu <n>] [--repeat <n>] [--factor <f>] [--kernel <name>] file.jpg ...\n");
+    printf("Kernels:");
+    for(unsigned int k=0; k<sizeof(kernels) / sizeof(kernels[0]); k++){
+        printf(" %s", kernels[k].name);
+    }
+    printf("\nrequantize is timed per coefficient, the others per symbol\n");
+    exit(1);
+}
+
+int main(int argc, char** argv){
+    int cpu = -1;
+    int repeat = 10;
+    float factor = 2.;
+    char* only = 0;
+
+    char** files = malloc(argc * sizeof(char*));
+    int n_files = 0;
+    for(int i=1; i<argc; i++){
+        if(!strcmp(argv[i], "--cpu") && i + 1 < argc){
+            cpu = atoi(argv[++i]);
+        }else if(!strcmp(argv[i], "--repeat") && i + 1 < argc){
+            repeat = atoi(argv[++i]);
+        }else if(!strcmp(argv[i], "--factor") && i + 1 < argc){
+            factor = atof(argv[++i]);
+        }else if(!strcmp(argv[i], "--kernel") && i + 1 < argc){
+            only = argv[++i];
+        }else{
+            files[n_files++] = argv[i];
+        }
+    }
+
+    if(!n_files || repeat < 1 || repeat > MAX_REPEAT || factor <= 0){
+        usage();
+    }
+
+    if(cpu >= 0){
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if(sched_setaffinity(0, sizeof(set), &set)){
+            printf("Could not pin to CPU %d\n", cpu);
+            exit(1);
+        }
+#else
+        printf("Pinning is not supported on this platform\n");
+#endif
+    }
+
+    for(int f=0; f<n_files; f++){
+        FILE* file = fopen(files[f], "rb");
+        if(!file){
+            printf("Could not open %s\n", files[f]);
+            continue;
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        unsigned char* data = malloc(size > 0 ? size : 1);
+        long read = fread(data, 1, size, file);
+        fclose(file);
+
+        struct corpus corpus;
+        int status = read == size ? corpus_init(&corpus, size, data, factor) : E_EMPTY;
+        if(status){
+            printf("%s: skipped (%d)\n", files[f], status);
+            free(data);
+            continue;
+        }
+
+        printf("\n%s: %ld symbols, %ld bits, %d blocks, %d runs\n",
+                files[f], corpus.n_symbols, corpus.full_bits, corpus.jpeg.n_blocks, repeat);
+        printf("%-18s %10s %10s %10s %8s %10s\n", "kernel", "ns/symbol", "stddev", "min", "cv %", "bits/cycle");
+
+        for(unsigned int k=0; k<sizeof(kernels) / sizeof(kernels[0]); k++){
+            if(!only || !strcmp(only, kernels[k].name)){
+                run_kernel(&corpus, k, repeat);
+            }
+        }
+
+        corpus_destroy(&corpus);
+        free(data);
+    }
+
+    free(files);
+    return 0;
+}
@@ -0,0 +1,435 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "jpeg.h"
+#include "mjpeg.h"
+#include "trace.h"
+
+#define READ_SIZE 65536
+
+static double now(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1.e-9 * time.tv_nsec;
+}
+
+static long find_soi(unsigned char* data, long size, long from){
+    for(long i=from; i<size-1; i++){
+        unsigned char* ff = memchr(data + i, 0xFF, size - 1 - i);
+        if(!ff){
+            break;
+        }
+
+        i = ff - data;
+        if(data[i+1] == 0xD8){
+            return i;
+        }
+    }
+    return -1;
+}
+
+long jpeg_mjpeg_next_frame(unsigned char* data, long size, long* start){
+    long soi = find_soi(data, size, 0);
+
+    while(soi >= 0){
+        // Segments are skipped by their length, scans up to the next marker
+        long at = soi + 2;
+        int malformed = 0;
+        while(!malformed){
+            if(at >= size){
+                break;
+            }
+            if(data[at] != 0xFF){
+                malformed = 1;
+                break;
+            }
+
+            // Markers may be preceded by any number of fill bytes
+            while(at < size && data[at] == 0xFF){
+                at++;
+            }
+            if(at >= size){
+                break;
+            }
+
+            unsigned char marker = data[at++];
+            if(marker == 0xD9){
+                *start = soi;
+                return at;
+            }
+            if(marker == 0x00 || marker == 0xD8){
+                malformed = 1;
+                break;
+            }
+            if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)){
+                continue;
+            }
+
+            if(at + 2 > size){
+                break;
+            }
+            long length = (data[at] << 8) | data[at + 1];
+            if(length < 2){
+                malformed = 1;
+                break;
+            }
+            at += length;
+
+            if(marker == 0xDA){
+                // Entropy coded data ends at the first marker which is not a restart
+                unsigned char* ff;
+                while(at < size && (ff = memchr(data + at, 0xFF, size - at))){
+                    at = ff - data;
+                    if(at + 1 >= size){
+                        at = size;
+                        break;
+                    }
+
+                    unsigned char next = data[at + 1];
+                    if(next == 0x00 || (next >= 0xD0 && next <= 0xD7)){
+                        at += 2;
+                    }else if(next == 0xFF){
+                        at++;
+                    }else{
+                        break;
+                    }
+                }
+                if(at >= size || data[at] != 0xFF){
+                    at = size;
+                    break;
+                }
+            }
+        }
+
+        if(!malformed){
+            // Incomplete
+            *start = soi;
+            return 0;
+        }
+
+        soi = find_soi(data, size, soi + 2);
+    }
+
+    // Keep a trailing 0xFF, it may be the start of the next SOI
+    *start = size > 0 && data[size - 1] == 0xFF ? size - 1 : size;
+    return 0;
+}
+
+#define SLOT_FREE 0
+#define SLOT_QUEUED 1
+#define SLOT_DONE 2
+
+struct mjpeg_slot {
+    int state;
+
+    unsigned char* input;
+    long input_size;
+    long input_capacity;
+
+    unsigned char* output;
+    long output_capacity;
+
+    /* Bytes written to output or an error */
+    long output_size;
+    double seconds;
+};
+
+struct mjpeg_pipeline {
+    struct jpeg_requantization requantization;
+    int optimise;
+    int restart_interval;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+
+    /* Frame i is held by slots[i % n_slots] */
+    int n_slots;
+    struct mjpeg_slot* slots;
+
+    /* Frames read, taken by a worker and written */
+    long n_read;
+    long n_taken;
+    long n_written;
+
+    int finished;
+};
+
+static long reencode_frame(struct jpeg_context* context, struct mjpeg_slot* slot, struct mjpeg_pipeline* pipeline){
+    int status = jpeg_context_parse(context, slot->input_size, slot->input);
+    if(status){
+        return status;
+    }
+
+    struct jpeg* jpeg = &context->jpeg;
+    jpeg->output_restart_interval = pipeline->restart_interval;
+    jpeg_init_recompress(jpeg, &pipeline->requantization);
+
+    // The limit does not depend on earlier frames, so slots are only ever grown
+    long output_size = jpeg_reencode_max_size(jpeg);
+    if(slot->output_capacity < output_size){
+        free(slot->output);
+        slot->output = malloc(output_size);
+        slot->output_capacity = slot->output ? output_size : 0;
+        if(!slot->output){
+            return E_FULL;
+        }
+    }
+
+    if(pipeline->optimise){
+        status = jpeg_optimise_huffman(jpeg);
+        if(status){
+            return status;
+        }
+    }
+
+    long bytes_header = jpeg_context_write_recompress_header(context, slot->output, output_size);
+    if(bytes_header < 0){
+        return bytes_header;
+    }
+
+    long bytes_scan = jpeg_reencode_huffman(jpeg, slot->output + bytes_header, output_size - bytes_header);
+    if(bytes_scan < 0){
+        return bytes_scan;
+    }
+
+    return bytes_header + bytes_scan;
+}
+
+static void* mjpeg_worker(void* arg){
+    struct mjpeg_pipeline* pipeline = arg;
+
+    struct jpeg_context context;
+    jpeg_context_init(&context);
+
+    pthread_mutex_lock(&pipeline->mutex);
+    for(;;){
+        while(pipeline->n_taken == pipeline->n_read && !pipeline->finished){
+            pthread_cond_wait(&pipeline->queued, &pipeline->mutex);
+        }
+        if(pipeline->n_taken == pipeline->n_read){
+            break;
+        }
+
+        long frame = pipeline->n_taken++;
+        struct mjpeg_slot* slot = pipeline->slots + frame % pipeline->n_slots;
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        JPEG_TRACE_BEGIN(span);
+        double start = now();
+        slot->output_size = reencode_frame(&context, slot, pipeline);
+        slot->seconds = now() - start;
+        JPEG_TRACE_END(span, "mjpeg frame", frame);
+
+        pthread_mutex_lock(&pipeline->mutex);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&pipeline->done);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    jpeg_context_destroy(&context);
+    return 0;
+}
+
+/* Write finished frames in order, waiting until at most max_pending are left */
+static int mjpeg_write(struct mjpeg_pipeline* pipeline, long max_pending, FILE* output, FILE* report,
+        struct jpeg_mjpeg_stats* stats){
+    for(;;){
+        pthread_mutex_lock(&pipeline->mutex);
+        if(pipeline->n_written == pipeline->n_read){
+            pthread_mutex_unlock(&pipeline->mutex);
+            break;
+        }
+
+        struct mjpeg_slot* slot = pipeline->slots + pipeline->n_written % pipeline->n_slots;
+        if(pipeline->n_read - pipeline->n_written > max_pending){
+            // The reader stalls on the oldest frame
+            JPEG_TRACE_BEGIN(span);
+            while(slot->state != SLOT_DONE){
+                pthread_cond_wait(&pipeline->done, &pipeline->mutex);
+            }
+            JPEG_TRACE_END(span, "mjpeg wait", pipeline->n_written);
+        }
+        int state = slot->state;
+        pthread_mutex_unlock(&pipeline->mutex);
+
+        if(state != SLOT_DONE){
+            break;
+        }
+
+        // Frames which cannot be reencoded are passed on unchanged
+        unsigned char* data = slot->output;
+        long size = slot->output_size;
+        if(size < 0){
+            data = slot->input;
+            size = slot->input_size;
+            stats->n_failed++;
+        }
+
+        if(fwrite(data, 1, size, output) != (size_t)size){
+            return E_WRITE;
+        }
+
+        if(report){
+            if(slot->output_size < 0){
+                fprintf(report, "Frame %ld: Error %ld\n", pipeline->n_written, slot->output_size);
+            }else{
+                fprintf(report, "Frame %ld: %ldkB to %ldkB in %fms, %ffps, %fMbps\n",
+                        pipeline->n_written, slot->input_size/1000, size/1000, 1000.*slot->seconds,
+                        1./slot->seconds, slot->input_size * 8./slot->seconds * 1.e-6);
+            }
+        }
+
+        stats->n_frames++;
+        stats->bytes_input += slot->input_size;
+        stats->bytes_output += size;
+
+        pthread_mutex_lock(&pipeline->mutex);
+        slot->state = SLOT_FREE;
+        pipeline->n_written++;
+        pthread_mutex_unlock(&pipeline->mutex);
+    }
+
+    fflush(output);
+    return 0;
+}
+
+int jpeg_mjpeg_reencode(int input_fd, FILE* output, struct jpeg_requantization* requantization, int optimise, int restart_interval, int n_threads,
+        FILE* report, struct jpeg_mjpeg_stats* stats){
+    struct mjpeg_pipeline pipeline;
+    pipeline.requantization = *requantization;
+    pipeline.optimise = optimise;
+    pipeline.restart_interval = restart_interval;
+    pthread_mutex_init(&pipeline.mutex, 0);
+    pthread_cond_init(&pipeline.queued, 0);
+    pthread_cond_init(&pipeline.done, 0);
+    pipeline.n_slots = 2 * n_threads;
+    pipeline.slots = calloc(pipeline.n_slots, sizeof(struct mjpeg_slot));
+    pipeline.n_read = 0;
+    pipeline.n_taken = 0;
+    pipeline.n_written = 0;
+    pipeline.finished = 0;
+
+    memset(stats, 0, sizeof(struct jpeg_mjpeg_stats));
+    double start_time = now();
+
+    pthread_t* threads = malloc(n_threads * sizeof(pthread_t));
+    int n_started = 0;
+    for(; n_started < n_threads; n_started++){
+        if(pthread_create(threads + n_started, 0, mjpeg_worker, &pipeline)){
+            break;
+        }
+    }
+
+    long capacity = 4 * READ_SIZE;
+    unsigned char* buffer = malloc(capacity);
+    long size = 0;
+
+    // Bytes already known not to contain an EOI
+    long checked = 0;
+
+    int status = n_started ? 0 : E_THREADS;
+    int eof = 0;
+    while(!status && !eof){
+        if(size + READ_SIZE > capacity){
+            capacity = 2 * (size + READ_SIZE);
+            buffer = realloc(buffer, capacity);
+        }
+
+        long bytes = read(input_fd, buffer + size, capacity - size);
+        if(bytes < 0){
+            status = E_READ;
+            break;
+        }
+        eof = !bytes;
+        size += bytes;
+
+        // A frame can only have been completed if an EOI arrived
+        int has_eoi = 0;
+        for(long i=checked > 0 ? checked - 1 : 0; i<size-1 && !has_eoi; i++){
+            unsigned char* ff = memchr(buffer + i, 0xFF, size - 1 - i);
+            if(!ff){
+                break;
+            }
+            i = ff - buffer;
+            has_eoi = buffer[i+1] == 0xD9;
+        }
+        checked = size;
+        if(!has_eoi){
+            continue;
+        }
+
+        long consumed = 0;
+        long start, end;
+        while((end = jpeg_mjpeg_next_frame(buffer + consumed, size - consumed, &start))){
+            // Wait for the slot of the frame
+            status = mjpeg_write(&pipeline, pipeline.n_slots - 1, output, report, stats);
+            if(status){
+                break;
+            }
+
+            struct mjpeg_slot* slot = pipeline.slots + pipeline.n_read % pipeline.n_slots;
+            long frame_size = end - start;
+            if(slot->input_capacity < frame_size){
+                free(slot->input);
+                slot->input = malloc(frame_size);
+                slot->input_capacity = frame_size;
+            }
+            memcpy(slot->input, buffer + consumed + start, frame_size);
+            slot->input_size = frame_size;
+            consumed += end;
+
+            pthread_mutex_lock(&pipeline.mutex);
+            slot->state = SLOT_QUEUED;
+            pipeline.n_read++;
+            pthread_cond_signal(&pipeline.queued);
+            pthread_mutex_unlock(&pipeline.mutex);
+
+            // Pass on whatever is done already
+            status = mjpeg_write(&pipeline, pipeline.n_slots, output, report, stats);
+            if(status){
+                break;
+            }
+        }
+        consumed += start;
+
+        memmove(buffer, buffer + consumed, size - consumed);
+        size -= consumed;
+        checked -= consumed;
+    }
+
+    pthread_mutex_lock(&pipeline.mutex);
+    pipeline.finished = 1;
+    pthread_cond_broadcast(&pipeline.queued);
+    pthread_mutex_unlock(&pipeline.mutex);
+
+    if(!status){
+        status = mjpeg_write(&pipeline, 0, output, report, stats);
+    }
+
+    for(int i=0; i<n_started; i++){
+        pthread_join(threads[i], 0);
+    }
+    free(threads);
+
+    stats->seconds = now() - start_time;
+
+    for(int i=0; i<pipeline.n_slots; i++){
+        free(pipeline.slots[i].input);
+        free(pipeline.slots[i].output);
+    }
+    free(pipeline.slots);
+    free(buffer);
+
+    pthread_cond_destroy(&pipeline.done);
+    pthread_cond_destroy(&pipeline.queued);
+    pthread_mutex_destroy(&pipeline.mutex);
+
+    return status;
+}
@@ -0,0 +1,32 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "parallel.h"
+
+int jpeg_parallel_threads(int requested){
+    if(requested > 0){
+        return requested;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+}
+
+void jpeg_parallel_run(int n_threads, void* (*worker)(void*), void* arg){
+    pthread_t* threads = malloc(n_threads * sizeof(pthread_t));
+
+    // If a thread cannot be created, the remaining ones take over its share
+    int n_started = 0;
+    for(; n_started < n_threads - 1; n_started++){
+        if(pthread_create(threads + n_started, 0, worker, arg)){
+            break;
+        }
+    }
+
+    worker(arg);
+
+    for(int i=0; i<n_started; i++){
+        pthread_join(threads[i], 0);
+    }
+    free(threads);
+}
@@ -0,0 +1,282 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+#include "jpeg.h"
+#include "huffman.h"
+
+static inline int magnitude_ssss(int value){
+    int ssss = 0;
+    while(value){
+        value >>= 1;
+        ssss++;
+    }
+    return ssss < 16 ? ssss : 15;
+}
+
+static inline void count_magnitude(struct jpeg_prediction* prediction, int component, int position, int value){
+    int magnitude = value < 0 ? -value : value;
+    if(magnitude < PREDICT_EXACT){
+        prediction->exact[component][position][magnitude]++;
+    }else{
+        int ssss = magnitude_ssss(magnitude);
+        prediction->large_count[component][position][ssss]++;
+        prediction->large_sum[component][position][ssss] += magnitude;
+    }
+}
+
+/* Code length in the table, codes missing from it are counted as the longest possible */
+static inline int code_size(struct huffman_inv* inv, int element){
+    return inv->data[element].exists ? inv->data[element].size : 16;
+}
+
+/* Estimated bits of the scan for component c given the factors per zigzag position */
+static double estimate_component(struct jpeg_prediction* prediction, int c, float* factors){
+    struct jpeg* jpeg = prediction->jpeg;
+    struct jpeg_component* component = jpeg->components[c];
+    struct huffman_inv* dc_inv = jpeg->dc_huffman_tables[component->dc_huffman_id]->huffman_inv;
+    struct huffman_inv* ac_inv = jpeg->ac_huffman_tables[component->ac_huffman_id]->huffman_inv;
+
+    double n_blocks = prediction->n_blocks[c];
+    if(n_blocks == 0){
+        return 0;
+    }
+
+    // Requantized ssss distribution per position
+    double ssss_count[64][16];
+    double nonzero[64];
+    for(int i=0; i<64; i++){
+        for(int s=0; s<16; s++) ssss_count[i][s] = 0;
+
+        for(int m=0; m<PREDICT_EXACT + 16; m++){
+            double count;
+            double magnitude;
+            if(m < PREDICT_EXACT){
+                count = prediction->exact[c][i][m];
+                magnitude = m;
+            }else{
+                count = prediction->large_count[c][i][m - PREDICT_EXACT];
+                magnitude = count ? prediction->large_sum[c][i][m - PREDICT_EXACT] / count : 0;
+            }
+
+            if(count == 0){
+                continue;
+            }
+
+            if(i == 0){
+                /*
+                 * DC differences are taken after requantizing both values, so
+                 * they round down or up depending on where the pair falls
+                 */
+                double scaled = magnitude * factors[0];
+                double low = floor(scaled);
+                ssss_count[0][magnitude_ssss(low)] += count * (1. - (scaled - low));
+                ssss_count[0][magnitude_ssss(low + 1)] += count * (scaled - low);
+            }else{
+                ssss_count[i][magnitude_ssss(round(magnitude * factors[i]))] += count;
+            }
+        }
+
+        nonzero[i] = 1. - ssss_count[i][0] / n_blocks;
+    }
+
+    double bits = 0;
+
+    // DC differences
+    for(int s=0; s<16; s++){
+        bits += ssss_count[0][s] * (code_size(dc_inv, s) + s);
+    }
+
+    /*
+     * AC coefficients, assuming positions are independent: the zero run in
+     * front of position i ends at k with probability nonzero[k] times the
+     * probability of zeros in between
+     */
+    int zrl = code_size(ac_inv, 0xF0);
+    for(int i=1; i<64; i++){
+        if(nonzero[i] <= 0){
+            continue;
+        }
+
+        for(int s=1; s<16; s++){
+            if(ssss_count[i][s] == 0){
+                continue;
+            }
+
+            double expected = 0;
+            double zeros = 1;
+            for(int k=i-1; k>=0 && zeros > 1e-6; k--){
+                double w = (k == 0 ? 1. : nonzero[k]) * zeros;
+                int run = i - k - 1;
+                expected += w * ((run / 16) * zrl + code_size(ac_inv, ((run % 16) << 4) + s));
+                zeros *= 1. - nonzero[k];
+            }
+
+            bits += ssss_count[i][s] * (expected + s);
+        }
+    }
+
+    // EOB unless the last coefficient is set
+    bits += n_blocks * (1. - nonzero[63]) * code_size(ac_inv, 0x00);
+
+    return bits;
+}
+
+static double estimate_scan_bytes(struct jpeg_prediction* prediction, float factor){
+    struct jpeg* jpeg = prediction->jpeg;
+
+    double bits = 0;
+    for(int c=0; c<jpeg->n_components; c++){
+        struct jpeg_quantisation_table* table = jpeg->quantisation_tables[jpeg->components[c]->quantisation_id];
+
+        // Same values as jpeg_quantisation_table_init_recompress
+        double max_value = table->double_precision ? 65535. : 255.;
+        float factors[64];
+        for(int i=0; i<64; i++){
+            double value = floor(table->values[i] * factor + .5);
+            factors[i] = ((float)table->values[i]) / (value < 1. ? 1. : (value > max_value ? max_value : value));
+        }
+
+        bits += estimate_component(prediction, c, factors);
+    }
+
+    return bits / 8;
+}
+
+/* Bits of the blocks encoded without requantization, restarts and byte stuffing */
+static double baseline_scan_bits(struct jpeg* jpeg){
+    double bits = 0;
+    int dc[MAX_COMPONENTS] = { 0 };
+    for(int i=0; i<jpeg->n_blocks; i++){
+        struct jpeg_block* block = jpeg->blocks + i;
+        struct jpeg_component* component = jpeg->components[block->component_id - 1];
+        struct huffman_inv* dc_inv = jpeg->dc_huffman_tables[component->dc_huffman_id]->huffman_inv;
+        struct huffman_inv* ac_inv = jpeg->ac_huffman_tables[component->ac_huffman_id]->huffman_inv;
+
+        int diff = block->values[0] - dc[block->component_id - 1];
+        dc[block->component_id - 1] = block->values[0];
+        int ssss = magnitude_ssss(diff < 0 ? -diff : diff);
+        bits += code_size(dc_inv, ssss) + ssss;
+
+        int last = 0;
+        for(int j=1; j<64; j++){
+            int value = block->values[j];
+            if(!value){
+                continue;
+            }
+
+            int zeros = j - last - 1;
+            ssss = magnitude_ssss(value < 0 ? -value : value);
+            bits += (zeros / 16) * code_size(ac_inv, 0xF0) + code_size(ac_inv, ((zeros % 16) << 4) + ssss) + ssss;
+            last = j;
+        }
+        if(last < 63){
+            bits += code_size(ac_inv, 0x00);
+        }
+    }
+
+    return bits;
+}
+
+int jpeg_prediction_init(struct jpeg_prediction* prediction, struct jpeg* jpeg){
+    memset(prediction, 0, sizeof(struct jpeg_prediction));
+    prediction->jpeg = jpeg;
+
+    if(jpeg->progressive){
+        // Decodes and builds the tables the baseline output is written with, which the estimate uses
+        int status = jpeg_progressive_prepare(jpeg);
+        if(status){
+            return status;
+        }
+    }else if(!jpeg->blocks){
+        int status = jpeg_decode_huffman(jpeg);
+        if(status){
+            return status;
+        }
+    }
+
+    int dc[MAX_COMPONENTS] = { 0 };
+    for(int i=0; i<jpeg->n_blocks; i++){
+        struct jpeg_block* block = jpeg->blocks + i;
+        int c = block->component_id - 1;
+
+        prediction->n_blocks[c]++;
+        count_magnitude(prediction, c, 0, block->values[0] - dc[c]);
+        dc[c] = block->values[0];
+
+        for(int j=1; j<64; j++){
+            count_magnitude(prediction, c, j, block->values[j]);
+        }
+    }
+
+    /*
+     * Progressive scans are coded too differently from the baseline output
+     * to calibrate against, so the output at factor one is counted instead
+     */
+    if(jpeg->progressive){
+        double estimate = estimate_scan_bytes(prediction, 1.);
+        prediction->calibration = estimate > 0 ? baseline_scan_bits(jpeg) / 8 / estimate : 1.;
+        return 0;
+    }
+
+    // Source scan up to the first marker other than RSTn, without restart markers
+    struct jpeg_segment* sos = jpeg_find_segment(jpeg, 0xDA, 0);
+    unsigned char* scan_data = sos->data + sos->size;
+    unsigned char* end = jpeg->data + jpeg->size;
+    unsigned char* at = scan_data;
+    while((at = memchr(at, 0xFF, end - at)) && at + 1 < end){
+        if(at[1] != 0x00 && at[1] != 0xFF && (at[1] < 0xD0 || at[1] > 0xD7)){
+            break;
+        }
+        at++;
+    }
+    long scan_size = (at && at + 1 < end ? at : end) - scan_data;
+    if(jpeg->restart_interval){
+        long n_mcus = jpeg->n_blocks / jpeg->loop_count;
+        scan_size -= 2 * ((n_mcus - 1) / jpeg->restart_interval);
+    }
+
+    double estimate = estimate_scan_bytes(prediction, 1.);
+    prediction->calibration = estimate > 0 ? scan_size / estimate : 1.;
+
+    return 0;
+}
+
+long jpeg_predict_size(struct jpeg_prediction* prediction, float factor){
+    double scan_bytes = estimate_scan_bytes(prediction, factor) * prediction->calibration;
+
+    // RSTn and the padding in front of it
+    struct jpeg* jpeg = prediction->jpeg;
+    if(jpeg->output_restart_interval){
+        long n_mcus = jpeg->n_blocks / jpeg->loop_count;
+        scan_bytes += 2.5 * ((n_mcus - 1) / jpeg->output_restart_interval);
+    }
+
+    return jpeg_recompress_header_size(prediction->jpeg) + (long)ceil(scan_bytes) + 2;
+}
+
+float jpeg_predict_factor(struct jpeg_prediction* prediction, long max_bytes, float min_factor, float max_factor){
+    if(jpeg_predict_size(prediction, min_factor) <= max_bytes){
+        return min_factor;
+    }
+
+    if(jpeg_predict_size(prediction, max_factor) > max_bytes){
+        return max_factor;
+    }
+
+    // Sizes shrink with growing factors
+    float low = min_factor;
+    float high = max_factor;
+    for(int i=0; i<24; i++){
+        float mid = (low + high) / 2;
+        if(jpeg_predict_size(prediction, mid) <= max_bytes){
+            high = mid;
+        }else{
+            low = mid;
+        }
+    }
+
+    return high;
+}
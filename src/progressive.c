@@ -0,0 +1,505 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "jpeg.h"
+#include "huffman.h"
+
+/*
+ * Decoding of progressive scans into jpeg->blocks, following ITU T.81 G.1.2
+ *
+ * Scans refine the coefficients of the blocks in turn: DC and AC bands are
+ * sent separately (spectral selection), and their bits from the most
+ * significant ones down (successive approximation). Coefficients stay in
+ * zigzag order, like everywhere else.
+ */
+
+struct progressive_scan {
+    int n_components;
+    struct jpeg_component* components[MAX_COMPONENTS];
+    struct huffman_lookup* dc_lookups[MAX_COMPONENTS];
+    struct huffman_lookup* ac_lookups[MAX_COMPONENTS];
+
+    /* Spectral selection and successive approximation */
+    int start;
+    int end;
+    int high;
+    int low;
+
+    int dc_offset[MAX_COMPONENTS];
+    int eob_run;
+};
+
+static uint16_t uint16_from_uchar(unsigned char* at){
+    return at[1] + 256*at[0];
+}
+
+static int decode_dc_first(struct progressive_scan* scan, int c, struct jpeg_ibitstream* stream, int16_t* values){
+    uint8_t ssss;
+    int status = huffman_lookup_decode(scan->dc_lookups[c], stream, &ssss);
+    if(status){
+        return status;
+    }
+
+    int diff;
+    status = huffman_from_ssss(ssss, stream, &diff);
+    if(status){
+        return status;
+    }
+
+    scan->dc_offset[c] += diff;
+    values[0] = scan->dc_offset[c] * (1 << scan->low);
+    return 0;
+}
+
+static int decode_dc_refine(struct progressive_scan* scan, struct jpeg_ibitstream* stream, int16_t* values){
+    uint32_t bit;
+    int status = jpeg_ibitstream_read_bits(stream, 1, &bit);
+    if(status){
+        return status;
+    }
+
+    if(bit){
+        values[0] |= 1 << scan->low;
+    }
+    return 0;
+}
+
+static int decode_ac_first(struct progressive_scan* scan, int c, struct jpeg_ibitstream* stream, int16_t* values){
+    if(scan->eob_run > 0){
+        scan->eob_run--;
+        return 0;
+    }
+
+    for(int k=scan->start; k<=scan->end; k++){
+        uint8_t rrrrssss;
+        int status = huffman_lookup_decode(scan->ac_lookups[c], stream, &rrrrssss);
+        if(status){
+            return status;
+        }
+
+        int rrrr = rrrrssss >> 4;
+        int ssss = rrrrssss & 0x0F;
+        if(ssss){
+            k += rrrr;
+            if(k > scan->end){
+                return E_INVALID_SCAN;
+            }
+
+            int value;
+            status = huffman_from_ssss(ssss, stream, &value);
+            if(status){
+                return status;
+            }
+            values[k] = value * (1 << scan->low);
+        }else if(rrrr == 15){
+            // 16 zeros
+            k += 15;
+        }else{
+            // This and the next 2^rrrr + bits - 1 blocks end here
+            uint32_t bits;
+            status = jpeg_ibitstream_read_bits(stream, rrrr, &bits);
+            if(status){
+                return status;
+            }
+            scan->eob_run = (1 << rrrr) + bits - 1;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* Adds the next bit to a coefficient that is already nonzero */
+static inline int refine_nonzero(struct jpeg_ibitstream* stream, int16_t* value, int bit_value){
+    uint32_t bit;
+    int status = jpeg_ibitstream_read_bits(stream, 1, &bit);
+    if(status){
+        return status;
+    }
+
+    if(bit && !(*value & bit_value)){
+        *value += *value >= 0 ? bit_value : -bit_value;
+    }
+    return 0;
+}
+
+static int decode_ac_refine(struct progressive_scan* scan, int c, struct jpeg_ibitstream* stream, int16_t* values){
+    int bit_value = 1 << scan->low;
+
+    int k = scan->start;
+    if(scan->eob_run == 0){
+        for(; k<=scan->end; k++){
+            uint8_t rrrrssss;
+            int status = huffman_lookup_decode(scan->ac_lookups[c], stream, &rrrrssss);
+            if(status){
+                return status;
+            }
+
+            int rrrr = rrrrssss >> 4;
+            int ssss = rrrrssss & 0x0F;
+            int value = 0;
+            if(ssss){
+                // Newly nonzero coefficients are always +-1 at this bit
+                if(ssss != 1){
+                    return E_INVALID_SCAN;
+                }
+
+                uint32_t bit;
+                status = jpeg_ibitstream_read_bits(stream, 1, &bit);
+                if(status){
+                    return status;
+                }
+                value = bit ? bit_value : -bit_value;
+            }else if(rrrr != 15){
+                uint32_t bits;
+                status = jpeg_ibitstream_read_bits(stream, rrrr, &bits);
+                if(status){
+                    return status;
+                }
+                scan->eob_run = (1 << rrrr) + bits;
+                break;
+            }
+
+            // Skip rrrr zero coefficients, refining the nonzero ones on the way
+            for(; k<=scan->end; k++){
+                if(values[k]){
+                    status = refine_nonzero(stream, values + k, bit_value);
+                    if(status){
+                        return status;
+                    }
+                }else if(rrrr-- == 0){
+                    break;
+                }
+            }
+
+            if(value){
+                if(k > scan->end){
+                    return E_INVALID_SCAN;
+                }
+                values[k] = value;
+            }
+        }
+    }
+
+    if(scan->eob_run > 0){
+        // Only refinements are left in the band
+        for(; k<=scan->end; k++){
+            if(values[k]){
+                int status = refine_nonzero(stream, values + k, bit_value);
+                if(status){
+                    return status;
+                }
+            }
+        }
+        scan->eob_run--;
+    }
+
+    return 0;
+}
+
+static int decode_block(struct progressive_scan* scan, int c, struct jpeg_ibitstream* stream, int16_t* values){
+    if(scan->start == 0){
+        return scan->high ? decode_dc_refine(scan, stream, values) : decode_dc_first(scan, c, stream, values);
+    }
+
+    return scan->high ? decode_ac_refine(scan, c, stream, values) : decode_ac_first(scan, c, stream, values);
+}
+
+/* Skip padding and the restart marker, which resets the predictors */
+static int restart(struct progressive_scan* scan, struct jpeg_ibitstream* stream){
+    stream->buffer = 0;
+    stream->bits = 0;
+    while(!stream->marker && stream->size_bytes > 0){
+        jpeg_ibitstream_fill(stream);
+        stream->buffer = 0;
+        stream->bits = 0;
+    }
+
+    if(jpeg_ibitstream_underflow(stream) != E_RESTART){
+        return E_SIZE_MISMATCH;
+    }
+
+    for(int i=0; i<MAX_COMPONENTS; i++) scan->dc_offset[i] = 0;
+    scan->eob_run = 0;
+    return 0;
+}
+
+/* First block of component in an MCU */
+static int mcu_offset(struct jpeg* jpeg, struct jpeg_component* component){
+    for(int i=0; i<jpeg->loop_count; i++){
+        if(jpeg->loop[i] == component){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int decode_scan(struct jpeg* jpeg, struct progressive_scan* scan, int restart_interval, struct jpeg_ibitstream* stream){
+    int n_mcus = jpeg->mcu_columns * jpeg->mcu_rows;
+
+    if(scan->n_components > 1){
+        // Interleaved, in the same order as a baseline scan
+        int offsets[MAX_COMPONENTS];
+        for(int c=0; c<scan->n_components; c++){
+            offsets[c] = mcu_offset(jpeg, scan->components[c]);
+        }
+
+        for(int m=0; m<n_mcus; m++){
+            if(restart_interval && m > 0 && m % restart_interval == 0){
+                int status = restart(scan, stream);
+                if(status){
+                    return status;
+                }
+            }
+
+            struct jpeg_block* mcu = jpeg->blocks + m * jpeg->loop_count;
+            for(int c=0; c<scan->n_components; c++){
+                int block_count = scan->components[c]->vertical_sampling * scan->components[c]->horizontal_sampling;
+                for(int j=0; j<block_count; j++){
+                    int status = decode_block(scan, c, stream, mcu[offsets[c] + j].values);
+                    if(status){
+                        return status;
+                    }
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    /*
+     * A single component is scanned in rows of its own blocks, which only
+     * cover the image and not the padding of the MCUs. vertical_sampling is
+     * the first (horizontal) factor of SOF, see jpeg_component_init.
+     */
+    struct jpeg_component* component = scan->components[0];
+    int h = component->vertical_sampling;
+    int v = component->horizontal_sampling;
+    int max_h = 1;
+    int max_v = 1;
+    for(int i=0; i<jpeg->n_components; i++){
+        max_h = jpeg->components[i]->vertical_sampling > max_h ? jpeg->components[i]->vertical_sampling : max_h;
+        max_v = jpeg->components[i]->horizontal_sampling > max_v ? jpeg->components[i]->horizontal_sampling : max_v;
+    }
+
+    int columns = ((jpeg->width * h + max_h - 1) / max_h + 7) / 8;
+    int rows = ((jpeg->height * v + max_v - 1) / max_v + 7) / 8;
+    if(columns > jpeg->mcu_columns * h) columns = jpeg->mcu_columns * h;
+    if(rows > jpeg->mcu_rows * v) rows = jpeg->mcu_rows * v;
+
+    int offset = mcu_offset(jpeg, component);
+    int n = 0;
+    for(int row=0; row<rows; row++){
+        for(int column=0; column<columns; column++){
+            if(restart_interval && n > 0 && n % restart_interval == 0){
+                int status = restart(scan, stream);
+                if(status){
+                    return status;
+                }
+            }
+            n++;
+
+            int m = (row / v) * jpeg->mcu_columns + column / h;
+            struct jpeg_block* block = jpeg->blocks + m * jpeg->loop_count + offset + (row % v) * h + column % h;
+            int status = decode_block(scan, 0, stream, block->values);
+            if(status){
+                return status;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int read_scan_header(struct jpeg* jpeg, struct progressive_scan* scan, unsigned char* at, long size,
+        struct jpeg_huffman_table** dc_tables, struct jpeg_huffman_table** ac_tables){
+    memset(scan, 0, sizeof(struct progressive_scan));
+    if(size < 6){
+        return E_INVALID_SCAN;
+    }
+
+    scan->n_components = at[4];
+    if(scan->n_components < 1 || scan->n_components > jpeg->n_components || size != 8 + 2 * scan->n_components){
+        return E_INVALID_SCAN;
+    }
+
+    for(int c=0; c<scan->n_components; c++){
+        int id = at[5 + 2*c];
+        int dc_id = at[6 + 2*c] >> 4;
+        int ac_id = at[6 + 2*c] & 0x0F;
+        if(id < 1 || id > jpeg->n_components || dc_id >= MAX_TABLES || ac_id >= MAX_TABLES){
+            return E_INVALID_SCAN;
+        }
+
+        scan->components[c] = jpeg->components[id - 1];
+        scan->dc_lookups[c] = dc_tables[dc_id] ? dc_tables[dc_id]->huffman_lookup : 0;
+        scan->ac_lookups[c] = ac_tables[ac_id] ? ac_tables[ac_id]->huffman_lookup : 0;
+    }
+
+    unsigned char* selection = at + 5 + 2 * scan->n_components;
+    scan->start = selection[0];
+    scan->end = selection[1];
+    scan->high = selection[2] >> 4;
+    scan->low = selection[2] & 0x0F;
+
+    // DC and AC are never mixed, AC bands belong to one component
+    if(scan->start == 0 ? scan->end != 0 : (scan->end < scan->start || scan->end > 63 || scan->n_components != 1)){
+        return E_INVALID_SCAN;
+    }
+    if(scan->low > 13){
+        return E_INVALID_SCAN;
+    }
+
+    for(int c=0; c<scan->n_components; c++){
+        int needs_dc = scan->start == 0 && !scan->high;
+        if((needs_dc && !scan->dc_lookups[c]) || (scan->start > 0 && !scan->ac_lookups[c])){
+            return E_INVALID_SCAN;
+        }
+    }
+
+    return 0;
+}
+
+/* Baseline tables the blocks are written with: one for luminance, one for chrominance */
+static void init_output_tables(struct jpeg* jpeg){
+    int n_tables = jpeg->n_components > 1 ? 2 : 1;
+    for(int i=0; i<MAX_TABLES; i++){
+        jpeg->dc_huffman_tables[i] = 0;
+        jpeg->ac_huffman_tables[i] = 0;
+    }
+
+    for(int i=0; i<2*n_tables; i++){
+        struct jpeg_huffman_table* table = jpeg_arena_alloc(&jpeg->arena, sizeof(struct jpeg_huffman_table));
+        memset(table, 0, sizeof(struct jpeg_huffman_table));
+        table->class = i / n_tables;
+        table->id = i % n_tables;
+        table->huffman_inv = jpeg_arena_alloc(&jpeg->arena, sizeof(struct huffman_inv));
+        huffman_inv_init_canonical(table->huffman_inv, table->counts, table->elements);
+
+        if(table->class){
+            jpeg->ac_huffman_tables[table->id] = table;
+        }else{
+            jpeg->dc_huffman_tables[table->id] = table;
+        }
+    }
+    jpeg->n_dc_huffman_tables = n_tables;
+    jpeg->n_ac_huffman_tables = n_tables;
+
+    for(int i=0; i<jpeg->n_components; i++){
+        jpeg->components[i]->dc_huffman_id = i > 0 ? n_tables - 1 : 0;
+        jpeg->components[i]->ac_huffman_id = i > 0 ? n_tables - 1 : 0;
+    }
+}
+
+int jpeg_decode_progressive(struct jpeg* jpeg){
+    jpeg->blocks = malloc(jpeg->n_blocks * sizeof(struct jpeg_block));
+    memset(jpeg->blocks, 0, jpeg->n_blocks * sizeof(struct jpeg_block));
+    for(int i=0; i<jpeg->n_blocks; i++){
+        jpeg->blocks[i].component_id = jpeg->loop[i % jpeg->loop_count]->id;
+    }
+
+    // Tables may be redefined between scans
+    struct jpeg_huffman_table* dc_tables[MAX_TABLES];
+    struct jpeg_huffman_table* ac_tables[MAX_TABLES];
+    memcpy(dc_tables, jpeg->dc_huffman_tables, sizeof(dc_tables));
+    memcpy(ac_tables, jpeg->ac_huffman_tables, sizeof(ac_tables));
+    int restart_interval = jpeg->restart_interval;
+
+    struct jpeg_segment* sos = jpeg_find_segment(jpeg, 0xDA, 0);
+    unsigned char* at = sos->data;
+    unsigned char* end = jpeg->data + jpeg->size;
+
+    int status = 0;
+    while(!status){
+        if(end - at < 2){
+            // Data ends without EOI
+            break;
+        }
+        if(at[0] != 0xFF){
+            status = E_INVALID_SCAN;
+            break;
+        }
+
+        uint8_t marker = at[1];
+        if(marker == 0xFF){
+            // Fill byte
+            at++;
+            continue;
+        }
+        if(marker == 0xD9){
+            break;
+        }
+
+        if(end - at < 4 || end - at < 2 + uint16_from_uchar(at + 2)){
+            status = E_EMPTY;
+            break;
+        }
+        unsigned char* segment = at;
+        long size = 2 + uint16_from_uchar(at + 2);
+        if(size < 4){
+            status = E_INVALID_SCAN;
+            break;
+        }
+        at += size;
+
+        if(marker == 0xC4){
+            // Tables are checked against the end of the segment, which lies within the data
+            unsigned char* table_at = segment + 4;
+            while(table_at < at){
+                if(jpeg_huffman_table_size(table_at, at) < 0 || (*table_at & 0x0F) >= MAX_TABLES){
+                    status = E_INVALID_SCAN;
+                    break;
+                }
+
+                struct jpeg_huffman_table* table = jpeg_arena_alloc(&jpeg->arena, sizeof(struct jpeg_huffman_table));
+                table_at += jpeg_huffman_table_init(table, &jpeg->arena, table_at);
+                if(table->class){
+                    ac_tables[table->id] = table;
+                }else{
+                    dc_tables[table->id] = table;
+                }
+            }
+        }else if(marker == 0xDD){
+            restart_interval = size >= 6 ? uint16_from_uchar(segment + 4) : 0;
+        }else if(marker == 0xDA){
+            struct progressive_scan scan;
+            status = read_scan_header(jpeg, &scan, segment, size, dc_tables, ac_tables);
+            if(status){
+                break;
+            }
+
+            struct jpeg_ibitstream stream;
+            jpeg_ibitstream_init(&stream, at, end - at);
+            status = decode_scan(jpeg, &scan, restart_interval, &stream);
+            if(status){
+                break;
+            }
+
+            // Continue at the marker behind the scan
+            while(!stream.marker && stream.size_bytes > 0){
+                stream.bits = 0;
+                jpeg_ibitstream_fill(&stream);
+            }
+            at = stream.at;
+        }
+    }
+
+    if(status){
+        free(jpeg->blocks);
+        jpeg->blocks = 0;
+        return status;
+    }
+
+    init_output_tables(jpeg);
+    return 0;
+}
+
+int jpeg_progressive_prepare(struct jpeg* jpeg){
+    if(jpeg->blocks && jpeg->dc_huffman_tables[0]->n_optimised){
+        return 0;
+    }
+
+    return jpeg_optimise_huffman(jpeg);
+}
@@ -0,0 +1,75 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include "jpeg.h"
+
+void jpeg_rate_control_init(struct jpeg_rate_control* rate_control, double bitrate, double fps, float min_factor, float max_factor){
+    rate_control->frame_bytes = bitrate / 8. / fps;
+    rate_control->fps = fps;
+    rate_control->min_factor = min_factor;
+    rate_control->max_factor = max_factor;
+
+    rate_control->smoothing = 0.2;
+    rate_control->max_step = 1.5;
+
+    rate_control->prediction = malloc(sizeof(struct jpeg_prediction));
+    rate_control->n_frames = 0;
+    rate_control->factor = min_factor;
+    rate_control->predicted = 0;
+
+    rate_control->correction = 1.;
+    rate_control->debt = 0.;
+}
+
+void jpeg_rate_control_destroy(struct jpeg_rate_control* rate_control){
+    free(rate_control->prediction);
+    rate_control->prediction = 0;
+}
+
+int jpeg_rate_control_prepare(struct jpeg_rate_control* rate_control, struct jpeg* jpeg){
+    int status = jpeg_prediction_init(rate_control->prediction, jpeg);
+    if(status){
+        return status;
+    }
+
+    // Pay back the debt over the next second, but never starve a frame completely
+    double budget = rate_control->frame_bytes - rate_control->debt / rate_control->fps;
+    if(budget < rate_control->frame_bytes / 4){
+        budget = rate_control->frame_bytes / 4;
+    }
+
+    float factor = jpeg_predict_factor(rate_control->prediction, budget / rate_control->correction,
+            rate_control->min_factor, rate_control->max_factor);
+
+    if(rate_control->n_frames > 0){
+        float low = rate_control->factor / rate_control->max_step;
+        float high = rate_control->factor * rate_control->max_step;
+        factor = factor < low ? low : (factor > high ? high : factor);
+    }
+    factor = factor < rate_control->min_factor ? rate_control->min_factor : factor;
+    factor = factor > rate_control->max_factor ? rate_control->max_factor : factor;
+
+    rate_control->factor = factor;
+    rate_control->predicted = jpeg_predict_size(rate_control->prediction, factor);
+
+    for(int i=0; i<jpeg->n_quantisation_tables; i++){
+        jpeg_quantisation_table_init_recompress(jpeg->quantisation_tables[i], factor);
+    }
+
+    return 0;
+}
+
+void jpeg_rate_control_update(struct jpeg_rate_control* rate_control, long bytes){
+    if(rate_control->predicted > 0){
+        double ratio = (double)bytes / rate_control->predicted;
+        rate_control->correction += rate_control->smoothing * (ratio - rate_control->correction);
+    }
+
+    double limit = rate_control->frame_bytes * rate_control->fps;
+    rate_control->debt += bytes - rate_control->frame_bytes;
+    rate_control->debt = rate_control->debt > limit ? limit : (rate_control->debt < -limit ? -limit : rate_control->debt);
+
+    rate_control->n_frames++;
+}
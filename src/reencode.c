@@ -3,57 +3,40 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <math.h>
+#include <string.h>
+#include <stdatomic.h>
 #include "jpeg.h"
 #include "huffman.h"
-
-static inline int from_ssss(uint8_t ssss, struct jpeg_ibitstream* stream, int* value){
-    if(ssss == 0){
-        *value = 0;
-        return 0;
-    }
-
-    int basevalue = 1 << (ssss - 1);
-
-    uint8_t positive; 
-    int status = jpeg_ibitstream_read(stream, &positive);
-    if(status){
-        return status;
-    }
-
-    if(!positive){
-        basevalue = 1 - 2*basevalue;
-    }
-
-    int additional = 0;
-    for(int i=0; i<ssss - 1; i++){
-        uint8_t next_bit;
-        int status = jpeg_ibitstream_read(stream, &next_bit);
-        if(status){
-            return status;
-        }
-        additional = (additional << 1) + next_bit;
-    }
-
-    *value = basevalue + additional;
-    return 0;
-}
-
-static inline int read_dc_value(struct jpeg_ibitstream* stream, struct huffman_tree* tree, int* value){
+#include "parallel.h"
+#include "requantize.h"
+#include "trace.h"
+
+static inline int read_dc_value(struct jpeg_ibitstream* stream, struct huffman_lookup* lookup, int* value,
+        struct jpeg_stats* stats){
+#ifdef JPEG_STATS
+    long position = jpeg_ibitstream_position(stream);
+#endif
     uint8_t ssss;
-    int status = huffman_tree_decode(tree, stream, &ssss);
+    int status = huffman_lookup_decode(lookup, stream, &ssss);
     if(status){
         return status;
     }
+    JPEG_STATS_ADD(stats, symbols[jpeg_ibitstream_position(stream) - position], 1);
 
-    return from_ssss(ssss, stream, value);
+    return huffman_from_ssss(ssss, stream, value);
 }
 
-static inline int read_ac_value(struct jpeg_ibitstream* stream, struct huffman_tree* tree, int* value, uint8_t* leading_zeros){
+static inline int read_ac_value(struct jpeg_ibitstream* stream, struct huffman_lookup* lookup, int* value, uint8_t* leading_zeros,
+        struct jpeg_stats* stats){
+#ifdef JPEG_STATS
+    long position = jpeg_ibitstream_position(stream);
+#endif
     uint8_t rrrrssss;
-    int status = huffman_tree_decode(tree, stream, &rrrrssss);
+    int status = huffman_lookup_decode(lookup, stream, &rrrrssss);
     if(status){
         return status;
     }
+    JPEG_STATS_ADD(stats, symbols[jpeg_ibitstream_position(stream) - position], 1);
 
     uint8_t rrrr = (rrrrssss & 0xF0) / 16;
     uint8_t ssss = rrrrssss & 0x0F;
@@ -62,80 +45,77 @@ static inline int read_ac_value(struct jpeg_ibitstream* stream, struct huffman_t
         // Terminate
         *leading_zeros = 64;
         *value = 0;
+        JPEG_STATS_ADD(stats, eob_read, 1);
 
         return 0;
     }else if(rrrr == 15 && ssss == 0){
         // 16 zeros
         *leading_zeros = 15;
         *value = 0;
+        JPEG_STATS_ADD(stats, zrl_read, 1);
 
         return 0;
     }else{
         // rrrr zeros followed by value specified through ssss
         *leading_zeros = rrrr;
 
-        return from_ssss(ssss, stream, value);
+        return huffman_from_ssss(ssss, stream, value);
     }
 }
 
-static inline int write_rrrrssss(struct jpeg_obitstream* stream, struct huffman_inv* huffman_inv, int value, uint8_t rrrr){
-    int ssss;
-
-    if(value == 0){
-        ssss = 0;
-    }else if(value > 0){
-        ssss = 12;
-        while((value & ~(1 << ssss)) == value) ssss--;
-        ssss++;
-    }else{
-        value *= -1;
-        ssss = 12;
-        while((value & ~(1 << ssss)) == value) ssss--;
-        ssss++;
-        value *= -1;
-    }
-
-    int status = huffman_inv_encode(huffman_inv, stream, (rrrr << 4) + ssss);
-    if(status){
-        return status;
-    }
-
-    if(ssss > 0){
-        status = jpeg_obitstream_write(stream, value > 0);
+/* Read past the AC coefficients from position i to the end of the block, their magnitude bits are skipped */
+static inline int skip_ac_values(struct jpeg_ibitstream* stream, struct huffman_lookup* lookup, int i,
+        struct jpeg_stats* stats){
+    for(; i<64; i++){
+#ifdef JPEG_STATS
+        long position = jpeg_ibitstream_position(stream);
+#endif
+        uint8_t rrrrssss;
+        int status = huffman_lookup_decode(lookup, stream, &rrrrssss);
         if(status){
             return status;
         }
-    }
-
-    int basevalue = 1 << (ssss - 1);
-    if(value < 0){
-        basevalue = 1 - 2*basevalue;
-    }
-    int additional = value - basevalue;
+        JPEG_STATS_ADD(stats, symbols[jpeg_ibitstream_position(stream) - position], 1);
+
+        if(rrrrssss == 0x00){
+            JPEG_STATS_ADD(stats, eob_read, 1);
+            return 0;
+        }else if(rrrrssss == 0xF0){
+            JPEG_STATS_ADD(stats, zrl_read, 1);
+            i += 15;
+            continue;
+        }
 
-    for(int i=(8 - ssss + 1); i<8; i++){
-        int status = jpeg_obitstream_write(stream, (additional >> (7 - i)) & 1);
+        uint32_t bits;
+        status = jpeg_ibitstream_read_bits(stream, rrrrssss & 0x0F, &bits);
         if(status){
             return status;
         }
+        JPEG_STATS_ADD(stats, zeroed, 1);
+
+        i += (rrrrssss & 0xF0) / 16;
     }
 
     return 0;
 }
 
-static inline int reencode_block(
+/*
+ * Decode a block, with the absolute DC value. Coefficients from position tail
+ * on are skipped and left zero.
+ */
+static inline int decode_block(
         struct jpeg_ibitstream* istream,
-        struct jpeg_obitstream* ostream,
+        int16_t* result,
         int* dec_dc_offset,
-        int* enc_dc_offset,
-        struct huffman_tree* dc_tree,
-        struct huffman_tree* ac_tree,
-        struct huffman_inv* dc_inv,
-        struct huffman_inv* ac_inv,
-        struct jpeg_quantisation_table* quantisation){
+        struct huffman_lookup* dc_lookup,
+        struct huffman_lookup* ac_lookup,
+        int tail,
+        struct jpeg_stats* stats){
+
+    memset(result, 0, 64 * sizeof(int16_t));
 
     int value = 0;
-    int status = read_dc_value(istream, dc_tree, &value);
+    int status = read_dc_value(istream, dc_lookup, &value, stats);
     int value_abs = value + (*dec_dc_offset);
     *dec_dc_offset = value_abs;
 
@@ -143,65 +123,238 @@ static inline int reencode_block(
         return status;
     }
 
-    value_abs = round(value_abs * quantisation->recompress_factors[0]);
-    status = write_rrrrssss(ostream, dc_inv, value_abs - (*enc_dc_offset), 0);
-    *enc_dc_offset = value_abs;
-
-    if(status){
-        return status;
-    }
+    result[0] = value_abs;
 
-    int enc_leading_zeros = 0;
     for(int i=1; i<64; i++){
+        if(i >= tail){
+            return skip_ac_values(istream, ac_lookup, i, stats);
+        }
+
         uint8_t leading_zeros;
         int value;
-        status = read_ac_value(istream, ac_tree, &value, &leading_zeros);
+        status = read_ac_value(istream, ac_lookup, &value, &leading_zeros, stats);
         if(status){
             return status;
         }
 
         i += leading_zeros;
-        enc_leading_zeros += leading_zeros;
         if(i >= 64){
             break;
         }
 
-        value = round(value * quantisation->recompress_factors[i]);
-        if(value == 0){
-            enc_leading_zeros++;
-        }else{
-            while(enc_leading_zeros > 16){
-                status = huffman_inv_encode(ac_inv, ostream, 0xF0);
-                if(status){
-                    return status;
-                }
-                enc_leading_zeros -= 16;
-            }
+        if(i >= tail){
+            // The run ended beyond the tail
+            JPEG_STATS_ADD(stats, zeroed, value != 0);
+            return skip_ac_values(istream, ac_lookup, i + 1, stats);
+        }
+
+        result[i] = value;
+    }
+
+    return 0;
+}
+
+/*
+ * Encode a block that is already requantized, mask has bit i set if data[i]
+ * is nonzero. Zero runs are found by bit scans.
+ */
+static inline int write_block(
+        struct jpeg_obitstream* ostream,
+        int16_t* data,
+        uint64_t mask,
+        int* enc_dc_offset,
+        struct huffman_inv* dc_inv,
+        struct huffman_inv* ac_inv,
+        struct jpeg_stats* stats){
+
+    int status = huffman_inv_encode_value(dc_inv, ostream, data[0] - (*enc_dc_offset), 0);
+    *enc_dc_offset = data[0];
 
-            status = write_rrrrssss(ostream, ac_inv, value, enc_leading_zeros);
+    if(status){
+        return status;
+    }
+
+    int last = 0;
+    for(uint64_t ac = mask & ~1ULL; ac; ac &= ac - 1){
+        int i = jpeg_mask_first(ac);
+        int zeros = i - last - 1;
+        while(zeros > 15){
+            status = huffman_inv_encode(ac_inv, ostream, 0xF0);
             if(status){
                 return status;
             }
-            enc_leading_zeros = 0;
+            zeros -= 16;
+            JPEG_STATS_ADD(stats, zrl_written, 1);
         }
+
+        status = huffman_inv_encode_value(ac_inv, ostream, data[i], zeros);
+        if(status){
+            return status;
+        }
+        last = i;
     }
 
-    if(enc_leading_zeros > 0){
+    if(last < 63){
         // Terminate
         status = huffman_inv_encode(ac_inv, ostream, 0);
         if(status){
             return status;
         }
-
+        JPEG_STATS_ADD(stats, eob_written, 1);
     }
 
     return 0;
 }
 
+static inline int reencode_block(
+        struct jpeg_ibitstream* istream,
+        struct jpeg_obitstream* ostream,
+        int* dec_dc_offset,
+        int* enc_dc_offset,
+        struct huffman_lookup* dc_lookup,
+        struct huffman_lookup* ac_lookup,
+        struct huffman_inv* dc_inv,
+        struct huffman_inv* ac_inv,
+        struct jpeg_quantisation_table* quantisation,
+        struct jpeg_stats* stats,
+        int component_index){
+
+#ifdef JPEG_STATS
+    double start = stats ? jpeg_stats_time() : 0;
+    long position = jpeg_ibitstream_position(istream);
+#endif
 
+    int16_t values[64];
+    int status = decode_block(istream, values, dec_dc_offset, dc_lookup, ac_lookup, quantisation->recompress_tail, stats);
+    if(status){
+        return status;
+    }
+
+#ifdef JPEG_STATS
+    unsigned char* output_at = ostream->at;
+    int output_bits = ostream->bits;
+    int nonzero = 0;
+    if(stats){
+        double decoded = jpeg_stats_time();
+        stats->seconds_decode += decoded - start;
+        start = decoded;
+
+        stats->component_bits_read[component_index] += jpeg_ibitstream_position(istream) - position;
+        for(int i=0; i<64; i++){
+            nonzero += values[i] != 0;
+        }
+    }
+#else
+    (void)component_index;
+#endif
+
+    uint64_t mask = jpeg_requantize_block(values, values, quantisation->recompress_integers, quantisation->recompress_fractions,
+            quantisation->recompress_thresholds);
+    status = write_block(ostream, values, mask, enc_dc_offset, dc_inv, ac_inv, stats);
+
+#ifdef JPEG_STATS
+    if(stats && !status){
+        for(uint64_t m = mask; m; m &= m - 1){
+            nonzero--;
+        }
+        stats->zeroed += nonzero;
+        stats->component_bits_written[component_index] += jpeg_stats_written_bits(ostream, output_at, output_bits);
+        stats->seconds_encode += jpeg_stats_time() - start;
+    }
+#endif
+
+    return status;
+}
 
 
+/*
+ * Reencode the next block of the scan, continuing after a restart marker in
+ * front of it. On failure the streams and predictors are left as they were.
+ */
+static int reencode_scan_block(
+        struct jpeg* jpeg,
+        struct jpeg_component* component,
+        struct jpeg_ibitstream* istream,
+        struct jpeg_obitstream* ostream,
+        int* dec_dc_offset,
+        int* enc_dc_offset){
+
+    struct jpeg_huffman_table* dc_table = jpeg->dc_huffman_tables[component->dc_huffman_id];
+    struct jpeg_huffman_table* ac_table = jpeg->ac_huffman_tables[component->ac_huffman_id];
+
+    for(;;){
+        struct jpeg_ibitstream istream_stored = *istream;
+        struct jpeg_obitstream ostream_stored = *ostream;
+        int dec_dc_stored = dec_dc_offset[component->id - 1];
+        int enc_dc_stored = enc_dc_offset[component->id - 1];
+#ifdef JPEG_STATS
+        struct jpeg_stats stats_stored;
+        if(jpeg->stats){
+            stats_stored = *jpeg->stats;
+        }
+#endif
+
+        int status = reencode_block(istream, ostream,
+                dec_dc_offset + component->id - 1,
+                enc_dc_offset + component->id - 1,
+                dc_table->huffman_lookup,
+                ac_table->huffman_lookup,
+                dc_table->huffman_inv,
+                ac_table->huffman_inv,
+                jpeg->quantisation_tables[component->quantisation_id],
+                jpeg->stats,
+                component->id - 1);
+
+#ifdef JPEG_STATS
+        if(status && jpeg->stats){
+            *jpeg->stats = stats_stored;
+        }
+#endif
+
+        if(status == E_RESTART){
+            // Padding in front of the marker may have been decoded, the scan continues after it
+            for(int i=0; i<MAX_COMPONENTS; i++) dec_dc_offset[i] = 0;
+            *ostream = ostream_stored;
+            enc_dc_offset[component->id - 1] = enc_dc_stored;
+            continue;
+        }
+
+        if(status){
+            *istream = istream_stored;
+            *ostream = ostream_stored;
+            dec_dc_offset[component->id - 1] = dec_dc_stored;
+            enc_dc_offset[component->id - 1] = enc_dc_stored;
+        }
+
+        return status;
+    }
+}
+
+long jpeg_reencode_max_size(struct jpeg* jpeg){
+    // Baseline output of progressive input and factors below one grow the scan, tables may be rewritten with all codes
+    long size = 2 * jpeg->size + MAX_TABLES * (2 * (4 + 17 + 256) + 4 + 129);
+
+    // DRI, and per interval a marker with padding in front and DC values coded from zero after it
+    if(jpeg->output_restart_interval){
+        long n_mcus = jpeg->n_blocks / jpeg->loop_count;
+        size += 6 + (4 + 4 * jpeg->loop_count) * (n_mcus / jpeg->output_restart_interval + 1);
+    }
+
+    return size;
+}
+
 long jpeg_reencode_huffman(struct jpeg* jpeg, unsigned char* buffer, long buffer_size){
+    if(jpeg->progressive){
+        int status = jpeg_progressive_prepare(jpeg);
+        if(status){
+            return status;
+        }
+    }
+
+    if(jpeg->blocks){
+        return jpeg_encode_huffman(jpeg, buffer, buffer_size);
+    }
+
     struct jpeg_segment* sos = jpeg_find_segment(jpeg, 0xDA, 0);
     unsigned char* scan_data = sos->data + sos->size;
     long scan_size = jpeg->size - (scan_data - jpeg->data);
@@ -212,84 +365,618 @@ long jpeg_reencode_huffman(struct jpeg* jpeg, unsigned char* buffer, long buffer
     struct jpeg_obitstream ostream;
     jpeg_obitstream_init(&ostream, buffer, buffer_size);
 
-    int loop_count = 0;
-    for(int i=0; i<jpeg->n_components; i++){
-        loop_count += jpeg->components[i]->vertical_sampling * jpeg->components[i]->horizontal_sampling;
-    }
-
-    struct jpeg_component** loop = malloc(loop_count * sizeof(struct jpeg_component*));
-    int k = 0;
-    for(int i=0; i<jpeg->n_components; i++){
-        int block_count = jpeg->components[i]->vertical_sampling * jpeg->components[i]->horizontal_sampling;
-        for(int j=0; j<block_count; j++){
-            loop[k++] = jpeg->components[i];
-        }
-    }
-
     int enc_dc_offset[MAX_COMPONENTS] = { 0 };
     int dec_dc_offset[MAX_COMPONENTS] = { 0 };
+    int interval_blocks = jpeg->output_restart_interval * jpeg->loop_count;
+
+#ifdef JPEG_TRACE
+    // One span per MCU row
+    int row_blocks = jpeg->mcu_columns * jpeg->loop_count;
+    int row_end = row_blocks;
+#endif
+    JPEG_TRACE_BEGIN(row_span);
 
     int component = 0;
     for(int i=0; i<jpeg->n_blocks; i++){
-        int dc_id = loop[component]->dc_huffman_id;
-        int ac_id = loop[component]->ac_huffman_id;
-        int quant_id = loop[component]->quantisation_id;
-
-        int done = 0;
-        int status = 0;
-
-        int ostream_at_bit_stored = ostream.at_bit;
-        unsigned char* ostream_at_stored = ostream.at;
-        while(!done){
-            status = reencode_block(&istream, &ostream, 
-                    dec_dc_offset + loop[component]->id - 1,
-                    enc_dc_offset + loop[component]->id - 1,
-                    jpeg->dc_huffman_tables[dc_id]->huffman_tree,
-                    jpeg->ac_huffman_tables[ac_id]->huffman_tree,
-                    jpeg->dc_huffman_tables[dc_id]->huffman_inv,
-                    jpeg->ac_huffman_tables[ac_id]->huffman_inv,
-                    jpeg->quantisation_tables[quant_id]);
-
-            if(status == E_RESTART){
-                for(int i=0; i<MAX_COMPONENTS; i++) dec_dc_offset[i] = 0;
-                ostream.at_bit = ostream_at_bit_stored;
-                ostream.at = ostream_at_stored;
-            }else{
-                done = 1;
+        if(interval_blocks && i > 0 && i % interval_blocks == 0){
+            int status = jpeg_obitstream_write_marker(&ostream, 0xD0 + (i / interval_blocks - 1) % 8);
+            if(status){
+                return status;
             }
+            for(int j=0; j<MAX_COMPONENTS; j++) enc_dc_offset[j] = 0;
         }
 
+        int status = reencode_scan_block(jpeg, jpeg->loop[component], &istream, &ostream, dec_dc_offset, enc_dc_offset);
         if(status){
-            free(loop);
             return status;
         }
 
-        component = (component + 1) % loop_count;
+        component = (component + 1) % jpeg->loop_count;
+
+#ifdef JPEG_TRACE
+        if(i + 1 == row_end){
+            JPEG_TRACE_END(row_span, "reencode row", i / row_blocks);
+            row_span = jpeg_trace_begin();
+            row_end += row_blocks;
+        }
+#endif
     }
 
-    free(loop);
+    // Assert we hit EOS
+    if(!jpeg_ibitstream_at_end(&istream)){
+        return E_SIZE_MISMATCH;
+    }
 
-    // Move to byte boundary
-    if(istream.size_bytes > 0){
-        uint8_t dummy;
-        while(istream.at_bit != 0) jpeg_ibitstream_read(&istream, &dummy);
+    // Pad byte with ones
+    int status = jpeg_obitstream_flush(&ostream);
+    if(status){
+        return status;
     }
 
-    // Assert we hit EOS
-    if(istream.size_bytes != 0){
+#ifdef JPEG_STATS
+    if(jpeg->stats){
+        // Whole scan without EOI, the padding before each marker is included in the bit counts
+        struct jpeg_stats* stats = jpeg->stats;
+        stats->bits_read += jpeg_ibitstream_position(&istream);
+        stats->bits_written += jpeg_stats_written_bits(&ostream, buffer, 0);
+        jpeg_stats_count_markers(scan_data, scan_size - 2, &stats->stuffed_read, &stats->restarts_read);
+        jpeg_stats_count_markers(buffer, ostream.at - buffer, &stats->stuffed_written, &stats->restarts_written);
+    }
+#endif
+
+    // Write EOS
+    unsigned char* out = ostream.at;
+    if(out - buffer > buffer_size - 2){
+        return E_FULL;
+    }
+    *(out++) = 0xFF;
+    *(out++) = 0xD9;
+
+    return out - buffer;
+}
+
+struct jpeg_restart_interval {
+    /* Entropy-coded data up to the restart marker */
+    unsigned char* data;
+    long size;
+    int n_mcus;
+
+    /* Requantized first MCU, encoded while stitching once the DC predictors are known */
+    int16_t first_mcu[MAX_MCU_BLOCKS][64];
+    uint64_t first_mcu_mask[MAX_MCU_BLOCKS];
+
+    /* Everything after the first MCU */
+    unsigned char* buffer;
+    struct jpeg_obitstream ostream;
+
+    /* Encoder DC predictors at the end of the interval */
+    int enc_dc_offset[MAX_COMPONENTS];
+
+    int status;
+
+#ifdef JPEG_STATS
+    /* Added to jpeg->stats once all intervals are stitched */
+    struct jpeg_stats stats;
+#endif
+};
+
+struct jpeg_reencode_parallel {
+    struct jpeg* jpeg;
+    struct jpeg_component** loop;
+    int loop_count;
+
+    int n_intervals;
+    struct jpeg_restart_interval* intervals;
+    atomic_int next_interval;
+};
+
+static int reencode_interval(struct jpeg_reencode_parallel* parallel, struct jpeg_restart_interval* interval){
+    struct jpeg* jpeg = parallel->jpeg;
+
+    struct jpeg_ibitstream istream;
+    jpeg_ibitstream_init(&istream, interval->data, interval->size);
+
+    int dec_dc_offset[MAX_COMPONENTS] = { 0 };
+    for(int i=0; i<MAX_COMPONENTS; i++) interval->enc_dc_offset[i] = 0;
+
+    struct jpeg_stats* stats = 0;
+#ifdef JPEG_STATS
+    if(jpeg->stats){
+        stats = &interval->stats;
+        jpeg_stats_init(stats);
+    }
+#endif
+
+    for(int i=0; i<interval->n_mcus * parallel->loop_count; i++){
+        struct jpeg_component* component = parallel->loop[i % parallel->loop_count];
+        struct jpeg_huffman_table* dc_table = jpeg->dc_huffman_tables[component->dc_huffman_id];
+        struct jpeg_huffman_table* ac_table = jpeg->ac_huffman_tables[component->ac_huffman_id];
+        struct jpeg_quantisation_table* quantisation = jpeg->quantisation_tables[component->quantisation_id];
+
+        int status;
+        if(i < parallel->loop_count){
+#ifdef JPEG_STATS
+            long position = jpeg_ibitstream_position(&istream);
+#endif
+            status = decode_block(&istream, interval->first_mcu[i],
+                    dec_dc_offset + component->id - 1,
+                    dc_table->huffman_lookup, ac_table->huffman_lookup, quantisation->recompress_tail, stats);
+            JPEG_STATS_ADD(stats, component_bits_read[component->id - 1], jpeg_ibitstream_position(&istream) - position);
+            interval->first_mcu_mask[i] = jpeg_requantize_block(interval->first_mcu[i], interval->first_mcu[i],
+                    quantisation->recompress_integers, quantisation->recompress_fractions, quantisation->recompress_thresholds);
+            interval->enc_dc_offset[component->id - 1] = interval->first_mcu[i][0];
+        }else{
+            status = reencode_block(&istream, &interval->ostream,
+                    dec_dc_offset + component->id - 1,
+                    interval->enc_dc_offset + component->id - 1,
+                    dc_table->huffman_lookup, ac_table->huffman_lookup,
+                    dc_table->huffman_inv, ac_table->huffman_inv,
+                    quantisation, stats, component->id - 1);
+        }
+
+        if(status){
+            return status;
+        }
+    }
+
+    if(!jpeg_ibitstream_at_end(&istream)){
         return E_SIZE_MISMATCH;
     }
 
+    JPEG_STATS_ADD(stats, bits_read, jpeg_ibitstream_position(&istream));
+    return 0;
+}
+
+static void* reencode_parallel_worker(void* arg){
+    struct jpeg_reencode_parallel* parallel = arg;
+
+    int i;
+    while((i = atomic_fetch_add(&parallel->next_interval, 1)) < parallel->n_intervals){
+        JPEG_TRACE_BEGIN(span);
+        parallel->intervals[i].status = reencode_interval(parallel, parallel->intervals + i);
+        JPEG_TRACE_END(span, "reencode interval", i);
+    }
+
+    return 0;
+}
+
+/* Split the scan at its restart markers, returns the number of intervals found */
+static int find_restart_intervals(unsigned char* scan_data, long scan_size, struct jpeg_restart_interval* intervals, int max_intervals){
+    int n = 0;
+    unsigned char* start = scan_data;
+    unsigned char* end = scan_data + scan_size;
+    unsigned char* at = scan_data;
+
+    while(n < max_intervals){
+        at = memchr(at, 0xFF, end - at);
+        if(!at || at + 1 >= end){
+            at = end;
+        }else if(at[1] == 0x00 || at[1] == 0xFF){
+            at++;
+            continue;
+        }
+
+        intervals[n].data = start;
+        intervals[n].size = at - start;
+        n++;
+
+        if(at == end || at[1] < 0xD0 || at[1] > 0xD7){
+            break;
+        }
+
+        at += 2;
+        start = at;
+    }
+
+    return n;
+}
+
+long jpeg_reencode_huffman_parallel(struct jpeg* jpeg, unsigned char* buffer, long buffer_size, int n_threads){
+    n_threads = jpeg_parallel_threads(n_threads);
+
+    if(jpeg->progressive){
+        int status = jpeg_progressive_prepare(jpeg);
+        if(status){
+            return status;
+        }
+    }
+
+    if(jpeg->blocks){
+        return jpeg_encode_huffman_parallel(jpeg, buffer, buffer_size, n_threads);
+    }
+
+    int loop_count = jpeg->loop_count;
+    if(n_threads <= 1 || loop_count > MAX_MCU_BLOCKS){
+        return jpeg_reencode_huffman(jpeg, buffer, buffer_size);
+    }
+
+    if(jpeg->restart_interval == 0){
+        // Speculative decoding into coefficients, which are then encoded in ranges
+        int status = jpeg_decode_huffman_parallel(jpeg, n_threads);
+        if(status){
+            return status;
+        }
+
+        long result = jpeg_encode_huffman_parallel(jpeg, buffer, buffer_size, n_threads);
+        free(jpeg->blocks);
+        jpeg->blocks = 0;
+        return result;
+    }
+
+    // Output intervals that differ from the input ones are encoded from coefficients
+    int same_intervals = jpeg->output_restart_interval == jpeg->restart_interval;
+    if(jpeg->output_restart_interval && !same_intervals){
+        int status = jpeg_decode_huffman(jpeg);
+        if(status){
+            return status;
+        }
+
+        long result = jpeg_encode_huffman_parallel(jpeg, buffer, buffer_size, n_threads);
+        free(jpeg->blocks);
+        jpeg->blocks = 0;
+        return result;
+    }
+
+    int n_mcus = jpeg->n_blocks / loop_count;
+    int n_intervals = (n_mcus + jpeg->restart_interval - 1) / jpeg->restart_interval;
+
+    struct jpeg_segment* sos = jpeg_find_segment(jpeg, 0xDA, 0);
+    unsigned char* scan_data = sos->data + sos->size;
+    long scan_size = jpeg->size - (scan_data - jpeg->data);
+
+    struct jpeg_reencode_parallel parallel;
+    parallel.jpeg = jpeg;
+    parallel.loop_count = loop_count;
+    parallel.n_intervals = n_intervals;
+    parallel.intervals = malloc(n_intervals * sizeof(struct jpeg_restart_interval));
+    atomic_init(&parallel.next_interval, 0);
+    if(!parallel.intervals){
+        return jpeg_reencode_huffman(jpeg, buffer, buffer_size);
+    }
+
+    if(find_restart_intervals(scan_data, scan_size, parallel.intervals, n_intervals) != n_intervals){
+        // Markers do not match the restart interval
+        free(parallel.intervals);
+        return jpeg_reencode_huffman(jpeg, buffer, buffer_size);
+    }
+
+    parallel.loop = jpeg->loop;
+
+    // Per-interval output, twice the input leaves room for factors below one
+    long scratch_size = 0;
+    for(int i=0; i<n_intervals; i++){
+        scratch_size += 2 * parallel.intervals[i].size + 64;
+    }
+    unsigned char* scratch = malloc(scratch_size);
+    if(!scratch){
+        free(parallel.intervals);
+        return jpeg_reencode_huffman(jpeg, buffer, buffer_size);
+    }
+
+    unsigned char* at = scratch;
+    for(int i=0; i<n_intervals; i++){
+        struct jpeg_restart_interval* interval = parallel.intervals + i;
+        interval->n_mcus = i < n_intervals - 1 ? jpeg->restart_interval : n_mcus - i * jpeg->restart_interval;
+        interval->buffer = at;
+        jpeg_obitstream_init(&interval->ostream, at, 2 * interval->size + 64);
+        at += 2 * interval->size + 64;
+    }
+
+    if(n_threads > n_intervals){
+        n_threads = n_intervals;
+    }
+
+    jpeg_parallel_run(n_threads, reencode_parallel_worker, &parallel);
+
+    // An interval which did not fit its share is reencoded again in one piece, the scan is left as it was
+    for(int i=0; i<n_intervals; i++){
+        if(parallel.intervals[i].status == E_FULL){
+            free(scratch);
+            free(parallel.intervals);
+            return jpeg_reencode_huffman(jpeg, buffer, buffer_size);
+        }
+    }
+
+    /*
+     * Stitch: first MCU with the predictors of the previous interval, then
+     * the rest as is. If the output keeps the intervals, they are separated
+     * by markers instead and start from zero.
+     */
+    struct jpeg_obitstream ostream;
+    jpeg_obitstream_init(&ostream, buffer, buffer_size);
+
+    int enc_dc_offset[MAX_COMPONENTS] = { 0 };
+
+    int status = 0;
+    for(int i=0; i<n_intervals && !status; i++){
+        struct jpeg_restart_interval* interval = parallel.intervals + i;
+        status = interval->status;
+
+        if(!status && i > 0 && same_intervals){
+            status = jpeg_obitstream_write_marker(&ostream, 0xD0 + (i - 1) % 8);
+            for(int j=0; j<MAX_COMPONENTS; j++) enc_dc_offset[j] = 0;
+        }
+
+        // Counted with the interval, which is only added to jpeg->stats if all of them are written
+        struct jpeg_stats* stats = 0;
+#ifdef JPEG_STATS
+        if(jpeg->stats){
+            stats = &interval->stats;
+        }
+#endif
+
+        for(int j=0; j<loop_count && !status; j++){
+            struct jpeg_component* component = parallel.loop[j];
+#ifdef JPEG_STATS
+            unsigned char* output_at = ostream.at;
+            int output_bits = ostream.bits;
+#endif
+            status = write_block(&ostream, interval->first_mcu[j], interval->first_mcu_mask[j],
+                    enc_dc_offset + component->id - 1,
+                    jpeg->dc_huffman_tables[component->dc_huffman_id]->huffman_inv,
+                    jpeg->ac_huffman_tables[component->ac_huffman_id]->huffman_inv, stats);
+            JPEG_STATS_ADD(stats, component_bits_written[component->id - 1], jpeg_stats_written_bits(&ostream, output_at, output_bits));
+        }
+
+        if(!status){
+            status = jpeg_obitstream_append(&ostream, &interval->ostream, interval->buffer);
+        }
+
+        for(int j=0; j<MAX_COMPONENTS; j++) enc_dc_offset[j] = interval->enc_dc_offset[j];
+    }
+
+#ifdef JPEG_STATS
+    if(jpeg->stats && !status){
+        for(int i=0; i<n_intervals; i++){
+            jpeg_stats_add(jpeg->stats, &parallel.intervals[i].stats);
+        }
+    }
+#endif
+
+    free(scratch);
+    free(parallel.intervals);
+
+    if(status){
+        return status;
+    }
+
     // Pad byte with ones
-    if(ostream.size_bytes > 0){
-        while(ostream.at_bit != 0) jpeg_obitstream_write(&ostream, 1);
+    status = jpeg_obitstream_flush(&ostream);
+    if(status){
+        return status;
+    }
+
+#ifdef JPEG_STATS
+    if(jpeg->stats){
+        // Bits read were added per interval
+        struct jpeg_stats* stats = jpeg->stats;
+        stats->bits_written += jpeg_stats_written_bits(&ostream, buffer, 0);
+        jpeg_stats_count_markers(scan_data, scan_size - 2, &stats->stuffed_read, &stats->restarts_read);
+        jpeg_stats_count_markers(buffer, ostream.at - buffer, &stats->stuffed_written, &stats->restarts_written);
     }
+#endif
 
     // Write EOS
     unsigned char* out = ostream.at;
-    assert(out - buffer <= buffer_size - 2);
+    if(out - buffer > buffer_size - 2){
+        return E_FULL;
+    }
     *(out++) = 0xFF;
     *(out++) = 0xD9;
 
     return out - buffer;
 }
+
+/* Output collected before it is passed to the callback */
+#define STREAM_OUTPUT_SIZE 65536
+
+void jpeg_reencode_stream_init(struct jpeg_reencode_stream* stream, struct jpeg_requantization* requantization,
+        jpeg_reencode_output output, void* user){
+    stream->requantization = *requantization;
+    stream->output = output;
+    stream->user = user;
+
+    stream->input = 0;
+    stream->input_size = 0;
+    stream->input_capacity = 0;
+
+    stream->header = 0;
+    stream->has_header = 0;
+
+    stream->n_blocks_done = 0;
+    stream->done = 0;
+    for(int i=0; i<MAX_COMPONENTS; i++){
+        stream->dec_dc_offset[i] = 0;
+        stream->enc_dc_offset[i] = 0;
+    }
+
+    stream->output_buffer = malloc(STREAM_OUTPUT_SIZE);
+    stream->output_buffer_size = STREAM_OUTPUT_SIZE;
+    jpeg_obitstream_init(&stream->ostream, stream->output_buffer, stream->output_buffer_size);
+}
+
+void jpeg_reencode_stream_destroy(struct jpeg_reencode_stream* stream){
+    if(stream->has_header){
+        jpeg_destroy(&stream->jpeg);
+    }
+
+    free(stream->input);
+    stream->input = 0;
+    free(stream->header);
+    stream->header = 0;
+    free(stream->output_buffer);
+    stream->output_buffer = 0;
+}
+
+/* Pass the bytes stored so far to the callback */
+static int stream_emit(struct jpeg_reencode_stream* stream){
+    long size = stream->ostream.at - stream->output_buffer;
+    stream->ostream.at = stream->output_buffer;
+    stream->ostream.size_bytes = stream->output_buffer_size;
+
+    if(size > 0){
+        return stream->output(stream->user, stream->output_buffer, size);
+    }
+
+    return 0;
+}
+
+/* Pass all whole bytes written so far to the callback, a partial byte stays pending */
+static int stream_emit_bytes(struct jpeg_reencode_stream* stream){
+    int status = jpeg_obitstream_store_bytes(&stream->ostream);
+    if(status == E_FULL){
+        status = stream_emit(stream);
+        if(!status){
+            status = jpeg_obitstream_store_bytes(&stream->ostream);
+        }
+    }
+    if(status){
+        return status;
+    }
+
+    return stream_emit(stream);
+}
+
+/* Size of the header up to and including SOS, 0 if it has not fully arrived */
+static long stream_header_size(unsigned char* data, long size){
+    long i = 0;
+    while(i + 4 <= size){
+        if(data[i] != 0xFF || data[i + 1] == 0xFF){
+            i++;
+            continue;
+        }
+
+        uint8_t marker = data[i + 1];
+        if(marker == 0xD8 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)){
+            // No length
+            i += 2;
+            continue;
+        }
+
+        long length = data[i + 2] * 256 + data[i + 3];
+        if(marker == 0xDA){
+            return i + 2 + length <= size ? i + 2 + length : 0;
+        }
+        i += 2 + length;
+    }
+
+    return 0;
+}
+
+static int stream_start_scan(struct jpeg_reencode_stream* stream, long header_size){
+    stream->header = malloc(header_size);
+    memcpy(stream->header, stream->input, header_size);
+    memmove(stream->input, stream->input + header_size, stream->input_size - header_size);
+    stream->input_size -= header_size;
+
+    int status = jpeg_init(&stream->jpeg, header_size, stream->header);
+    if(status){
+        free(stream->header);
+        stream->header = 0;
+        return status;
+    }
+    stream->has_header = 1;
+
+    // Blocks of progressive scans are only complete at the end
+    struct jpeg* jpeg = &stream->jpeg;
+    if(jpeg->progressive){
+        return E_PROGRESSIVE;
+    }
+    jpeg_init_recompress(jpeg, &stream->requantization);
+
+    long buffer_size = jpeg_recompress_header_size(jpeg);
+    unsigned char* buffer = malloc(buffer_size);
+    long bytes_header = jpeg_write_recompress_header(jpeg, buffer, buffer_size);
+    status = bytes_header < 0 ? bytes_header : stream->output(stream->user, buffer, bytes_header);
+    free(buffer);
+
+    return status;
+}
+
+static int stream_reencode_blocks(struct jpeg_reencode_stream* stream){
+    struct jpeg* jpeg = &stream->jpeg;
+
+    while(stream->n_blocks_done < jpeg->n_blocks){
+        struct jpeg_component* component = jpeg->loop[stream->n_blocks_done % jpeg->loop_count];
+
+        int status = reencode_scan_block(jpeg, component, &stream->istream, &stream->ostream,
+                stream->dec_dc_offset, stream->enc_dc_offset);
+
+        if(status == E_FULL && stream->ostream.at > stream->output_buffer){
+            // Make room and try again
+            status = stream_emit(stream);
+            if(status){
+                return status;
+            }
+            continue;
+        }
+
+        if(status == E_EMPTY && !stream->istream.marker){
+            // Wait for the rest of the block, passing on what is written until then
+            return stream_emit_bytes(stream);
+        }
+
+        if(status){
+            return status;
+        }
+
+        stream->n_blocks_done++;
+    }
+
+    // Pad byte with ones and write EOS, making sure there is room for both
+    int status = stream_emit(stream);
+    if(!status){
+        status = jpeg_obitstream_flush(&stream->ostream);
+    }
+    if(status){
+        return status;
+    }
+    *(stream->ostream.at++) = 0xFF;
+    *(stream->ostream.at++) = 0xD9;
+    stream->done = 1;
+
+    return stream_emit(stream);
+}
+
+int jpeg_reencode_stream_feed(struct jpeg_reencode_stream* stream, unsigned char* data, long size){
+    if(stream->done){
+        return 0;
+    }
+
+    // Drop consumed input, the bits buffered in istream are kept in istream
+    if(stream->has_header){
+        long consumed = stream->istream.at - stream->input;
+        memmove(stream->input, stream->istream.at, stream->input_size - consumed);
+        stream->input_size -= consumed;
+    }
+
+    if(stream->input_size + size > stream->input_capacity){
+        stream->input_capacity = 2 * (stream->input_size + size);
+        stream->input = realloc(stream->input, stream->input_capacity);
+    }
+    memcpy(stream->input + stream->input_size, data, size);
+    stream->input_size += size;
+
+    if(!stream->has_header){
+        long header_size = stream_header_size(stream->input, stream->input_size);
+        if(!header_size){
+            return 0;
+        }
+
+        int status = stream_start_scan(stream, header_size);
+        if(status){
+            return status;
+        }
+
+        jpeg_ibitstream_init(&stream->istream, stream->input, stream->input_size);
+    }else{
+        stream->istream.at = stream->input;
+        stream->istream.size_bytes = stream->input_size;
+    }
+
+    return stream_reencode_blocks(stream);
+}
+
+int jpeg_reencode_stream_finish(struct jpeg_reencode_stream* stream){
+    return stream->done ? 0 : E_EMPTY;
+}
@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include "requantize.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define REQUANTIZE_SSE2
+#if defined(__GNUC__) && defined(__x86_64__)
+#define REQUANTIZE_AVX2
+#endif
+#endif
+
+#ifndef REQUANTIZE_SSE2
+
+static uint64_t requantize_block_scalar(const int16_t* data, int16_t* result, const uint16_t* integers, const uint32_t* fractions,
+        const uint16_t* thresholds){
+    uint64_t mask = 0;
+    for(int i=0; i<64; i++){
+        uint32_t magnitude = data[i] < 0 ? -data[i] : data[i];
+        result[i] = magnitude < thresholds[i] ? 0 : jpeg_requantize_value(data[i], integers[i], fractions[i]);
+        if(result[i]){
+            mask |= 1ULL << i;
+        }
+    }
+    return mask;
+}
+
+#else
+
+/*
+ * Vector paths work modulo 2^16 like the conversion to int16_t: the integer
+ * part is multiplied in 16 bits, only the fraction needs 32x32 -> 64 bit
+ * products
+ */
+
+/* Rounded fractional part for four magnitudes in 32-bit lanes */
+static inline __m128i fraction_sse2(__m128i magnitude, __m128i fraction){
+    __m128i half = _mm_set1_epi64x(1LL << 31);
+    __m128i even = _mm_add_epi64(_mm_mul_epu32(magnitude, fraction), half);
+    __m128i odd = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(magnitude, 32), _mm_srli_epi64(fraction, 32)), half);
+    __m128i result = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_and_si128(odd, _mm_set1_epi64x(0xFFFFFFFF00000000LL)));
+
+    // Keep the low 16 bits for packing
+    return _mm_srai_epi32(_mm_slli_epi32(result, 16), 16);
+}
+
+static uint64_t requantize_block_sse2(const int16_t* data, int16_t* result, const uint16_t* integers, const uint32_t* fractions,
+        const uint16_t* thresholds){
+    __m128i zero = _mm_setzero_si128();
+
+    // Unsigned comparison by flipping the sign bits
+    __m128i bias = _mm_set1_epi16(-0x8000);
+
+    uint64_t mask = 0;
+    for(int i=0; i<64; i+=16){
+        __m128i zeros[2];
+        for(int j=0; j<2; j++){
+            int k = i + 8*j;
+            __m128i values = _mm_loadu_si128((const __m128i*)(data + k));
+            __m128i sign = _mm_srai_epi16(values, 15);
+            __m128i magnitude = _mm_sub_epi16(_mm_xor_si128(values, sign), sign);
+            __m128i dead = _mm_cmplt_epi16(_mm_xor_si128(magnitude, bias),
+                    _mm_xor_si128(_mm_loadu_si128((const __m128i*)(thresholds + k)), bias));
+            magnitude = _mm_andnot_si128(dead, magnitude);
+
+            __m128i low = fraction_sse2(_mm_unpacklo_epi16(magnitude, zero), _mm_loadu_si128((const __m128i*)(fractions + k)));
+            __m128i high = fraction_sse2(_mm_unpackhi_epi16(magnitude, zero), _mm_loadu_si128((const __m128i*)(fractions + k + 4)));
+
+            values = _mm_add_epi16(_mm_mullo_epi16(magnitude, _mm_loadu_si128((const __m128i*)(integers + k))), _mm_packs_epi32(low, high));
+            values = _mm_sub_epi16(_mm_xor_si128(values, sign), sign);
+
+            _mm_storeu_si128((__m128i*)(result + k), values);
+            zeros[j] = _mm_cmpeq_epi16(values, zero);
+        }
+
+        uint64_t zero_mask = _mm_movemask_epi8(_mm_packs_epi16(zeros[0], zeros[1]));
+        mask |= (~zero_mask & 0xFFFF) << i;
+    }
+    return mask;
+}
+
+#endif
+
+#ifdef REQUANTIZE_AVX2
+
+__attribute__((target("avx2")))
+static inline __m256i fraction_avx2(__m256i magnitude, __m256i fraction){
+    __m256i half = _mm256_set1_epi64x(1LL << 31);
+    __m256i even = _mm256_add_epi64(_mm256_mul_epu32(magnitude, fraction), half);
+    __m256i odd = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(magnitude, 32), _mm256_srli_epi64(fraction, 32)), half);
+    __m256i result = _mm256_or_si256(_mm256_srli_epi64(even, 32), _mm256_and_si256(odd, _mm256_set1_epi64x(0xFFFFFFFF00000000LL)));
+
+    return _mm256_srai_epi32(_mm256_slli_epi32(result, 16), 16);
+}
+
+__attribute__((target("avx2")))
+static uint64_t requantize_block_avx2(const int16_t* data, int16_t* result, const uint16_t* integers, const uint32_t* fractions,
+        const uint16_t* thresholds){
+    __m256i bias = _mm256_set1_epi16(-0x8000);
+
+    uint64_t mask = 0;
+    for(int i=0; i<64; i+=16){
+        __m256i values = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i sign = _mm256_srai_epi16(values, 15);
+        __m256i magnitude = _mm256_sub_epi16(_mm256_xor_si256(values, sign), sign);
+        __m256i dead = _mm256_cmpgt_epi16(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(thresholds + i)), bias),
+                _mm256_xor_si256(magnitude, bias));
+        magnitude = _mm256_andnot_si256(dead, magnitude);
+
+        __m256i low = fraction_avx2(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(magnitude)),
+                _mm256_loadu_si256((const __m256i*)(fractions + i)));
+        __m256i high = fraction_avx2(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(magnitude, 1)),
+                _mm256_loadu_si256((const __m256i*)(fractions + i + 8)));
+
+        // Packing works per 128-bit lane, restore the order of the quarters
+        __m256i fraction = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+
+        values = _mm256_add_epi16(_mm256_mullo_epi16(magnitude, _mm256_loadu_si256((const __m256i*)(integers + i))), fraction);
+        values = _mm256_sub_epi16(_mm256_xor_si256(values, sign), sign);
+        _mm256_storeu_si256((__m256i*)(result + i), values);
+
+        __m256i zeros = _mm256_cmpeq_epi16(values, _mm256_setzero_si256());
+        uint64_t zero_mask = _mm_movemask_epi8(_mm_packs_epi16(
+                    _mm256_castsi256_si128(zeros), _mm256_extracti128_si256(zeros, 1)));
+        mask |= (~zero_mask & 0xFFFF) << i;
+    }
+    return mask;
+}
+
+#endif
+
+uint64_t jpeg_requantize_block(const int16_t* data, int16_t* result, const uint16_t* integers, const uint32_t* fractions,
+        const uint16_t* thresholds){
+#ifdef REQUANTIZE_AVX2
+    if(__builtin_cpu_supports("avx2")){
+        return requantize_block_avx2(data, result, integers, fractions, thresholds);
+    }
+#endif
+#ifdef REQUANTIZE_SSE2
+    return requantize_block_sse2(data, result, integers, fractions, thresholds);
+#else
+    return requantize_block_scalar(data, result, integers, fractions, thresholds);
+#endif
+}
@@ -0,0 +1,103 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <time.h>
+#include "jpeg.h"
+
+void jpeg_stats_init(struct jpeg_stats* stats){
+    memset(stats, 0, sizeof(struct jpeg_stats));
+}
+
+double jpeg_stats_time(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + 1.e-9 * time.tv_nsec;
+}
+
+void jpeg_stats_count_markers(unsigned char* data, long size, long* stuffed, long* restarts){
+    for(long i=0; i<size-1; i++){
+        unsigned char* ff = memchr(data + i, 0xFF, size - 1 - i);
+        if(!ff){
+            break;
+        }
+
+        i = ff - data;
+        if(data[i+1] == 0x00){
+            (*stuffed)++;
+            i++;
+        }else if(data[i+1] >= 0xD0 && data[i+1] <= 0xD7){
+            (*restarts)++;
+            i++;
+        }
+    }
+}
+
+void jpeg_stats_count_scan(unsigned char* data, long size, long* bits, long* stuffed, long* restarts){
+    long scan_stuffed = 0;
+    long scan_restarts = 0;
+    jpeg_stats_count_markers(data, size, &scan_stuffed, &scan_restarts);
+
+    *bits += 8 * (size - scan_stuffed - 2 * scan_restarts);
+    *stuffed += scan_stuffed;
+    *restarts += scan_restarts;
+}
+
+long jpeg_stats_written_bits(struct jpeg_obitstream* stream, unsigned char* from, int from_bits){
+    long bits = 0;
+    long stuffed = 0;
+    long restarts = 0;
+    jpeg_stats_count_scan(from, stream->at - from, &bits, &stuffed, &restarts);
+    return bits + stream->bits - from_bits;
+}
+
+void jpeg_stats_add(struct jpeg_stats* stats, struct jpeg_stats* from){
+    for(int i=0; i<17; i++){
+        stats->symbols[i] += from->symbols[i];
+    }
+
+    stats->bits_read += from->bits_read;
+    stats->bits_written += from->bits_written;
+    stats->stuffed_read += from->stuffed_read;
+    stats->stuffed_written += from->stuffed_written;
+    stats->restarts_read += from->restarts_read;
+    stats->restarts_written += from->restarts_written;
+    stats->eob_read += from->eob_read;
+    stats->zrl_read += from->zrl_read;
+    stats->eob_written += from->eob_written;
+    stats->zrl_written += from->zrl_written;
+    stats->zeroed += from->zeroed;
+
+    for(int i=0; i<MAX_COMPONENTS; i++){
+        stats->component_bits_read[i] += from->component_bits_read[i];
+        stats->component_bits_written[i] += from->component_bits_written[i];
+    }
+
+    stats->seconds_header += from->seconds_header;
+    stats->seconds_decode += from->seconds_decode;
+    stats->seconds_encode += from->seconds_encode;
+}
+
+void jpeg_stats_print(struct jpeg_stats* stats, FILE* f){
+    fprintf(f, "Symbols by code length:");
+    for(int i=1; i<17; i++){
+        fprintf(f, " %ld", stats->symbols[i]);
+    }
+    fprintf(f, "\n");
+
+    fprintf(f, "Bits: %ld read, %ld written\n", stats->bits_read, stats->bits_written);
+    fprintf(f, "Stuffed bytes: %ld read, %ld written\n", stats->stuffed_read, stats->stuffed_written);
+    fprintf(f, "Restart markers: %ld read, %ld written\n", stats->restarts_read, stats->restarts_written);
+    fprintf(f, "EOB: %ld read, %ld written\n", stats->eob_read, stats->eob_written);
+    fprintf(f, "ZRL: %ld read, %ld written\n", stats->zrl_read, stats->zrl_written);
+    fprintf(f, "Coefficients zeroed: %ld\n", stats->zeroed);
+
+    for(int i=0; i<MAX_COMPONENTS; i++){
+        if(stats->component_bits_read[i]){
+            fprintf(f, "Component %d: %ld bits read, %ld written\n", i + 1,
+                    stats->component_bits_read[i], stats->component_bits_written[i]);
+        }
+    }
+
+    fprintf(f, "Time: header %fms, decode %fms, encode %fms\n",
+            1000.*stats->seconds_header, 1000.*stats->seconds_decode, 1000.*stats->seconds_encode);
+}
@@ -0,0 +1,153 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+
+/* Spans kept per thread, older ones are overwritten */
+#define TRACE_SPANS 65536
+
+struct jpeg_trace_span {
+    const char* name;
+    long arg;
+    uint64_t start;
+    uint64_t end;
+};
+
+/*
+ * Written by one thread at a time without locks. A buffer is handed on to a
+ * new thread once its thread has exited, so a lane of the trace may show
+ * several short-lived workers one after another.
+ */
+struct jpeg_trace_buffer {
+    struct jpeg_trace_buffer* next;
+    int lane;
+    atomic_int in_use;
+
+    /* Spans recorded, the last TRACE_SPANS of them are in spans */
+    atomic_long n_spans;
+    struct jpeg_trace_span spans[TRACE_SPANS];
+};
+
+atomic_int jpeg_trace_active = 0;
+
+static _Atomic(struct jpeg_trace_buffer*) buffers = 0;
+static atomic_int n_lanes = 0;
+static uint64_t epoch = 0;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static _Thread_local struct jpeg_trace_buffer* current = 0;
+
+static void release_buffer(void* arg){
+    struct jpeg_trace_buffer* buffer = arg;
+    atomic_store_explicit(&buffer->in_use, 0, memory_order_release);
+}
+
+static void create_key(){
+    pthread_key_create(&key, release_buffer);
+}
+
+/* Buffer of the calling thread, 0 if none could be allocated */
+static struct jpeg_trace_buffer* thread_buffer(){
+    if(current){
+        return current;
+    }
+
+    // Take over the buffer of a thread which has exited
+    for(struct jpeg_trace_buffer* cur = atomic_load(&buffers); cur; cur = cur->next){
+        int expected = 0;
+        if(atomic_compare_exchange_strong(&cur->in_use, &expected, 1)){
+            current = cur;
+            break;
+        }
+    }
+
+    if(!current){
+        struct jpeg_trace_buffer* created = malloc(sizeof(struct jpeg_trace_buffer));
+        if(!created){
+            return 0;
+        }
+
+        created->lane = atomic_fetch_add(&n_lanes, 1);
+        atomic_init(&created->in_use, 1);
+        atomic_init(&created->n_spans, 0);
+
+        created->next = atomic_load(&buffers);
+        while(!atomic_compare_exchange_weak(&buffers, &created->next, created));
+        current = created;
+    }
+
+    pthread_once(&key_once, create_key);
+    pthread_setspecific(key, current);
+    return current;
+}
+
+uint64_t jpeg_trace_now(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return 1000000000ull * time.tv_sec + time.tv_nsec + 1;
+}
+
+void jpeg_trace_start(){
+    for(struct jpeg_trace_buffer* cur = atomic_load(&buffers); cur; cur = cur->next){
+        atomic_store(&cur->n_spans, 0);
+    }
+
+    epoch = jpeg_trace_now();
+    atomic_store(&jpeg_trace_active, 1);
+}
+
+void jpeg_trace_stop(){
+    atomic_store(&jpeg_trace_active, 0);
+}
+
+void jpeg_trace_record(const char* name, long arg, uint64_t start){
+    uint64_t end = jpeg_trace_now();
+
+    struct jpeg_trace_buffer* buffer = thread_buffer();
+    if(!buffer){
+        return;
+    }
+
+    long n = atomic_load_explicit(&buffer->n_spans, memory_order_relaxed);
+    struct jpeg_trace_span* span = buffer->spans + n % TRACE_SPANS;
+    span->name = name;
+    span->arg = arg;
+    span->start = start;
+    span->end = end;
+
+    atomic_store_explicit(&buffer->n_spans, n + 1, memory_order_release);
+}
+
+void jpeg_trace_write(FILE* f){
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    int first = 1;
+    for(struct jpeg_trace_buffer* cur = atomic_load(&buffers); cur; cur = cur->next){
+        long n = atomic_load_explicit(&cur->n_spans, memory_order_acquire);
+        if(!n){
+            continue;
+        }
+
+        fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"lane %d\"}}",
+                first ? "" : ",", cur->lane, cur->lane);
+        first = 0;
+
+        for(long i = n > TRACE_SPANS ? n - TRACE_SPANS : 0; i < n; i++){
+            struct jpeg_trace_span* span = cur->spans + i % TRACE_SPANS;
+            if(span->start < epoch){
+                // Begun before the tracer was started
+                continue;
+            }
+
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"n\":%ld}}",
+                    span->name, cur->lane,
+                    1.e-3 * (span->start - epoch), 1.e-3 * (span->end - span->start),
+                    span->arg);
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+}
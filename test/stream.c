@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "jpeg.h"
+
+/*
+ * Feeds the files given as arguments to the streaming reencoder in chunks cut
+ * at awkward places and compares the output with jpeg_reencode_huffman
+ */
+
+#define LUMA_FACTOR 2.
+#define CHROMA_FACTOR 3.
+
+static int failures = 0;
+
+#define CHECK(condition, ...) do{ \
+    if(!(condition)){ \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+        failures++; \
+    } \
+}while(0)
+
+struct output {
+    unsigned char* data;
+    long size;
+    long capacity;
+};
+
+static int collect(void* user, unsigned char* data, long size){
+    struct output* output = user;
+    if(output->size + size > output->capacity){
+        output->capacity = 2 * (output->size + size);
+        output->data = realloc(output->data, output->capacity);
+    }
+    memcpy(output->data + output->size, data, size);
+    output->size += size;
+    return 0;
+}
+
+static void requantization_init(struct jpeg_requantization* requantization){
+    jpeg_requantization_init(requantization, LUMA_FACTOR);
+    requantization->chroma_factor = CHROMA_FACTOR;
+}
+
+static long reference(unsigned char* data, long size, unsigned char** result){
+    struct jpeg jpeg;
+    if(jpeg_init(&jpeg, size, data)){
+        return E_INVALID_HEADER;
+    }
+
+    struct jpeg_requantization requantization;
+    requantization_init(&requantization);
+    jpeg_init_recompress(&jpeg, &requantization);
+
+    long buffer_size = jpeg_reencode_max_size(&jpeg);
+    *result = malloc(buffer_size);
+
+    long bytes_header = jpeg_write_recompress_header(&jpeg, *result, buffer_size);
+    long bytes_scan = bytes_header < 0 ? bytes_header : jpeg_reencode_huffman(&jpeg, *result + bytes_header, buffer_size - bytes_header);
+    jpeg_destroy(&jpeg);
+
+    return bytes_scan < 0 ? bytes_scan : bytes_header + bytes_scan;
+}
+
+/*
+ * Feed data in chunks ending at the n_cuts ascending offsets in cuts, and
+ * check the output against expected. The output received before the last
+ * chunk must go beyond the header.
+ */
+static void check_split(const char* name, const char* split, unsigned char* data, long size, long* cuts, int n_cuts,
+        unsigned char* expected, long expected_size, long header_size){
+    struct output output = { 0, 0, 0 };
+    struct jpeg_requantization requantization;
+    requantization_init(&requantization);
+
+    struct jpeg_reencode_stream stream;
+    jpeg_reencode_stream_init(&stream, &requantization, collect, &output);
+
+    int status = 0;
+    long at = 0;
+    long before_last = 0;
+    for(int i=0; i<=n_cuts && !status; i++){
+        long end = i < n_cuts ? cuts[i] : size;
+        if(end == size){
+            before_last = output.size;
+        }
+        status = jpeg_reencode_stream_feed(&stream, data + at, end - at);
+        at = end;
+        if(at == size){
+            break;
+        }
+    }
+    if(!status){
+        status = jpeg_reencode_stream_finish(&stream);
+    }
+
+    CHECK(!status, "%s, %s: status %d", name, split, status);
+    CHECK(output.size == expected_size && !memcmp(output.data, expected, expected_size),
+            "%s, %s: output differs (%ld bytes, expected %ld)", name, split, output.size, expected_size);
+    CHECK(before_last > header_size, "%s, %s: %ld bytes of output before the last chunk, header is %ld",
+            name, split, before_last, header_size);
+
+    jpeg_reencode_stream_destroy(&stream);
+    free(output.data);
+}
+
+static long header_size(unsigned char* data, long size){
+    for(long i=0; i + 1 < size; i++){
+        if(data[i] == 0xFF && data[i + 1] == 0xDA){
+            return i + 2 + data[i + 2] * 256 + data[i + 3];
+        }
+    }
+    return size;
+}
+
+static void check_file(const char* name){
+    FILE* f = fopen(name, "rb");
+    if(!f){
+        CHECK(0, "%s: could not open", name);
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char* data = malloc(size);
+    size = fread(data, 1, size, f);
+    fclose(f);
+
+    unsigned char* expected = NULL;
+    long expected_size = reference(data, size, &expected);
+    CHECK(expected_size > 0, "%s: reference failed (%ld)", name, expected_size);
+
+    long scan_start = header_size(data, size);
+    long output_header = header_size(expected, expected_size);
+    long* cuts = malloc(2 * size * sizeof(long));
+    int n_cuts;
+
+    if(expected_size > 0){
+        // Every byte on its own
+        n_cuts = 0;
+        for(long i=1; i<size; i++){
+            cuts[n_cuts++] = i;
+        }
+        check_split(name, "bytes", data, size, cuts, n_cuts, expected, expected_size, output_header);
+
+        // Between 0xFF and the byte after it: stuffing, markers and RSTn in the scan
+        n_cuts = 0;
+        for(long i=1; i<size; i++){
+            if(data[i - 1] == 0xFF){
+                cuts[n_cuts++] = i;
+            }
+        }
+        check_split(name, "after 0xFF", data, size, cuts, n_cuts, expected, expected_size, output_header);
+
+        // In front of and right after each RSTn
+        n_cuts = 0;
+        for(long i=scan_start; i + 1<size; i++){
+            if(data[i] == 0xFF && data[i + 1] >= 0xD0 && data[i + 1] <= 0xD7){
+                cuts[n_cuts++] = i;
+                cuts[n_cuts++] = i + 2;
+            }
+        }
+        if(n_cuts){
+            check_split(name, "around RSTn", data, size, cuts, n_cuts, expected, expected_size, output_header);
+        }
+
+        // In the middle of the header segments and then the scan in two halves
+        n_cuts = 0;
+        for(long i=7; i<scan_start; i+=13){
+            cuts[n_cuts++] = i;
+        }
+        cuts[n_cuts++] = scan_start + (size - scan_start) / 2;
+        check_split(name, "halves", data, size, cuts, n_cuts, expected, expected_size, output_header);
+    }
+
+    free(cuts);
+    free(expected);
+    free(data);
+}
+
+int main(int argc, char** args){
+    if(argc < 2){
+        printf("Usage: jpeg-reencode-test-stream file.jpg...\n");
+        return 1;
+    }
+
+    for(int i=1; i<argc; i++){
+        check_file(args[i]);
+    }
+
+    if(failures){
+        printf("%d failures\n", failures);
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}